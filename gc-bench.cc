@@ -0,0 +1,1119 @@
+/*
+ * gc-bench.cc
+ *
+ *  Microbenchmarks for the collectors. Build it next to the simulation:
+ *
+ *    g++ -O2 -o gc-bench gc-bench.cc ms-graph-api.cc sc-graph-api.cc \
+ *        hyb-graph-api.cc mc-graph-api.cc ix-graph-api.cc
+ *
+ *  Every benchmark is guarded the same way as the tests in main.cc.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include "ms-graph-api.h"
+#include "sc-graph-api.h"
+#include "hyb-graph-api.h"
+#include "mc-graph-api.h"
+#include "ix-graph-api.h"
+#include "gc-collector.h"
+#include "gc-trace.h"
+
+
+//#define CANCELMSALLOCBENCH // comment if you want to run MS alloc/free bench
+//#define CANCELMARKBENCH // comment if you want to run the mark throughput bench
+//#define CANCELSWEEPBENCH // comment if you want to run the eager/lazy sweep bench
+//#define CANCELPARMARKBENCH // comment if you want to run the parallel mark bench
+//#define CANCELPARCOPYBENCH // comment if you want to run the parallel copy bench
+//#define CANCELCARDBENCH // comment if you want to run the card table bench
+//#define CANCELPROMOTEBENCH // comment if you want to run the hybrid promotion bench
+//#define CANCELTENUREBENCH // comment if you want to run the adaptive tenuring bench
+//#define CANCELSITEBENCH // comment if you want to run the allocation-site pretenuring bench
+//#define CANCELROOTBENCH // comment if you want to run the root table bench
+//#define CANCELCMBENCH // comment if you want to run the concurrent/incremental mark bench
+//#define CANCELTYPEDBENCH // comment if you want to run the typed object copy bench
+//#define CANCELTLABBENCH // comment if you want to run the hybrid TLAB bench
+//#define CANCELSAFEPOINTBENCH // comment if you want to run the safepoint bench
+//#define CANCELCOMPACTBENCH // comment if you want to run the full-heap collector bench
+//#define CANCELREGIONBENCH // comment if you want to run the mark-region allocation bench
+//#define CANCELSIZINGBENCH // comment if you want to run the heap sizing bench
+//#define CANCELTRACEBENCH // comment if you want to run the trace replay bench
+//#define CANCELEVENTBENCH // comment if you want to run the collection event log bench
+
+
+using namespace std;
+
+// Seconds elapsed since "start", measured with a monotonic clock.
+static double Elapsed(chrono::steady_clock::time_point start) {
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// Bytes of mark-sweep heap that hold "objects" plain objects. A page does
+// not divide evenly into slots, so a little over their size is needed.
+static size_t MSHeapBytes(int objects) {
+	return size_t(objects) * sizeof(ms_graph_api::Object) * 8 / 7;
+}
+
+// The mark-sweep heap as it used to be: every object is a separate new,
+// linked through its child at the end of a first/last list, and the sweep
+// walks the list and deletes each object on its own. Kept here only as the
+// baseline for the slab allocator.
+struct LegacyMSHeap {
+	ms_graph_api::Object* first;
+	ms_graph_api::Object* last;
+
+	LegacyMSHeap() {
+		first = NULL;
+		last = NULL;
+	}
+
+	void New(const string& desc) {
+		ms_graph_api::Object* obj = new ms_graph_api::Object(desc);
+		if (first == NULL) first = obj; else last->child = obj;
+		last = obj;
+	}
+
+	void SweepAll() {
+		while (first != NULL) {
+			ms_graph_api::Object* obsolete = first;
+			first = first->child;
+			delete obsolete;
+		}
+		last = NULL;
+	}
+};
+
+// The marker as it used to be, one native stack frame per object. Only safe
+// while the chain fits in the native stack.
+static void RecursiveMark(ms_graph_api::MSGraphUtil& msgc,
+                          ms_graph_api::Object* root) {
+	if (root == NULL) return;
+	gc_bitmap::Set(msgc.mark_bits, msgc.Slot(root));
+	RecursiveMark(msgc, root->child);
+}
+
+// Builds a single chain of "depth" objects hanging off one root.
+static void BuildChain(ms_graph_api::MSGraphUtil& msgc, int depth) {
+	msgc.NewReference("root");
+	ms_graph_api::Object* obj = msgc.roots.back();
+	for (int i = 1; i < depth; i++) {
+		obj = msgc.New("", obj);
+	}
+}
+
+// Marks the heap "rounds" times and returns marked objects per second.
+// The full sweep that clears the mark bitmap between rounds is not timed;
+// Sweep() alone only finishes a pending sweep and would leave it set.
+static double MarkThroughput(ms_graph_api::MSGraphUtil& msgc, int rounds,
+                             bool recursive) {
+	double secs = 0;
+	for (int r = 0; r < rounds; r++) {
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		for (int i = 0; i < int(msgc.roots.size()); i++) {
+			if (recursive) RecursiveMark(msgc, msgc.roots[i]); else msgc.DFSMark(msgc.roots[i]);
+		}
+		secs += Elapsed(start);
+		msgc.StartSweep();
+		msgc.Sweep();
+	}
+	return double(msgc.num_objects) * rounds / secs;
+}
+
+// Allocation-heavy churn: keeps a window of "live" roots and drops a
+// pseudo-random one for every allocation past it; every other allocation
+// hangs a child off a random root, overwriting its old child. Every
+// allocation is timed, collections included, and the latency distribution
+// is printed along with the longest pause the collector itself recorded.
+// "budget" and "budget_us" set the step size of the incremental mode.
+static void AllocationPauses(const char* label, bool lazy, ms_graph_api::MarkMode mode,
+                             int heap_size, int live, int allocations,
+                             int budget = 0, int budget_us = 0) {
+	ms_graph_api::MSGraphUtil msgc(MSHeapBytes(heap_size));
+	msgc.lazy_sweep = lazy;
+	msgc.mark_mode = mode;
+	if (budget > 0) msgc.inc_budget = budget;
+	msgc.inc_budget_us = budget_us;
+	vector <double> pauses;
+	pauses.reserve(allocations);
+	unsigned int seed = 12345;
+
+	for (int i = 0; i < allocations; i++) {
+		seed = seed * 1103515245 + 12345;
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		if (i % 2 == 0 || msgc.roots.empty()) {
+			msgc.NewReference("");
+		} else {
+			msgc.New("", msgc.roots[(seed >> 8) % msgc.roots.size()]);
+		}
+		pauses.push_back(Elapsed(start));
+
+		if (int(msgc.roots.size()) > live) {
+			int victim = (seed >> 4) % msgc.roots.size();
+			msgc.EndLifetime(msgc.roots.HandleAt(victim));
+		}
+	}
+
+	double total = 0;
+	for (int i = 0; i < int(pauses.size()); i++) total += pauses[i];
+	sort(pauses.begin(), pauses.end());
+	cout << label
+	     << "p50 " << pauses[pauses.size() / 2] * 1e6 << " us, "
+	     << "p99 " << pauses[pauses.size() * 99 / 100] * 1e6 << " us, "
+	     << "p99.99 " << pauses[pauses.size() * 9999 / 10000] * 1e6 << " us, "
+	     << "max " << pauses.back() * 1e6 << " us, "
+	     << "total " << total * 1e3 << " ms, "
+	     << "GC max pause " << msgc.max_pause_us << " us";
+	if (mode == ms_graph_api::INCREMENTAL_MARK) {
+		cout << ", " << msgc.full_collections << " full collections";
+	}
+	cout << "\n";
+}
+
+// Builds "chains" chains of "depth" objects each and times a full
+// collection (everything is live, so it is all marking) with 1 to 16 GC
+// threads.
+static void ParallelMarkScaling(const char* shape, int chains, int depth) {
+	cout << shape << " (" << chains << " x " << depth << "):";
+	for (int threads = 1; threads <= 16; threads *= 2) {
+		ms_graph_api::MSGraphUtil msgc(MSHeapBytes(chains * depth));
+		msgc.gc_threads = threads;
+		for (int c = 0; c < chains; c++) {
+			msgc.NewReference("root");
+			ms_graph_api::Object* obj = msgc.roots.back();
+			for (int i = 1; i < depth; i++) {
+				obj = msgc.New("", obj);
+			}
+		}
+
+		const int rounds = 5;
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		for (int r = 0; r < rounds; r++) {
+			msgc.TriggerGC();
+		}
+		cout << "  " << threads << "t " << Elapsed(start) / rounds * 1e3 << " ms";
+	}
+	cout << endl;
+}
+
+// Copies a live set of "chains" chains of "depth" objects with 1 to 16 GC
+// threads and prints the pause with the per-thread split of the work.
+static void ParallelCopyScaling(int chains, int depth) {
+	cout << "live set " << chains << " x " << depth << ":\n";
+	for (int threads = 1; threads <= 16; threads *= 2) {
+		sc_graph_api::SCGraphUtil scgc((chains * depth + chains) * sizeof(sc_graph_api::Object));
+		scgc.gc_threads = threads;
+		for (int c = 0; c < chains; c++) {
+			scgc.NewReference("root");
+			sc_graph_api::Object* obj = scgc.roots.back();
+			for (int i = 1; i < depth; i++) {
+				obj = scgc.New("", obj);
+			}
+		}
+
+		const int rounds = 5;
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		for (int r = 0; r < rounds; r++) {
+			scgc.TriggerGC();
+		}
+		cout << threads << "t pause " << Elapsed(start) / rounds * 1e3 << " ms";
+		if (threads > 1) {
+			long total = 0, busiest = 0;
+			for (int id = 0; id < threads; id++) {
+				total += scgc.copied_bytes[id];
+				busiest = max(busiest, scgc.copied_bytes[id]);
+			}
+			cout << ", imbalance " << busiest / (double(total) / threads)
+			     << ", PLAB waste " << scgc.plab_waste << " bytes";
+		}
+		cout << endl;
+	}
+}
+
+// Builds a complete binary tree of TreeNodes, "depth" levels deep, and
+// returns its root. The new nodes are kept reachable from "hold" while the
+// tree grows, since an allocation may collect and move them.
+static sc_graph_api::Object* BuildTree(sc_graph_api::SCGraphUtil& scgc, int depth) {
+	gc_roots::RootHandle hold = scgc.roots.Add(NULL);
+	sc_graph_api::TreeNode* node = scgc.NewObject<sc_graph_api::TreeNode>("");
+	scgc.roots.Set(hold, node);
+	if (depth > 1) {
+		sc_graph_api::Object* left = BuildTree(scgc, depth - 1);
+		((sc_graph_api::TreeNode*)scgc.roots.Get(hold))->refs[0] = left;
+		sc_graph_api::Object* right = BuildTree(scgc, depth - 1);
+		((sc_graph_api::TreeNode*)scgc.roots.Get(hold))->refs[1] = right;
+	}
+	sc_graph_api::Object* tree = scgc.roots.Get(hold);
+	scgc.roots.Remove(hold);
+	return tree;
+}
+
+// Copies a live set of typed objects with 1 to 16 GC threads: a binary
+// tree "depth" levels deep and a hash map of "entries" MapEntries in one
+// reference array of "buckets" buckets, which the threads split into
+// chunks.
+static void TypedCopyScaling(int depth, int buckets, int entries) {
+	cout << "tree of depth " << depth << ", map of " << entries << " entries in "
+	     << buckets << " buckets:\n";
+	for (int threads = 1; threads <= 16; threads *= 2) {
+		sc_graph_api::SCGraphUtil scgc((size_t(3) << depth) * sizeof(sc_graph_api::Object));
+		scgc.gc_threads = threads;
+		scgc.roots.Add(BuildTree(scgc, depth));
+		gc_roots::RootHandle map = scgc.roots.Add(scgc.NewArray("map", buckets));
+		for (int i = 0; i < entries; i++) {
+			sc_graph_api::MapEntry* entry = scgc.NewObject<sc_graph_api::MapEntry>("");
+			sc_graph_api::RefArray* table = (sc_graph_api::RefArray*)scgc.roots.Get(map);
+			entry->child = table->Elems()[i % buckets];
+			table->Elems()[i % buckets] = entry;
+		}
+
+		const int rounds = 5;
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		for (int r = 0; r < rounds; r++) {
+			scgc.TriggerGC();
+		}
+		cout << threads << "t pause " << Elapsed(start) / rounds * 1e3 << " ms";
+		if (threads > 1) {
+			cout << ", PLAB waste " << scgc.plab_waste << " bytes";
+		}
+		cout << endl;
+	}
+}
+
+// Fills a hybrid mark-sweep heap with "old_size" live objects, kept alive
+// by a few chains so the roots stay few, hangs one young object into the
+// chain after every "stride"-th of them and times a few stop-copy
+// collections. Only the dirty cards are scanned, so the card scan and the
+// minor pause should follow the number of old-to-young pointers and stay
+// flat as the old heap grows. Both heaps have room to spare, so the young
+// objects are not promoted and no full collection gets in the way.
+static void CardScanCost(int old_size, int stride) {
+	const int chains = 4;
+	hyb_graph_api::HybGraphUtil gc(2 * old_size * sizeof(hyb_graph_api::Object),
+	                               4 * (old_size / stride) * sizeof(hyb_graph_api::Object), 1000);
+	vector <hyb_graph_api::Object*> strided;
+	hyb_graph_api::Object* obj = NULL;
+	for (int i = 0; i < old_size; i++) {
+		if (i % (old_size / chains) == 0) {
+			obj = gc.roots.Get(gc.MSNewReference(""));
+		} else {
+			obj = gc.MSNew("", obj);
+		}
+		if (i % stride == 0) strided.push_back(obj);
+	}
+	for (int i = 0; i < int(strided.size()); i++) {
+		hyb_graph_api::Object* next = strided[i]->child;
+		hyb_graph_api::Object* young = gc.New("", strided[i]);
+		gc.WriteReference(young, next);
+	}
+
+	const int rounds = 5;
+	double pause = 0, scan = 0;
+	for (int r = 0; r < rounds; r++) {
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		gc.SCTriggerGC();
+		pause += Elapsed(start);
+		scan += gc.card_scan_us;
+	}
+	cout << "old heap " << old_size << ": " << gc.dirty_cards << " dirty cards, "
+	     << "card scan " << scan / rounds << " us, minor pause "
+	     << pause / rounds * 1e6 << " us, survivors " << gc.SCNumObjects() << endl;
+}
+
+// Fills the hybrid stop-copy heap with "roots" chains of "depth" objects
+// and collects until all of them have been promoted. The survivors fill
+// the nursery, so the threshold drops and the second collection promotes
+// them. Prints the cost per promoted object of the collection that did.
+static void PromotionCost(int roots, int depth) {
+	const int threshold = 2;
+	hyb_graph_api::HybGraphUtil gc(roots * depth * sizeof(hyb_graph_api::Object),
+	                               roots * depth * sizeof(hyb_graph_api::Object), threshold);
+	for (int c = 0; c < roots; c++) {
+		gc.NewReference("root");
+		hyb_graph_api::Object* obj = gc.roots.back();
+		for (int i = 1; i < depth; i++) {
+			obj = gc.New("", obj);
+		}
+	}
+	double secs = 0;
+	while (gc.SCNumObjects() > 0) {
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		gc.SCTriggerGC();
+		secs = Elapsed(start);
+	}
+	cout << roots << " x " << depth << ": promoted " << gc.num_objects << " objects, "
+	     << secs / gc.num_objects * 1e9 << " ns per object\n";
+}
+
+// Allocates roots in a hybrid heap with a 4096-object nursery, starting
+// from a tenuring threshold of 1. One in eight of them stays live for the
+// next "lifetime" allocations, the rest die at once. Prints the threshold
+// the first stop-copy collections chose, the one it settled on, and how
+// much was promoted in all.
+static void TenuringConvergence(int lifetime) {
+	hyb_graph_api::HybGraphUtil gc((lifetime / 8 + 4096) * sizeof(hyb_graph_api::Object),
+	                               4096 * sizeof(hyb_graph_api::Object), 1);
+	gc_roots::RootHandle none = { -1, 0 };
+	vector <gc_roots::RootHandle> live(lifetime / 8, none);
+	for (int i = 0; i < 64 * lifetime + (1 << 20); i++) {
+		gc_roots::RootHandle handle = gc.NewReference("");
+		if (i % 8 != 0) {
+			gc.EndLifetime(handle);
+			continue;
+		}
+		gc_roots::RootHandle& slot = live[i / 8 % live.size()];
+		gc.EndLifetime(slot);
+		slot = handle;
+	}
+
+	size_t promoted = 0;
+	cout << "lifetime " << lifetime << ": threshold";
+	for (int i = 0; i < int(gc.tenuring_log.size()); i++) {
+		if (i < 8) cout << " " << gc.tenuring_log[i].threshold;
+		promoted += gc.tenuring_log[i].promoted;
+	}
+	cout << " ... " << gc.threshold << " after " << gc.tenuring_log.size() << " cycles, "
+	     << promoted << " bytes promoted\n";
+}
+
+// Allocates a stream of objects in a hybrid heap with a 1024-object
+// nursery: one in four is kept among the last "kept" of them, the rest
+// die at once. The two kinds come from allocation sites of their own if
+// "sites" is set, and from no site otherwise. Returns the time per
+// allocation, and the bytes copied through the nursery in "copied".
+static double SiteRun(int kept, bool sites, size_t& copied) {
+	hyb_graph_api::HybGraphUtil gc((kept + 1024) * 2 * sizeof(hyb_graph_api::Object),
+	                               1024 * sizeof(hyb_graph_api::Object), 3);
+	int long_site = sites ? gc.AllocationSiteId("long") : -1;
+	int short_site = sites ? gc.AllocationSiteId("short") : -1;
+	gc_roots::RootHandle none = { -1, 0 };
+	vector <gc_roots::RootHandle> live(kept, none);
+
+	const int allocations = 1 << 20;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	for (int i = 0; i < allocations; i++) {
+		if (i % 4 == 0) {
+			gc_roots::RootHandle& slot = live[i / 4 % kept];
+			gc.EndLifetime(slot);
+			slot = gc.NewReference("", long_site);
+		} else {
+			gc.EndLifetime(gc.NewReference("", short_site));
+		}
+	}
+	double secs = Elapsed(start);
+
+	copied = 0;
+	for (int i = 0; i < int(gc.tenuring_log.size()); i++) {
+		copied += gc.tenuring_log[i].survived + gc.tenuring_log[i].promoted;
+	}
+	return secs / allocations;
+}
+
+// SiteRun() with and without allocation sites.
+static void PretenuringCost(int kept) {
+	size_t plain_copied, site_copied;
+	double plain = SiteRun(kept, false, plain_copied);
+	double site = SiteRun(kept, true, site_copied);
+	cout << kept << " kept: no sites " << plain * 1e9 << " ns, " << plain_copied
+	     << " bytes copied; sites " << site * 1e9 << " ns, " << site_copied << " bytes copied\n";
+}
+
+// Registers "count" roots and ends them again in pseudo-random order,
+// once with the root table and once the way the roots vector used to do it
+// (find, then erase from the middle). Prints the time per root.
+static void RootChurn(int count) {
+	ms_graph_api::MSGraphUtil msgc(MSHeapBytes(count));
+	vector <gc_roots::RootHandle> handles;
+	vector <ms_graph_api::Object*> legacy;
+	for (int i = 0; i < count; i++) {
+		handles.push_back(msgc.NewReference(""));
+		legacy.push_back(msgc.roots.back());
+	}
+	vector <ms_graph_api::Object*> order(legacy);
+	unsigned int seed = 12345;
+	for (int i = count - 1; i > 0; i--) {
+		seed = seed * 1103515245 + 12345;
+		int j = (seed >> 8) % (i + 1);
+		swap(handles[i], handles[j]);
+		swap(order[i], order[j]);
+	}
+
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	for (int i = 0; i < count; i++) {
+		msgc.EndLifetime(handles[i]);
+	}
+	double table_secs = Elapsed(start);
+
+	start = chrono::steady_clock::now();
+	for (int i = 0; i < count; i++) {
+		legacy.erase(find(legacy.begin(), legacy.end(), order[i]));
+	}
+	double vector_secs = Elapsed(start);
+
+	cout << count << " roots: table " << table_secs / count * 1e9 << " ns, "
+	     << "vector " << vector_secs / count * 1e9 << " ns per EndLifetime\n";
+}
+
+// One mutator thread of NurseryThroughput(): allocates garbage in its
+// TLAB until the nursery is full. "spin" is busy work between allocations,
+// to make some threads allocate more slowly than others.
+static void NurseryWorker(hyb_graph_api::HybGraphUtil* gc, hyb_graph_api::Tlab* tlab,
+                          int spin, long* count) {
+	volatile unsigned int sink = 0;
+	long n = 0;
+	while (gc->SCAllocate(*tlab, "") != NULL) {
+		n++;
+		for (int i = 0; i < spin; i++) sink += i;
+	}
+	*count = n;
+}
+
+// Allocates in the hybrid nursery from "threads" threads at once, every
+// other one at a slower rate, until the nursery is full, then collects and
+// goes again for "rounds" rounds. With "one_object" every TLAB holds one
+// object, so each allocation takes the nursery lock, as a shared bump
+// pointer would. Prints allocations per second over the allocation phases
+// and, for adaptive TLABs, the refills per thread per round and the range
+// of TLAB sizes the threads ended up with.
+static void NurseryThroughput(int threads, int rounds, bool one_object) {
+	const int nursery = 1 << 16;
+	hyb_graph_api::HybGraphUtil gc(64 * sizeof(hyb_graph_api::Object),
+	                               nursery * sizeof(hyb_graph_api::Object), 1000);
+	vector <hyb_graph_api::Tlab*> tlabs;
+	for (int id = 0; id < threads; id++) {
+		tlabs.push_back(gc.AddTlab());
+	}
+
+	double secs = 0;
+	long allocations = 0;
+	vector <long> counts(threads);
+	for (int r = 0; r < rounds; r++) {
+		if (one_object) {
+			for (int id = 0; id < threads; id++) {
+				tlabs[id]->size = sizeof(hyb_graph_api::Object);
+			}
+		}
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		vector <thread> workers;
+		for (int id = 0; id < threads; id++) {
+			workers.push_back(thread(NurseryWorker, &gc, tlabs[id], (id % 2) * 64, &counts[id]));
+		}
+		for (int id = 0; id < threads; id++) {
+			workers[id].join();
+			allocations += counts[id];
+		}
+		secs += Elapsed(start);
+		gc.SCTriggerGC();
+	}
+
+	cout << "  " << (one_object ? "lock per object: " : "adaptive TLABs:  ")
+	     << allocations / secs / 1e6 << " Mallocs/s";
+	if (!one_object) {
+		long refills = 0;
+		size_t smallest = tlabs[0]->size, largest = tlabs[0]->size;
+		for (int id = 0; id < threads; id++) {
+			refills += tlabs[id]->refills;
+			smallest = min(smallest, tlabs[id]->size);
+			largest = max(largest, tlabs[id]->size);
+		}
+		cout << ", " << double(refills) / threads / rounds << " refills per thread per round"
+		     << ", TLAB " << smallest << " to " << largest << " bytes";
+	}
+	cout << endl;
+}
+
+// One mutator thread of SafepointLatency(): keeps its last few objects
+// alive as roots of its own and, between allocations, does "work" units of
+// busy work with a safepoint poll every "poll" units.
+static void SafepointWorker(sc_graph_api::SCGraphUtil* gc, int allocations, int work, int poll) {
+	sc_graph_api::Mutator* mutator = gc->AttachMutator();
+	volatile unsigned int sink = 0;
+	vector <gc_roots::RootHandle> live;
+	for (int n = 0; n < allocations; n++) {
+		live.push_back(gc->NewReference("", mutator));
+		if (live.size() > 32) {
+			mutator->roots.Remove(live.front());
+			live.erase(live.begin());
+		}
+		for (int i = 0; i < work; i++) {
+			sink += i;
+			if ((i + 1) % poll == 0) gc->Safepoint();
+		}
+	}
+	gc->DetachMutator(mutator);
+}
+
+// Runs "threads" attached mutators on a small semi-space heap, so that
+// they collect often, and prints how long stopping the world took against
+// how long it stayed stopped. Threads that poll rarely keep the others
+// waiting at the safepoint for longer.
+static void SafepointLatency(int threads, int poll) {
+	sc_graph_api::SCGraphUtil gc(threads * 128 * sizeof(sc_graph_api::Object));
+	vector <thread> workers;
+	for (int id = 0; id < threads; id++) {
+		workers.push_back(thread(SafepointWorker, &gc, 2000, 1 << 14, poll));
+	}
+	for (int id = 0; id < threads; id++) {
+		workers[id].join();
+	}
+	cout << threads << " threads, poll every " << poll << ": " << gc.safepoints.stops << " stops, "
+	     << gc.safepoints.ttsp_total_us / max(gc.safepoints.stops, 1L) << " us to safepoint (max "
+	     << gc.safepoints.ttsp_max_us << "), "
+	     << gc.safepoints.pause_total_us / max(gc.safepoints.stops, 1L) << " us stopped\n";
+}
+
+// Fills the heap with "objects" roots, ends all but every "keep"-th one
+// so the survivors are spread out over it, and times one collection.
+template <class GC>
+static double FullHeapCollection(GC& gc, int objects, int keep) {
+	for (int i = 0; i < objects; i++) {
+		gc_roots::RootHandle handle = gc.NewReference("");
+		if (i % keep != 0) gc.EndLifetime(handle);
+	}
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	gc.TriggerGC();
+	return Elapsed(start);
+}
+
+// The three full-heap collectors on the same scattered live set: the time
+// one collection takes and the memory each reserves for "objects" objects.
+static void FullHeapCost(int objects, int keep) {
+	ms_graph_api::MSGraphUtil msgc(MSHeapBytes(objects));
+	sc_graph_api::SCGraphUtil scgc(objects * sizeof(sc_graph_api::Object));
+	mc_graph_api::MCGraphUtil mcgc(objects * sizeof(mc_graph_api::Object));
+	ix_graph_api::IXGraphUtil ixgc(objects * sizeof(ix_graph_api::Object) * 8 / 7);
+	double ms_secs = FullHeapCollection(msgc, objects, keep);
+	double sc_secs = FullHeapCollection(scgc, objects, keep);
+	double mc_secs = FullHeapCollection(mcgc, objects, keep);
+	double ix_secs = FullHeapCollection(ixgc, objects, keep);
+	cout << objects << " objects, 1 in " << keep << " live:\n"
+	     << "  mark-sweep:   " << ms_secs * 1e3 << " ms, " << msgc.max_bytes << " bytes reserved\n"
+	     << "  stop-copy:    " << sc_secs * 1e3 << " ms, " << 2 * scgc.max_bytes << " bytes reserved\n"
+	     << "  mark-compact: " << mc_secs * 1e3 << " ms, " << mcgc.max_bytes << " bytes reserved, "
+	     << mcgc.moved_bytes << " bytes moved\n"
+	     << "  mark-region:  " << ix_secs * 1e3 << " ms, " << ixgc.max_bytes << " bytes reserved, "
+	     << ixgc.evacuated_bytes << " bytes evacuated\n";
+}
+
+// Allocates objects of 56 to 56 + 8 * "spread" bytes until the heap is
+// full, keeping every "keep"-th of them as a root, collects, then times
+// filling the heap up again around the survivors: from the size class
+// free lists in the mark-sweep heap, by bumping through holes in the
+// mark-region heap. Returns the time per allocation of the refill, 0 if
+// the collection left no room at all.
+template <class GC>
+static double RefillCost(GC& gc, int keep, int spread) {
+	unsigned int seed = 12345;
+	for (int i = 0; ; i++) {
+		seed = seed * 1103515245 + 12345;
+		auto obj = gc.Allocate("", 56 + 8 * ((seed >> 8) % (spread + 1)));
+		if (obj == NULL) break;
+		if (i % keep == 0) gc.NewReference(obj);
+	}
+	gc.TriggerGC();
+
+	long allocations = 0;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	while (gc.Allocate("", 56 + 8 * ((seed >> 8) % (spread + 1))) != NULL) {
+		seed = seed * 1103515245 + 12345;
+		allocations++;
+	}
+	return allocations ? Elapsed(start) / allocations : 0;
+}
+
+// RefillCost() for mark-sweep and mark-region on heaps of the same size.
+static void RegionRefill(int keep, int spread) {
+	ms_graph_api::MSGraphUtil msgc(1 << 24);
+	ix_graph_api::IXGraphUtil ixgc(1 << 24);
+	double ms_secs = RefillCost(msgc, keep, spread);
+	double ix_secs = RefillCost(ixgc, keep, spread);
+	cout << "1 in " << keep << " live, sizes 56 to " << 56 + 8 * spread << ": mark-sweep "
+	     << ms_secs * 1e9 << " ns per allocation, mark-region ";
+	if (ix_secs > 0) cout << ix_secs * 1e9 << " ns per allocation"; else cout << "no free lines";
+	cout << ", " << ixgc.recyclable_count << " recyclable blocks\n";
+}
+
+// Churns through roots, keeping "live" of them among the most recent,
+// then only one in 16 of those. Returns the time per allocation, with the
+// heap size at the end of the first phase in "peak".
+template <class GC>
+static double SizingRun(GC& gc, int live, size_t& peak) {
+	const int allocations = 1 << 20;
+	gc_roots::RootHandle none = { -1, 0 };
+	vector <gc_roots::RootHandle> ring(live, none);
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	for (int i = 0; i < allocations; i++) {
+		gc_roots::RootHandle& slot = ring[i % live];
+		gc.EndLifetime(slot);
+		slot = gc.NewReference("");
+	}
+	peak = gc.max_bytes;
+	for (int i = live / 16; i < live; i++) {
+		gc.EndLifetime(ring[i]);
+	}
+	for (int i = 0; i < allocations; i++) {
+		gc_roots::RootHandle& slot = ring[i % (live / 16)];
+		gc.EndLifetime(slot);
+		slot = gc.NewReference("");
+	}
+	return Elapsed(start) / (2 * allocations);
+}
+
+// SizingRun() on a heap fixed at room for four times the live set, and on
+// one that starts at 64 KB and may grow to that size.
+template <class GC>
+static void HeapSizing(const char* name, size_t max_bytes, int live) {
+	size_t fixed_peak, sized_peak;
+	GC fixed(max_bytes);
+	GC sized(1 << 16, max_bytes);
+	double fixed_secs = SizingRun(fixed, live, fixed_peak);
+	double sized_secs = SizingRun(sized, live, sized_peak);
+	cout << name << live << " live: fixed " << fixed_secs * 1e9 << " ns, " << fixed_peak
+	     << " bytes; sized " << sized_secs * 1e9 << " ns, " << sized_peak << " bytes, then "
+	     << sized.max_bytes << ", " << sized.sizing.grows << " grows, " << sized.sizing.shrinks
+	     << " shrinks\n";
+}
+
+// The object "depth" child links below "obj" in the churn trace's model of
+// the heap, where child[obj] is obj's child or -1.
+static int ChainAt(const vector <int>& child, int obj, int depth) {
+	for (int i = 0; i < depth; i++) obj = child[obj];
+	return obj;
+}
+
+// Length of the chain starting at "obj", counted up to "limit" objects.
+// Chains are shared once a store links one root's chain into another's,
+// and can loop.
+static int ChainLength(const vector <int>& child, int obj, int limit) {
+	int length = 1;
+	while (length < limit && child[obj] >= 0) {
+		obj = child[obj];
+		length++;
+	}
+	return length;
+}
+
+// Writes a trace of "allocations" allocations to "path": a window of
+// "live" roots, each with a chain of objects hanging off it. Most
+// allocations extend or cut a chain, one in four replaces a root, and now
+// and then a chain is linked into another or cut off with a store. Sizes
+// vary from 56 to 80 bytes and each kind of allocation has its own site.
+// The generator keeps the child link of every object it has created, so
+// a store that shares a chain, and a later cut through the shared part,
+// leave every chain's length right and each event names an object the
+// replay has. Returns the number of events written.
+static long WriteChurnTrace(const char* path, long allocations, int live) {
+	gc_trace::TraceWriter trace;
+	if (!trace.Open(path)) return 0;
+	vector <int> window(live), held(live), child;
+	for (int i = 0; i < live; i++) {
+		window[i] = trace.NewReference(56, 0);
+		held[i] = int(child.size());
+		child.push_back(-1);
+	}
+	unsigned int seed = 12345;
+	for (long i = 0; i < allocations; i++) {
+		seed = seed * 1103515245 + 12345;
+		int r = (seed >> 8) % live;
+		size_t size = 56 + 8 * ((seed >> 4) % 4);
+		switch ((seed >> 24) % 8) {
+		case 0:
+		case 1:
+			trace.EndLifetime(window[r]);
+			window[r] = trace.NewReference(size, 0);
+			held[r] = int(child.size());
+			child.push_back(-1);
+			break;
+		case 7: {
+			int other = (seed >> 12) % live;
+			if (other == r || (seed & 1)) {
+				trace.WriteReference(window[r], 0, -1, 0);
+				child[held[r]] = -1;
+			} else {
+				trace.WriteReference(window[r], 0, window[other], 0);
+				child[held[r]] = held[other];
+			}
+			// the store comes with an allocation
+		}
+		// fall through
+		default: {
+			int depth = min(ChainLength(child, held[r], 4) - 1, int((seed >> 16) % 4));
+			trace.New(window[r], depth, size, 1 + depth);
+			child[ChainAt(child, held[r], depth)] = int(child.size());
+			child.push_back(-1);
+			break;
+		}
+		}
+	}
+	long events = trace.events;
+	return trace.Close() ? events : 0;
+}
+
+// Replays the whole trace on "gc" and prints the time per event.
+template <class GC>
+static void ReplayCost(GC& gc, gc_trace::TraceReader& trace) {
+	trace.Rewind();
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	long skipped;
+	long events = gc_trace::Replay(gc, trace, skipped);
+	double secs = Elapsed(start);
+	cout << "  " << gc.Name() << ": " << events << " events, " << secs / events * 1e9
+	     << " ns per event, " << skipped << " skipped\n";
+}
+
+// WriteChurnTrace() once, then the cost of decoding it alone and of
+// replaying it on each collector.
+static void TraceReplay(long allocations, int live) {
+	const char* path = "gc-bench.trace";
+	long written = WriteChurnTrace(path, allocations, live);
+	gc_trace::TraceReader trace;
+	if (written == 0 || !trace.Open(path)) return;
+
+	gc_trace::TraceEvent e;
+	long events = 0;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	while (trace.Next(e)) events++;
+	double secs = Elapsed(start);
+	cout << events << " events, " << double(trace.Bytes()) / events << " bytes per event, decoded at "
+	     << trace.Bytes() / secs / 1e6 << " MB/s\n";
+
+	{ gc_collector::Collector<gc_collector::MarkSweep> gc(1 << 24); ReplayCost(gc, trace); }
+	{ gc_collector::Collector<gc_collector::StopCopy> gc(1 << 24); ReplayCost(gc, trace); }
+	{ gc_collector::Collector<gc_collector::Hybrid> gc(1 << 24, 1 << 22, 3); ReplayCost(gc, trace); }
+	{ gc_collector::Collector<gc_collector::MarkCompact> gc(1 << 24); ReplayCost(gc, trace); }
+	{ gc_collector::Collector<gc_collector::MarkRegion> gc(1 << 24); ReplayCost(gc, trace); }
+	trace.Close();
+	unlink(path);
+}
+
+// Times "rounds" small collections on "gc", each after "objects" roots
+// have come and gone, and returns the time per collection.
+template <class GC>
+static double SmallCollections(GC& gc, int rounds, int objects) {
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	for (int r = 0; r < rounds; r++) {
+		for (int i = 0; i < objects; i++) {
+			gc.EndLifetime(gc.NewReference(""));
+		}
+		gc.TriggerGC();
+	}
+	return Elapsed(start) / rounds;
+}
+
+// The cost of the event log on collections that take a few microseconds:
+// the same run with the log off and on, and the last event as JSON.
+static void EventLogCost(int rounds, int objects) {
+	ms_graph_api::MSGraphUtil off(MSHeapBytes(objects));
+	ms_graph_api::MSGraphUtil on(MSHeapBytes(objects));
+	on.events.Enable(rounds);
+	double off_secs = SmallCollections(off, rounds, objects);
+	double on_secs = SmallCollections(on, rounds, objects);
+	cout << "  log off: " << off_secs * 1e6 << " us per collection\n"
+	     << "  log on:  " << on_secs * 1e6 << " us per collection\n";
+
+	gc_events::Event e;
+	long logged = 0;
+	while (on.events.Pop(e)) logged++;
+	cout << "  " << logged << " events logged, " << on.events.Dropped() << " dropped, last:\n  ";
+	on.TriggerGC();
+	on.events.DrainJson(cout);
+}
+
+int main() {
+
+#ifndef CANCELMSALLOCBENCH
+
+	// Fill the heap and reclaim all of it, many times over. Both sides only
+	// allocate and free: the slab side calls Allocate() and sweeps, without
+	// the roots or the marking a NewReference() and a TriggerGC() would
+	// add, which the legacy heap never had.
+	{
+		const int heap_size = 1 << 16;
+		const int rounds = 200;
+		double ops = double(heap_size) * rounds;
+
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		LegacyMSHeap legacy;
+		for (int r = 0; r < rounds; r++) {
+			for (int i = 0; i < heap_size; i++) {
+				legacy.New("");
+			}
+			legacy.SweepAll();
+		}
+		double legacy_secs = Elapsed(start);
+
+		start = chrono::steady_clock::now();
+		ms_graph_api::MSGraphUtil msgc(MSHeapBytes(heap_size));
+		for (int r = 0; r < rounds; r++) {
+			for (int i = 0; i < heap_size; i++) {
+				msgc.Allocate("");
+			}
+			msgc.StartSweep();
+			msgc.Sweep();
+		}
+		double slab_secs = Elapsed(start);
+
+		cout << "\nMark and Sweep alloc/free, " << heap_size << " objects x "
+		     << rounds << " rounds.\n";
+		cout << "new/delete: " << ops / legacy_secs / 1e6 << " Mops/s\n";
+		cout << "slab:       " << ops / slab_secs / 1e6 << " Mops/s\n";
+		cout << "------------------\n";
+	}
+
+#endif
+
+#ifndef CANCELMARKBENCH
+
+	// Deep chains: first one shallow enough for the recursive marker, then
+	// one that only the explicit mark stack survives.
+	{
+		const int shallow = 20000;
+		const int deep = 1 << 22;
+
+		ms_graph_api::MSGraphUtil small(MSHeapBytes(shallow));
+		BuildChain(small, shallow);
+		cout << "\nMark throughput, chain of " << shallow << " objects.\n";
+		cout << "recursive:  " << MarkThroughput(small, 50, true) / 1e6 << " Mobjects/s\n";
+		cout << "mark stack: " << MarkThroughput(small, 50, false) / 1e6 << " Mobjects/s\n";
+
+		ms_graph_api::MSGraphUtil large(MSHeapBytes(deep));
+		BuildChain(large, deep);
+		cout << "Mark throughput, chain of " << deep << " objects.\n";
+		cout << "mark stack: " << MarkThroughput(large, 5, false) / 1e6 << " Mobjects/s\n";
+		cout << "------------------\n";
+	}
+
+#endif
+
+#ifndef CANCELSWEEPBENCH
+
+	// The same churn with an eager and a lazy sweep. Lazy sweeping should
+	// cut the worst pauses down to the mark and move the sweep into the
+	// allocation latencies.
+	{
+		const int heap_size = 1 << 20;
+		cout << "\nMark and Sweep allocation latency, heap of " << heap_size
+		     << " objects.\n";
+		AllocationPauses("eager: ", false, ms_graph_api::STW_MARK, heap_size, heap_size / 8, heap_size * 8);
+		AllocationPauses("lazy:  ", true, ms_graph_api::STW_MARK, heap_size, heap_size / 8, heap_size * 8);
+		cout << "------------------\n";
+	}
+
+#endif
+
+#ifndef CANCELPARMARKBENCH
+
+	// Wide graphs split evenly across the workers from the start; deep ones
+	// only have as much parallelism as there are chains.
+	{
+		cout << "\nParallel mark, full collection time per GC thread count.\n";
+		ParallelMarkScaling("wide", 1 << 20, 4);
+		ParallelMarkScaling("deep", 16, 1 << 18);
+		cout << "------------------\n";
+	}
+
+#endif
+
+#ifndef CANCELPARCOPYBENCH
+
+	{
+		cout << "\nParallel copy, stop-copy pause per GC thread count.\n";
+		ParallelCopyScaling(1 << 18, 4);
+		cout << "------------------\n";
+	}
+
+#endif
+
+#ifndef CANCELCARDBENCH
+
+	// The same number of old-to-young pointers in old heaps of growing size.
+	{
+		cout << "\nHybrid minor collection with a card table.\n";
+		CardScanCost(1 << 16, 256);
+		CardScanCost(1 << 20, 4096);
+		cout << "------------------\n";
+	}
+
+#endif
+
+#ifndef CANCELPROMOTEBENCH
+
+	{
+		cout << "\nHybrid promotion.\n";
+		PromotionCost(1 << 12, 4);
+		PromotionCost(1 << 16, 4);
+		cout << "------------------\n";
+	}
+
+#endif
+
+#ifndef CANCELTENUREBENCH
+
+	// Objects that all live about as long: the threshold should settle
+	// just past their lifetime in collections, unless they crowd the
+	// nursery.
+	{
+		cout << "\nAdaptive tenuring.\n";
+		for (int lifetime = 1024; lifetime <= 65536; lifetime *= 4) {
+			TenuringConvergence(lifetime);
+		}
+		cout << "------------------\n";
+	}
+
+#endif
+
+#ifndef CANCELSITEBENCH
+
+	// Long-lived objects from a site of their own are pretenured instead
+	// of being copied through the nursery.
+	{
+		cout << "\nAllocation-site pretenuring.\n";
+		for (int kept = 1 << 12; kept <= 1 << 16; kept *= 4) {
+			PretenuringCost(kept);
+		}
+		cout << "------------------\n";
+	}
+
+#endif
+
+#ifndef CANCELROOTBENCH
+
+	{
+		cout << "\nEnding roots in random order.\n";
+		RootChurn(1 << 12);
+		RootChurn(1 << 16);
+		cout << "------------------\n";
+	}
+
+#endif
+
+#ifndef CANCELCMBENCH
+
+	// Stop-the-world against concurrent and incremental marking on the same
+	// churn. Both should take the marking out of the worst pauses; the
+	// incremental steps should stay close to their budget.
+	{
+		const int heap_size = 1 << 20;
+		cout << "\nMark and Sweep allocation latency by mark mode, heap of "
+		     << heap_size << " objects.\n";
+		AllocationPauses("stop-the-world: ", false, ms_graph_api::STW_MARK, heap_size, heap_size / 8, heap_size * 8);
+		AllocationPauses("concurrent:     ", false, ms_graph_api::CONCURRENT_MARK, heap_size, heap_size / 8, heap_size * 8);
+		AllocationPauses("incr. 64 objs:  ", false, ms_graph_api::INCREMENTAL_MARK, heap_size, heap_size / 8, heap_size * 8, 64);
+		AllocationPauses("incr. 20 us:    ", false, ms_graph_api::INCREMENTAL_MARK, heap_size, heap_size / 8, heap_size * 8, 0, 20);
+		cout << "------------------\n";
+	}
+
+#endif
+
+#ifndef CANCELTYPEDBENCH
+
+	{
+		cout << "\nParallel copy of typed objects.\n";
+		TypedCopyScaling(18, 1 << 16, 1 << 18);
+		cout << "------------------\n";
+	}
+
+#endif
+
+#ifndef CANCELTLABBENCH
+
+	// Nursery allocation from several threads at once, with TLABs and
+	// with a lock taken for every object.
+	{
+		cout << "\nHybrid nursery allocation throughput.\n";
+		for (int threads = 1; threads <= 16; threads *= 2) {
+			cout << threads << " threads:\n";
+			NurseryThroughput(threads, 50, false);
+			NurseryThroughput(threads, 50, true);
+		}
+		cout << "------------------\n";
+	}
+
+#endif
+
+#ifndef CANCELSAFEPOINTBENCH
+
+	// Several mutator threads stopping each other for collections, with
+	// frequent polls and with polls only at allocations.
+	{
+		cout << "\nSafepoint latency.\n";
+		for (int threads = 1; threads <= 8; threads *= 2) {
+			SafepointLatency(threads, 256);
+			SafepointLatency(threads, 1 << 14);
+		}
+		cout << "------------------\n";
+	}
+
+#endif
+
+#ifndef CANCELCOMPACTBENCH
+
+	// One collection of a heap full of short-lived objects with some
+	// survivors among them, by each of the full-heap collectors.
+	{
+		cout << "\nFull-heap collection cost.\n";
+		for (int keep = 2; keep <= 32; keep *= 4) {
+			FullHeapCost(1 << 18, keep);
+		}
+		cout << "------------------\n";
+	}
+
+#endif
+
+#ifndef CANCELREGIONBENCH
+
+	// Allocation into a heap that a collection has left full of holes,
+	// from free lists and by bumping through runs of free lines.
+	{
+		cout << "\nMark-region refill.\n";
+		for (int keep = 2; keep <= 32; keep *= 4) {
+			RegionRefill(keep, 0);
+			RegionRefill(keep, 32);
+		}
+		cout << "------------------\n";
+	}
+
+#endif
+
+#ifndef CANCELSIZINGBENCH
+
+	// A live set that grows and then shrinks again. The sized heaps should
+	// follow it, at some cost in extra collections while they are small.
+	{
+		cout << "\nHeap sizing.\n";
+		for (int live = 1 << 12; live <= 1 << 16; live *= 4) {
+			HeapSizing<ms_graph_api::MSGraphUtil>("mark-sweep, ", MSHeapBytes(live * 4), live);
+			HeapSizing<sc_graph_api::SCGraphUtil>("stop-copy,  ", live * 4 * sizeof(sc_graph_api::Object), live);
+		}
+		cout << "------------------\n";
+	}
+
+#endif
+
+#ifndef CANCELTRACEBENCH
+
+	// One recorded mutator replayed on every collector. Decoding streams
+	// through the mapped trace; the rest of the replay is the collector.
+	{
+		cout << "\nTrace replay.\n";
+		TraceReplay(1 << 22, 1 << 12);
+		cout << "------------------\n";
+	}
+
+#endif
+
+#ifndef CANCELEVENTBENCH
+
+	// Collections of a nearly empty heap, where the log's clock reads are
+	// the largest share of a collection they will ever be.
+	{
+		cout << "\nCollection event log.\n";
+		EventLogCost(1 << 14, 64);
+		cout << "------------------\n";
+	}
+
+#endif
+
+	return 0;
+}
@@ -0,0 +1,119 @@
+/*
+ * gc-bitmap.h
+ *
+ *  Side bitmaps for the slab heaps. Bit i of a bitmap describes slot i of
+ *  the slab, so marking and sweeping read and write the bitmaps instead of
+ *  the objects themselves.
+ *
+ *  The sweep looks at the allocation and mark bitmaps one block of
+ *  BLOCKWORDS 64-bit words (256 slots) at a time. With AVX2 or SSE2 the
+ *  "is anything in this block dead" test is a couple of vector
+ *  instructions, so fully live and fully free blocks are skipped without
+ *  looking at individual words.
+ */
+
+#ifndef GCBITMAP_H_
+#define GCBITMAP_H_
+
+#include <stdint.h>
+#include <vector>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+namespace gc_bitmap {
+
+// 64-bit words per sweep block
+const int BLOCKWORDS = 4;
+
+// Number of words for a bitmap of "bits" bits, rounded up to whole blocks.
+inline int Words(int bits) {
+	int words = (bits + 63) / 64;
+	return (words + BLOCKWORDS - 1) / BLOCKWORDS * BLOCKWORDS;
+}
+
+inline bool Test(const vector<uint64_t>& bits, int i) {
+	return (bits[i >> 6] >> (i & 63)) & 1;
+}
+
+inline void Set(vector<uint64_t>& bits, int i) {
+	bits[i >> 6] |= uint64_t(1) << (i & 63);
+}
+
+inline void Clear(vector<uint64_t>& bits, int i) {
+	bits[i >> 6] &= ~(uint64_t(1) << (i & 63));
+}
+
+// Sets or clears the "n" bits from bit "i" on, a word at a time.
+inline void SetRun(vector<uint64_t>& bits, int i, int n, bool value) {
+	while (n > 0) {
+		int k = n < 64 - (i & 63) ? n : 64 - (i & 63);
+		uint64_t mask = (k == 64 ? ~uint64_t(0) : (uint64_t(1) << k) - 1) << (i & 63);
+		if (value) {
+			bits[i >> 6] |= mask;
+		} else {
+			bits[i >> 6] &= ~mask;
+		}
+		i += k;
+		n -= k;
+	}
+}
+
+// How many of the "n" bits from bit "i" on are clear before the first set
+// one, a word at a time.
+inline int ClearRun(const vector<uint64_t>& bits, int i, int n) {
+	int run = 0;
+	while (run < n) {
+		int b = (i + run) & 63;
+		uint64_t word = bits[(i + run) >> 6] >> b;
+		if (word != 0) {
+			run += __builtin_ctzll(word);
+			return run < n ? run : n;
+		}
+		run += 64 - b;
+	}
+	return n;
+}
+
+// Atomic versions, for bitmaps that another thread updates at the same
+// time. AtomicSet is true for the one caller that found the bit clear.
+inline bool AtomicTest(vector<uint64_t>& bits, int i) {
+	return (__atomic_load_n(&bits[i >> 6], __ATOMIC_RELAXED) >> (i & 63)) & 1;
+}
+
+inline bool AtomicSet(vector<uint64_t>& bits, int i) {
+	uint64_t bit = uint64_t(1) << (i & 63);
+	if (__atomic_load_n(&bits[i >> 6], __ATOMIC_RELAXED) & bit) return false;
+	return !(__atomic_fetch_or(&bits[i >> 6], bit, __ATOMIC_RELAXED) & bit);
+}
+
+// True when some slot in the block at "alloc"/"mark" is allocated but
+// not marked, ie. the block holds garbage.
+inline bool AnyDead(const uint64_t* alloc, const uint64_t* mark) {
+#if defined(__AVX2__)
+	__m256i a = _mm256_loadu_si256((const __m256i*)alloc);
+	__m256i m = _mm256_loadu_si256((const __m256i*)mark);
+	__m256i dead = _mm256_andnot_si256(m, a);
+	return !_mm256_testz_si256(dead, dead);
+#elif defined(__SSE2__)
+	__m128i dead0 = _mm_andnot_si128(_mm_loadu_si128((const __m128i*)mark),
+	                                 _mm_loadu_si128((const __m128i*)alloc));
+	__m128i dead1 = _mm_andnot_si128(_mm_loadu_si128((const __m128i*)(mark + 2)),
+	                                 _mm_loadu_si128((const __m128i*)(alloc + 2)));
+	__m128i dead = _mm_or_si128(dead0, dead1);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(dead, _mm_setzero_si128())) != 0xFFFF;
+#else
+	uint64_t dead = 0;
+	for (int i = 0; i < BLOCKWORDS; i++) {
+		dead |= alloc[i] & ~mark[i];
+	}
+	return dead != 0;
+#endif
+}
+
+} // gc_bitmap
+
+#endif /* GCBITMAP_H_ */
@@ -0,0 +1,416 @@
+/*
+ * gc-collector.h
+ *
+ *  One interface to all five collectors, so a workload is written once and
+ *  run on any of them.
+ *
+ *  The collectors share no base class and each has an Object type of its
+ *  own. A policy class per collector names its heap and object types and
+ *  says, in a few static inline functions, how that heap allocates, keeps
+ *  roots, stores references and collects. Collector<Policy> owns a heap and
+ *  turns the policy into the interface workloads are written against:
+ *
+ *    Object* New(desc, parent)          a new object hanging off parent
+ *    Object* New(desc, parent, size, site)
+ *    RootHandle NewReference(desc)      a new object held by a new root
+ *    RootHandle NewReference(desc, size, site)
+ *    RootHandle NewNode(desc)           a new binary tree node held by a new
+ *                                       root
+ *    int AllocationSite(name)           the site to pass to the above
+ *    int RootCount()                    roots, by dense position
+ *    Object* Root(int i)
+ *    RootHandle RootAt(int i)
+ *    Object* Get(RootHandle h)          the object a root holds, or NULL
+ *    Object* Child(Object* obj)
+ *    void EndLifetime(RootHandle h)
+ *    void WriteReference(obj, value)    obj->child = value, barrier included
+ *    void SetSubtree(node, i, value)    subtree i, 0 or 1, of a tree node
+ *                                       = value, barrier included
+ *    void TriggerGC()
+ *    size_t Footprint()                 bytes the heap takes up as it is now
+ *    void ShowMemoryUsage()
+ *    void ShowStats()                   the collector's own statistics
+ *
+ *  A workload is a template over its collector. Instantiated for a
+ *  Collector<Policy>, every call resolves at compile time and inlines down
+ *  to the collector's own function, with no virtual dispatch on the
+ *  allocation path.
+ *
+ *  Every collector keeps the object size; allocation sites are a hint
+ *  only the hybrid collector takes, and the others hand out -1 for every
+ *  site.
+ *
+ *  AnyCollector is the same interface behind one virtual call, for when the
+ *  collector is only chosen at run time. Its objects are the opaque
+ *  AnyObject, which is the collector's own Object underneath.
+ */
+
+#ifndef GCCOLLECTOR_H_
+#define GCCOLLECTOR_H_
+
+#include <iostream>
+#include <string>
+#include <utility>
+
+#include "ms-graph-api.h"
+#include "sc-graph-api.h"
+#include "hyb-graph-api.h"
+#include "mc-graph-api.h"
+#include "ix-graph-api.h"
+
+using namespace std;
+
+namespace gc_collector {
+
+using gc_roots::RootHandle;
+
+// Mark-sweep. Stores go through the SATB / incremental write barrier.
+struct MarkSweep {
+	typedef ms_graph_api::MSGraphUtil Heap;
+	typedef ms_graph_api::Object Object;
+	typedef ms_graph_api::TreeNode TreeNode;
+
+	static const char* Name() { return "Mark and Sweep"; }
+	static Object* New(Heap& gc, const string& desc, Object* parent) {
+		return gc.New(desc, parent);
+	}
+	static RootHandle NewReference(Heap& gc, const string& desc) {
+		return gc.NewReference(desc);
+	}
+	static Object* New(Heap& gc, const string& desc, Object* parent, size_t size, int) {
+		return gc.New(desc, parent, size);
+	}
+	static RootHandle NewReference(Heap& gc, const string& desc, size_t size, int) {
+		return gc.NewReference(desc, size);
+	}
+	static Object* NewNode(Heap& gc, const string& desc) {
+		return gc.NewObject<TreeNode>(desc);
+	}
+	static int AllocationSite(Heap&, const string&) { return -1; }
+	static void WriteReference(Heap& gc, Object* obj, Object* value) {
+		gc.WriteReference(obj, value);
+	}
+	static void SetSubtree(Heap& gc, Object* node, int i, Object* value) {
+		gc.WriteReference(node, &((TreeNode*)node)->refs[i], value);
+	}
+	static size_t Footprint(Heap& gc) { return gc.max_bytes; }
+	static void ShowMemoryUsage(Heap& gc) { gc.ShowMemoryUsage(); }
+	static void ShowStats(Heap& gc) { gc.ShowSizingStats(); }
+};
+
+// Semispace copying. Nothing runs concurrently with the mutator, so a
+// store needs no barrier.
+struct StopCopy {
+	typedef sc_graph_api::SCGraphUtil Heap;
+	typedef sc_graph_api::Object Object;
+	typedef sc_graph_api::TreeNode TreeNode;
+
+	static const char* Name() { return "Stop-Copy"; }
+	static Object* New(Heap& gc, const string& desc, Object* parent) {
+		return gc.New(desc, parent);
+	}
+	static RootHandle NewReference(Heap& gc, const string& desc) {
+		return gc.NewReference(desc);
+	}
+	static Object* New(Heap& gc, const string& desc, Object* parent, size_t size, int) {
+		return gc.New(desc, parent, size);
+	}
+	static RootHandle NewReference(Heap& gc, const string& desc, size_t size, int) {
+		return gc.NewReference(desc, size);
+	}
+	static Object* NewNode(Heap& gc, const string& desc) {
+		return gc.NewObject<TreeNode>(desc);
+	}
+	static int AllocationSite(Heap&, const string&) { return -1; }
+	static void WriteReference(Heap&, Object* obj, Object* value) {
+		obj->child = value;
+	}
+	static void SetSubtree(Heap&, Object* node, int i, Object* value) {
+		((TreeNode*)node)->refs[i] = value;
+	}
+	static size_t Footprint(Heap& gc) { return 2 * gc.max_bytes; }
+	static void ShowMemoryUsage(Heap& gc) { gc.ShowMemoryUsage(); }
+	static void ShowStats(Heap& gc) { gc.ShowCopyStats(); }
+};
+
+// Generational: a stop-copy nursery in front of a mark-sweep heap. Stores
+// go through the card-marking barrier. Memory usage is shown for the whole
+// heap and then for each half.
+struct Hybrid {
+	typedef hyb_graph_api::HybGraphUtil Heap;
+	typedef hyb_graph_api::Object Object;
+	typedef hyb_graph_api::TreeNode TreeNode;
+
+	static const char* Name() { return "Hybrid"; }
+	static Object* New(Heap& gc, const string& desc, Object* parent) {
+		return gc.New(desc, parent);
+	}
+	static RootHandle NewReference(Heap& gc, const string& desc) {
+		return gc.NewReference(desc);
+	}
+	static Object* New(Heap& gc, const string& desc, Object* parent, size_t size, int site) {
+		return gc.New(desc, parent, size, site);
+	}
+	static RootHandle NewReference(Heap& gc, const string& desc, size_t size, int site) {
+		return gc.NewReference(desc, size, site);
+	}
+	static Object* NewNode(Heap& gc, const string& desc) {
+		return gc.NewObject<TreeNode>(desc);
+	}
+	static int AllocationSite(Heap& gc, const string& name) { return gc.AllocationSiteId(name); }
+	static void WriteReference(Heap& gc, Object* obj, Object* value) {
+		gc.WriteReference(obj, value);
+	}
+	static void SetSubtree(Heap& gc, Object* node, int i, Object* value) {
+		gc.WriteReference(node, &((TreeNode*)node)->refs[i], value);
+	}
+	static size_t Footprint(Heap& gc) { return gc.ms_max_bytes + 2 * gc.sc_max_bytes; }
+	static void ShowMemoryUsage(Heap& gc) {
+		gc.ShowMemoryUsage();
+		cout << "MarkSweep heap:\n";
+		gc.MSShowMemoryUsage();
+		cout << "StopCopy heap:\n";
+		gc.SCShowMemoryUsage();
+		cout << endl;
+	}
+	static void ShowStats(Heap& gc) { gc.ShowTenuringStats(); }
+};
+
+// Sliding mark-compact. No barrier.
+struct MarkCompact {
+	typedef mc_graph_api::MCGraphUtil Heap;
+	typedef mc_graph_api::Object Object;
+	typedef mc_graph_api::TreeNode TreeNode;
+
+	static const char* Name() { return "Mark-Compact"; }
+	static Object* New(Heap& gc, const string& desc, Object* parent) {
+		return gc.New(desc, parent);
+	}
+	static RootHandle NewReference(Heap& gc, const string& desc) {
+		return gc.NewReference(desc);
+	}
+	static Object* New(Heap& gc, const string& desc, Object* parent, size_t size, int) {
+		return gc.New(desc, parent, size);
+	}
+	static RootHandle NewReference(Heap& gc, const string& desc, size_t size, int) {
+		return gc.NewReference(desc, size);
+	}
+	static Object* NewNode(Heap& gc, const string& desc) {
+		return gc.NewObject<TreeNode>(desc);
+	}
+	static int AllocationSite(Heap&, const string&) { return -1; }
+	static void WriteReference(Heap&, Object* obj, Object* value) {
+		obj->child = value;
+	}
+	static void SetSubtree(Heap&, Object* node, int i, Object* value) {
+		((TreeNode*)node)->refs[i] = value;
+	}
+	static size_t Footprint(Heap& gc) { return gc.max_bytes; }
+	static void ShowMemoryUsage(Heap& gc) { gc.ShowMemoryUsage(); }
+	static void ShowStats(Heap& gc) { gc.ShowCompactStats(); }
+};
+
+// Immix-style mark-region. No barrier.
+struct MarkRegion {
+	typedef ix_graph_api::IXGraphUtil Heap;
+	typedef ix_graph_api::Object Object;
+	typedef ix_graph_api::TreeNode TreeNode;
+
+	static const char* Name() { return "Mark-Region"; }
+	static Object* New(Heap& gc, const string& desc, Object* parent) {
+		return gc.New(desc, parent);
+	}
+	static RootHandle NewReference(Heap& gc, const string& desc) {
+		return gc.NewReference(desc);
+	}
+	static Object* New(Heap& gc, const string& desc, Object* parent, size_t size, int) {
+		return gc.New(desc, parent, size);
+	}
+	static RootHandle NewReference(Heap& gc, const string& desc, size_t size, int) {
+		return gc.NewReference(desc, size);
+	}
+	static Object* NewNode(Heap& gc, const string& desc) {
+		return gc.NewObject<TreeNode>(desc);
+	}
+	static int AllocationSite(Heap&, const string&) { return -1; }
+	static void WriteReference(Heap&, Object* obj, Object* value) {
+		obj->child = value;
+	}
+	static void SetSubtree(Heap&, Object* node, int i, Object* value) {
+		((TreeNode*)node)->refs[i] = value;
+	}
+	static size_t Footprint(Heap& gc) { return gc.max_bytes; }
+	static void ShowMemoryUsage(Heap& gc) { gc.ShowMemoryUsage(); }
+	static void ShowStats(Heap& gc) { gc.ShowRegionStats(); }
+};
+
+// A heap of the policy's collector. The constructor arguments are passed on
+// to the heap's own constructor. The heap itself is public, for whatever
+// the policy does not cover.
+template <class Policy>
+class Collector {
+  public:
+    typedef typename Policy::Heap Heap;
+    typedef typename Policy::Object Object;
+
+    template <class... Args>
+    explicit Collector(Args&&... args) : heap(std::forward<Args>(args)...) {}
+
+    const char* Name() const { return Policy::Name(); }
+
+    Object* New(const string& desc, Object* parent) {
+    	return Policy::New(heap, desc, parent);
+    }
+    Object* New(const string& desc, Object* parent, size_t size, int site) {
+    	return Policy::New(heap, desc, parent, size, site);
+    }
+    RootHandle NewReference(const string& desc) {
+    	return Policy::NewReference(heap, desc);
+    }
+    RootHandle NewReference(const string& desc, size_t size, int site) {
+    	return Policy::NewReference(heap, desc, size, site);
+    }
+    RootHandle NewNode(const string& desc) {
+    	Object* node = Policy::NewNode(heap, desc);
+    	if (node != NULL) return heap.NewReference(node);
+    	RootHandle none = { -1, 0 };
+    	return none;
+    }
+    int AllocationSite(const string& name) { return Policy::AllocationSite(heap, name); }
+    int RootCount() const { return heap.roots.size(); }
+    Object* Root(int i) const { return heap.roots[i]; }
+    RootHandle RootAt(int i) const { return heap.roots.HandleAt(i); }
+    Object* Get(RootHandle h) const { return heap.roots.Get(h); }
+    Object* Child(Object* obj) const { return obj->child; }
+    void EndLifetime(RootHandle h) { heap.EndLifetime(h); }
+    void WriteReference(Object* obj, Object* value) {
+    	Policy::WriteReference(heap, obj, value);
+    }
+    void SetSubtree(Object* node, int i, Object* value) {
+    	Policy::SetSubtree(heap, node, i, value);
+    }
+    void TriggerGC() { heap.TriggerGC(); }
+    size_t Footprint() { return Policy::Footprint(heap); }
+    void ShowMemoryUsage() { Policy::ShowMemoryUsage(heap); }
+    void ShowStats() { Policy::ShowStats(heap); }
+
+    Heap heap;
+
+  private:
+    Collector(const Collector&);
+    Collector& operator=(const Collector&);
+};
+
+// An object of whichever collector an AnyCollector runs. Never defined:
+// pointers to it are the collector's own Object pointers.
+struct AnyObject;
+
+// The Collector interface with the collector picked at run time. Every
+// call is one virtual call on top of what Collector<Policy> does.
+class AnyCollector {
+  public:
+    typedef AnyObject Object;
+
+    // A collector of the given policy, with its heap built from "args".
+    template <class Policy, class... Args>
+    static AnyCollector* Make(Args&&... args) {
+    	return new AnyCollector(new Model<Policy>(std::forward<Args>(args)...));
+    }
+
+    ~AnyCollector() { delete self; }
+
+    const char* Name() const { return self->Name(); }
+    Object* New(const string& desc, Object* parent) { return self->New(desc, parent, 0, -1); }
+    Object* New(const string& desc, Object* parent, size_t size, int site) {
+    	return self->New(desc, parent, size, site);
+    }
+    RootHandle NewReference(const string& desc) { return self->NewReference(desc, 0, -1); }
+    RootHandle NewReference(const string& desc, size_t size, int site) {
+    	return self->NewReference(desc, size, site);
+    }
+    RootHandle NewNode(const string& desc) { return self->NewNode(desc); }
+    int AllocationSite(const string& name) { return self->AllocationSite(name); }
+    int RootCount() const { return self->RootCount(); }
+    Object* Root(int i) const { return self->Root(i); }
+    RootHandle RootAt(int i) const { return self->RootAt(i); }
+    Object* Get(RootHandle h) const { return self->Get(h); }
+    Object* Child(Object* obj) const { return self->Child(obj); }
+    void EndLifetime(RootHandle h) { self->EndLifetime(h); }
+    void WriteReference(Object* obj, Object* value) { self->WriteReference(obj, value); }
+    void SetSubtree(Object* node, int i, Object* value) { self->SetSubtree(node, i, value); }
+    void TriggerGC() { self->TriggerGC(); }
+    size_t Footprint() { return self->Footprint(); }
+    void ShowMemoryUsage() { self->ShowMemoryUsage(); }
+    void ShowStats() { self->ShowStats(); }
+
+  private:
+    class Concept {
+      public:
+        virtual ~Concept() {}
+        virtual const char* Name() const = 0;
+        virtual Object* New(const string& desc, Object* parent, size_t size, int site) = 0;
+        virtual RootHandle NewReference(const string& desc, size_t size, int site) = 0;
+        virtual RootHandle NewNode(const string& desc) = 0;
+        virtual int AllocationSite(const string& name) = 0;
+        virtual int RootCount() const = 0;
+        virtual Object* Root(int i) const = 0;
+        virtual RootHandle RootAt(int i) const = 0;
+        virtual Object* Get(RootHandle h) const = 0;
+        virtual Object* Child(Object* obj) const = 0;
+        virtual void EndLifetime(RootHandle h) = 0;
+        virtual void WriteReference(Object* obj, Object* value) = 0;
+        virtual void SetSubtree(Object* node, int i, Object* value) = 0;
+        virtual void TriggerGC() = 0;
+        virtual size_t Footprint() = 0;
+        virtual void ShowMemoryUsage() = 0;
+        virtual void ShowStats() = 0;
+    };
+
+    template <class Policy>
+    class Model : public Concept {
+      public:
+        typedef typename Policy::Object Native;
+
+        template <class... Args>
+        explicit Model(Args&&... args) : gc(std::forward<Args>(args)...) {}
+
+        const char* Name() const { return gc.Name(); }
+        Object* New(const string& desc, Object* parent, size_t size, int site) {
+        	return (Object*)gc.New(desc, (Native*)parent, size, site);
+        }
+        RootHandle NewReference(const string& desc, size_t size, int site) {
+        	return gc.NewReference(desc, size, site);
+        }
+        RootHandle NewNode(const string& desc) { return gc.NewNode(desc); }
+        int AllocationSite(const string& name) { return gc.AllocationSite(name); }
+        int RootCount() const { return gc.RootCount(); }
+        Object* Root(int i) const { return (Object*)gc.Root(i); }
+        RootHandle RootAt(int i) const { return gc.RootAt(i); }
+        Object* Get(RootHandle h) const { return (Object*)gc.Get(h); }
+        Object* Child(Object* obj) const { return (Object*)gc.Child((Native*)obj); }
+        void EndLifetime(RootHandle h) { gc.EndLifetime(h); }
+        void WriteReference(Object* obj, Object* value) {
+        	gc.WriteReference((Native*)obj, (Native*)value);
+        }
+        void SetSubtree(Object* node, int i, Object* value) {
+        	gc.SetSubtree((Native*)node, i, (Native*)value);
+        }
+        void TriggerGC() { gc.TriggerGC(); }
+        size_t Footprint() { return gc.Footprint(); }
+        void ShowMemoryUsage() { gc.ShowMemoryUsage(); }
+        void ShowStats() { gc.ShowStats(); }
+
+      private:
+        Collector<Policy> gc;
+    };
+
+    explicit AnyCollector(Concept* model) : self(model) {}
+    AnyCollector(const AnyCollector&);
+    AnyCollector& operator=(const AnyCollector&);
+
+    Concept* self;
+};
+
+} // gc_collector
+
+#endif /* GCCOLLECTOR_H_ */
@@ -0,0 +1,234 @@
+/*
+ * gc-events.h
+ *
+ *  A structured log of collections, shared by all the collectors.
+ *
+ *  Every collection is one Event: why it ran (the heap was full, it was
+ *  asked for, a promotion failed, or a concurrent cycle finished marking
+ *  and its final pause ran), which generation it collected, how long each phase
+ *  took, the objects and bytes in the collected space before and after,
+ *  and what was promoted. Phases are timed with the monotonic clock. Time
+ *  a collection spends outside the phases its collector has (resizing the
+ *  heap, say) counts towards the total only.
+ *
+ *  The collector fills in the event as it goes, Begin() to End(), and
+ *  End() pushes it onto a ring buffer. The ring has one producer, whichever
+ *  thread is collecting with the world stopped, and one consumer, whichever
+ *  thread drains it, and neither ever waits for the other: the producer
+ *  publishes a slot by moving "head" on with a release store, the consumer
+ *  frees one by moving "tail". When the ring is full new events are
+ *  dropped and counted, so the collector never blocks on a slow reader.
+ *
+ *  The log is off until Enable() is called. Off, Begin() costs one relaxed
+ *  load of "enabled", the other calls a test of a flag, and no clock is
+ *  read. Drained events are written as JSON lines or as CSV.
+ */
+
+#ifndef GCEVENTS_H_
+#define GCEVENTS_H_
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+
+using namespace std;
+
+namespace gc_events {
+
+enum Cause { HEAP_FULL, EXPLICIT, PROMOTION_FAILURE, OCCUPANCY, CAUSES };
+enum Generation { FULL_HEAP, YOUNG, OLD, GENERATIONS };
+enum Phase { ROOTS, MARK, SWEEP, COPY, PROMOTE, COMPACT, PHASES };
+
+const char* const cause_names[CAUSES] = { "heap-full", "explicit", "promotion-failure", "occupancy" };
+const char* const generation_names[GENERATIONS] = { "full", "young", "old" };
+const char* const phase_names[PHASES] = { "roots", "mark", "sweep", "copy", "promote", "compact" };
+
+struct Event {
+	long id;                 // collections logged before this one
+	int cause;
+	int generation;
+	double start_us;         // since the log was created
+	double total_us;
+	double phase_us[PHASES];
+	long objects_before;
+	long objects_after;
+	size_t bytes_before;
+	size_t bytes_after;
+	long promoted_objects;
+	size_t promoted_bytes;
+};
+
+class EventLog {
+  public:
+    EventLog() : enabled(false), head(0), tail(0), dropped(0) {
+    	ring = NULL;
+    	mask = 0;
+    	active = false;
+    	next_id = 0;
+    	epoch = chrono::steady_clock::now();
+    }
+
+    ~EventLog() { delete[] ring; }
+
+    // Turns the log on. The ring is allocated the first time, with room
+    // for "capacity" events rounded up to a power of two; call it before
+    // the heap is shared between threads.
+    void Enable(int capacity) {
+    	if (ring == NULL) {
+    		size_t size = 1;
+    		while (size < size_t(capacity)) size <<= 1;
+    		ring = new Event[size];
+    		mask = size - 1;
+    	}
+    	enabled.store(true, memory_order_relaxed);
+    }
+
+    // Turns it off again. Events already logged can still be drained.
+    void Disable() {
+    	enabled.store(false, memory_order_relaxed);
+    }
+
+    bool On() const {
+    	return enabled.load(memory_order_relaxed);
+    }
+
+    // Producer side, called by the collecting thread. Begin() starts the
+    // clock, each Phase() charges the time since the last mark to "phase",
+    // and End() logs the event.
+    void Begin(int cause, int generation) {
+    	if (!On()) {
+    		active = false;
+    		return;
+    	}
+    	active = true;
+    	current = Event();
+    	current.cause = cause;
+    	current.generation = generation;
+    	start = chrono::steady_clock::now();
+    	last = start;
+    	current.start_us = Micros(epoch, start);
+    }
+
+    void Before(long objects, size_t bytes) {
+    	if (!active) return;
+    	current.objects_before = objects;
+    	current.bytes_before = bytes;
+    }
+
+    void Phase(int phase) {
+    	if (!active) return;
+    	chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    	current.phase_us[phase] += Micros(last, now);
+    	last = now;
+    }
+
+    void Promoted(long objects, size_t bytes) {
+    	if (!active) return;
+    	current.promoted_objects += objects;
+    	current.promoted_bytes += bytes;
+    }
+
+    void After(long objects, size_t bytes) {
+    	if (!active) return;
+    	current.objects_after = objects;
+    	current.bytes_after = bytes;
+    }
+
+    void End() {
+    	if (!active) return;
+    	active = false;
+    	current.total_us = Micros(start, chrono::steady_clock::now());
+    	current.id = next_id++;
+
+    	size_t h = head.load(memory_order_relaxed);
+    	if (h - tail.load(memory_order_acquire) > mask) {
+    		dropped.fetch_add(1, memory_order_relaxed);
+    		return;
+    	}
+    	ring[h & mask] = current;
+    	head.store(h + 1, memory_order_release);
+    }
+
+    // Consumer side. Takes the oldest event not yet drained; false if
+    // there is none.
+    bool Pop(Event& e) {
+    	if (ring == NULL) return false;
+    	size_t t = tail.load(memory_order_relaxed);
+    	if (t == head.load(memory_order_acquire)) return false;
+    	e = ring[t & mask];
+    	tail.store(t + 1, memory_order_release);
+    	return true;
+    }
+
+    // Drains every event logged so far to "out", one JSON object per
+    // line. Returns how many there were.
+    long DrainJson(ostream& out) {
+    	Event e;
+    	long n = 0;
+    	while (Pop(e)) {
+    		out << "{\"id\":" << e.id << ",\"cause\":\"" << cause_names[e.cause]
+    		    << "\",\"generation\":\"" << generation_names[e.generation]
+    		    << "\",\"start_us\":" << e.start_us << ",\"total_us\":" << e.total_us
+    		    << ",\"phase_us\":{";
+    		for (int p = 0; p < PHASES; p++) {
+    			out << (p ? "," : "") << "\"" << phase_names[p] << "\":" << e.phase_us[p];
+    		}
+    		out << "},\"objects_before\":" << e.objects_before << ",\"objects_after\":" << e.objects_after
+    		    << ",\"bytes_before\":" << e.bytes_before << ",\"bytes_after\":" << e.bytes_after
+    		    << ",\"promoted_objects\":" << e.promoted_objects
+    		    << ",\"promoted_bytes\":" << e.promoted_bytes << "}\n";
+    		n++;
+    	}
+    	return n;
+    }
+
+    // The CSV header line, and the same drain as CSV rows.
+    static void CsvHeader(ostream& out) {
+    	out << "id,cause,generation,start_us,total_us";
+    	for (int p = 0; p < PHASES; p++) out << "," << phase_names[p] << "_us";
+    	out << ",objects_before,objects_after,bytes_before,bytes_after,promoted_objects,promoted_bytes\n";
+    }
+
+    long DrainCsv(ostream& out) {
+    	Event e;
+    	long n = 0;
+    	while (Pop(e)) {
+    		out << e.id << "," << cause_names[e.cause] << "," << generation_names[e.generation]
+    		    << "," << e.start_us << "," << e.total_us;
+    		for (int p = 0; p < PHASES; p++) out << "," << e.phase_us[p];
+    		out << "," << e.objects_before << "," << e.objects_after << "," << e.bytes_before
+    		    << "," << e.bytes_after << "," << e.promoted_objects << "," << e.promoted_bytes << "\n";
+    		n++;
+    	}
+    	return n;
+    }
+
+    long Dropped() const { return dropped.load(memory_order_relaxed); }
+
+  private:
+    static double Micros(chrono::steady_clock::time_point from, chrono::steady_clock::time_point to) {
+    	return chrono::duration<double, micro>(to - from).count();
+    }
+
+    atomic<bool> enabled;
+    Event* ring;
+    size_t mask;
+    atomic<size_t> head;     // next slot the producer fills
+    atomic<size_t> tail;     // next slot the consumer drains
+    atomic<long> dropped;
+
+    // The collection in progress, touched by the producer only.
+    bool active;
+    Event current;
+    long next_id;
+    chrono::steady_clock::time_point epoch;
+    chrono::steady_clock::time_point start;
+    chrono::steady_clock::time_point last;
+
+    EventLog(const EventLog&);
+    EventLog& operator=(const EventLog&);
+};
+
+} // gc_events
+
+#endif /* GCEVENTS_H_ */
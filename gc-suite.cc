@@ -0,0 +1,367 @@
+/*
+ * gc-suite.cc
+ *
+ *  The benchmark suite: standard workloads on the mark-sweep, stop-copy
+ *  and hybrid collectors, over a grid of heap sizes, fixed and sized
+ *  heaps, and for the hybrid, initial tenuring thresholds. Build it next
+ *  to the simulation:
+ *
+ *    g++ -O2 -o gc-suite gc-suite.cc ms-graph-api.cc sc-graph-api.cc \
+ *        hyb-graph-api.cc mc-graph-api.cc ix-graph-api.cc -lpthread
+ *
+ *  and run it as
+ *
+ *    gc-suite [results.csv [allocations per run]]
+ *
+ *  Every run is one CSV row of results.csv (gc-suite.csv by default), so
+ *  two runs of the suite can be compared line by line or loaded anywhere:
+ *
+ *    collector, workload     what ran
+ *    heap_bytes, sizing      the heap's footprint, and whether it is fixed
+ *                            at that or starts at a sixteenth of it and is
+ *                            sized up to it (see heap-sizing.h)
+ *    threshold               initial tenuring threshold, hybrid only
+ *    allocations, seconds    objects allocated and the wall time it took
+ *    allocs_per_sec
+ *    gc_count, gc_ms         collection pauses and their total length
+ *    pause_p50_us, pause_p99_us, pause_max_us
+ *    peak_footprint_bytes    the largest the heap got
+ *    out_of_memory           allocations that found no room at all
+ *
+ *  A pause is the time the world stayed stopped, as the safepoints measure
+ *  it. Every collector stops the world the same way, so the pauses of one
+ *  compare with those of another.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "gc-collector.h"
+
+using namespace std;
+using namespace gc_collector;
+
+enum Workload { LISTS, TREES, CHURN, CACHE, MIXED, WORKLOADS };
+
+static const char* const workload_names[WORKLOADS] = { "lists", "trees", "churn", "cache", "mixed" };
+
+// Objects live at once in each workload, at most, in plain objects; a tree
+// node counts for about one and a half. Heaps are sized as multiples of
+// it.
+static const int workload_live[WORKLOADS] = { 9000, 6400, 520, 8200, 6400 };
+
+// The results of one run.
+struct Result {
+	long allocations;
+	double seconds;
+	size_t peak_footprint;
+	long out_of_memory;
+};
+
+// A collector as the workloads see it: allocations are counted, and the
+// footprint followed, as they go. "failed" is set by the first allocation
+// that finds no room, and the workloads stop there.
+template <class GC>
+class Meter {
+  public:
+    typedef typename GC::Object Object;
+
+    Meter(GC& collector) : gc(collector) {
+    	allocations = 0;
+    	peak_footprint = gc.Footprint();
+    	failed = false;
+    }
+
+    RootHandle NewRoot() {
+    	RootHandle h = gc.NewReference("");
+    	Count(gc.Get(h) != NULL);
+    	return h;
+    }
+
+    // A new object hanging off the object root "h" holds.
+    void NewChild(RootHandle h) {
+    	Object* parent = gc.Get(h);
+    	if (parent == NULL) return;
+    	Count(gc.New("", parent) != NULL);
+    }
+
+    // Points the object "h" holds at the object "value" holds.
+    void Link(RootHandle h, RootHandle value) {
+    	Object* obj = gc.Get(h);
+    	if (obj != NULL) gc.WriteReference(obj, gc.Get(value));
+    }
+
+    RootHandle NewNode() {
+    	RootHandle h = gc.NewNode("");
+    	Count(gc.Get(h) != NULL);
+    	return h;
+    }
+
+    // Makes the tree node "value" holds subtree "i" of the one "h" holds.
+    void LinkSubtree(RootHandle h, int i, RootHandle value) {
+    	Object* node = gc.Get(h);
+    	if (node != NULL) gc.SetSubtree(node, i, gc.Get(value));
+    }
+
+    bool Done(long target) const { return failed || allocations >= target; }
+
+    GC& gc;
+    long allocations;
+    size_t peak_footprint;
+    bool failed;
+
+  private:
+    void Count(bool ok) {
+    	allocations++;
+    	if (!ok) failed = true;
+    	size_t footprint = gc.Footprint();
+    	if (footprint > peak_footprint) peak_footprint = footprint;
+    }
+};
+
+static unsigned int Random(unsigned int& seed) {
+	seed = seed * 1103515245 + 12345;
+	return seed >> 8;
+}
+
+// Ends every root in "roots".
+template <class GC>
+static void EndAll(Meter<GC>& m, vector <RootHandle>& roots) {
+	for (int i = 0; i < int(roots.size()); i++) m.gc.EndLifetime(roots[i]);
+	roots.clear();
+}
+
+// Builds a list of "length" nodes, each new node pushed on the front, and
+// returns the root holding its head.
+template <class GC>
+static RootHandle List(Meter<GC>& m, int length) {
+	RootHandle head = m.NewRoot();
+	for (int i = 1; i < length && !m.failed; i++) {
+		RootHandle node = m.NewRoot();
+		m.Link(node, head);
+		m.gc.EndLifetime(head);
+		head = node;
+	}
+	return head;
+}
+
+// Linked lists: lists of 1000 nodes, of which the last 8 stay live.
+template <class GC>
+static void Lists(Meter<GC>& m, long target) {
+	vector <RootHandle> lists;
+	for (int i = 0; !m.Done(target); i++) {
+		RootHandle head = List(m, 1000);
+		if (int(lists.size()) < 8) {
+			lists.push_back(head);
+		} else {
+			m.gc.EndLifetime(lists[i % 8]);
+			lists[i % 8] = head;
+		}
+	}
+	EndAll(m, lists);
+}
+
+// Builds a complete binary tree "depth" levels deep out of tree nodes and
+// returns the root holding its top node.
+template <class GC>
+static RootHandle Tree(Meter<GC>& m, int depth) {
+	RootHandle node = m.NewNode();
+	for (int i = 0; i < 2 && depth > 1 && !m.failed; i++) {
+		RootHandle subtree = Tree(m, depth - 1);
+		m.LinkSubtree(node, i, subtree);
+		m.gc.EndLifetime(subtree);
+	}
+	return node;
+}
+
+// Binary trees, in the manner of GCBench: a tree 12 levels deep stays
+// live throughout, while trees 8 levels deep are built and dropped.
+template <class GC>
+static void Trees(Meter<GC>& m, long target) {
+	RootHandle kept = Tree(m, 12);
+	while (!m.Done(target)) {
+		m.gc.EndLifetime(Tree(m, 8));
+	}
+	m.gc.EndLifetime(kept);
+}
+
+// Short-lived churn: an object and a child of it, dropped at once, except
+// one pair in 64, which lives on among the last 256 kept.
+template <class GC>
+static void Churn(Meter<GC>& m, long target) {
+	unsigned int seed = 12345;
+	vector <RootHandle> kept;
+	for (int i = 0; !m.Done(target); i++) {
+		RootHandle h = m.NewRoot();
+		m.NewChild(h);
+		if (Random(seed) % 64 != 0) {
+			m.gc.EndLifetime(h);
+		} else if (int(kept.size()) < 256) {
+			kept.push_back(h);
+		} else {
+			m.gc.EndLifetime(kept[i % 256]);
+			kept[i % 256] = h;
+		}
+	}
+	EndAll(m, kept);
+}
+
+// One step of a cache of "entries" entries, each a key with its value
+// hanging off it: a pseudo-random entry is replaced.
+template <class GC>
+static void CacheStep(Meter<GC>& m, vector <RootHandle>& cache, int entries, unsigned int& seed) {
+	RootHandle h = m.NewRoot();
+	m.NewChild(h);
+	if (int(cache.size()) < entries) {
+		cache.push_back(h);
+		return;
+	}
+	int victim = Random(seed) % entries;
+	m.gc.EndLifetime(cache[victim]);
+	cache[victim] = h;
+}
+
+// A long-lived cache of 4096 entries. An entry lives for about 4096 steps.
+template <class GC>
+static void Cache(Meter<GC>& m, long target) {
+	unsigned int seed = 12345;
+	vector <RootHandle> cache;
+	while (!m.Done(target)) CacheStep(m, cache, 4096, seed);
+	EndAll(m, cache);
+}
+
+// All of them at once: short-lived churn, a cache of 2048 entries, and
+// every thousandth step a list of 200 nodes, of which the last 8 stay
+// live.
+template <class GC>
+static void Mixed(Meter<GC>& m, long target) {
+	unsigned int seed = 12345;
+	vector <RootHandle> cache, lists;
+	for (int i = 0; !m.Done(target); i++) {
+		RootHandle h = m.NewRoot();
+		m.gc.EndLifetime(h);
+		if (i % 4 == 0) CacheStep(m, cache, 2048, seed);
+		if (i % 1000 == 0) {
+			RootHandle head = List(m, 200);
+			if (int(lists.size()) < 8) {
+				lists.push_back(head);
+			} else {
+				m.gc.EndLifetime(lists[i / 1000 % 8]);
+				lists[i / 1000 % 8] = head;
+			}
+		}
+	}
+	EndAll(m, cache);
+	EndAll(m, lists);
+}
+
+// Runs "workload" on "gc" until "target" objects have been allocated.
+template <class GC>
+static Result Measure(GC& gc, int workload, long target) {
+	gc.heap.safepoints.log_pauses = true;
+	Meter<GC> m(gc);
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	switch (workload) {
+	case LISTS: Lists(m, target); break;
+	case TREES: Trees(m, target); break;
+	case CHURN: Churn(m, target); break;
+	case CACHE: Cache(m, target); break;
+	case MIXED: Mixed(m, target); break;
+	}
+	Result r;
+	r.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	r.allocations = m.allocations;
+	r.peak_footprint = m.peak_footprint;
+	r.out_of_memory = 0;
+	return r;
+}
+
+// The pause that "p" percent of the pauses do not exceed (nearest rank),
+// 0 if there were none.
+static double Percentile(vector <double> pauses, double p) {
+	if (pauses.empty()) return 0;
+	sort(pauses.begin(), pauses.end());
+	size_t rank = size_t(p / 100 * pauses.size() + 0.999999);
+	return pauses[max(rank, size_t(1)) - 1];
+}
+
+// Writes the CSV row of one run.
+template <class GC>
+static void Report(FILE* out, GC& gc, int workload, size_t heap_bytes, bool sized,
+                   int threshold, Result& r) {
+	vector <double>& pauses = gc.heap.safepoints.pause_log;
+	fprintf(out, "%s,%s,%zu,%s,", gc.Name(), workload_names[workload], heap_bytes,
+	        sized ? "sized" : "fixed");
+	if (threshold > 0) fprintf(out, "%d", threshold);
+	fprintf(out, ",%ld,%.6f,%.0f,%zu,%.3f,%.2f,%.2f,%.2f,%zu,%ld\n",
+	        r.allocations, r.seconds, r.allocations / r.seconds, pauses.size(),
+	        gc.heap.safepoints.pause_total_us / 1e3, Percentile(pauses, 50), Percentile(pauses, 99),
+	        gc.heap.safepoints.pause_max_us, r.peak_footprint, r.out_of_memory);
+	fflush(out);
+}
+
+// The mark-sweep heap is the whole footprint.
+static void RunMarkSweep(FILE* out, int workload, size_t bytes, bool sized, long target) {
+	Collector<MarkSweep>* gc = sized ? new Collector<MarkSweep>(bytes / 16, bytes)
+	                                 : new Collector<MarkSweep>(bytes);
+	Result r = Measure(*gc, workload, target);
+	r.out_of_memory = gc->heap.sizing.out_of_memory;
+	Report(out, *gc, workload, bytes, sized, 0, r);
+	delete gc;
+}
+
+// Each semispace is half of the footprint.
+static void RunStopCopy(FILE* out, int workload, size_t bytes, bool sized, long target) {
+	Collector<StopCopy>* gc = sized ? new Collector<StopCopy>(bytes / 32, bytes / 2)
+	                                : new Collector<StopCopy>(bytes / 2);
+	Result r = Measure(*gc, workload, target);
+	r.out_of_memory = gc->heap.sizing.out_of_memory;
+	Report(out, *gc, workload, bytes, sized, 0, r);
+	delete gc;
+}
+
+// The mark-sweep heap is half of the footprint and each nursery semispace
+// a quarter.
+static void RunHybrid(FILE* out, int workload, size_t bytes, bool sized, int threshold, long target) {
+	Collector<Hybrid>* gc = sized ? new Collector<Hybrid>(bytes / 32, bytes / 64, threshold, bytes / 2, bytes / 4)
+	                              : new Collector<Hybrid>(bytes / 2, bytes / 4, threshold);
+	Result r = Measure(*gc, workload, target);
+	r.out_of_memory = gc->heap.ms_sizing.out_of_memory + gc->heap.sc_sizing.out_of_memory;
+	Report(out, *gc, workload, bytes, sized, threshold, r);
+	delete gc;
+}
+
+int main(int argc, char** argv) {
+	const char* path = argc > 1 ? argv[1] : "gc-suite.csv";
+	long target = argc > 2 ? atol(argv[2]) : 1 << 18;
+	FILE* out = fopen(path, "w");
+	if (out == NULL) {
+		cout << "Error! Unable to open " << path << "!\n";
+		return 1;
+	}
+	fprintf(out, "collector,workload,heap_bytes,sizing,threshold,allocations,seconds,"
+	             "allocs_per_sec,gc_count,gc_ms,pause_p50_us,pause_p99_us,pause_max_us,"
+	             "peak_footprint_bytes,out_of_memory\n");
+
+	const int factors[] = { 4, 8, 16 };
+	const int thresholds[] = { 1, 4, 15 };
+	for (int w = 0; w < WORKLOADS; w++) {
+		cout << workload_names[w] << "..." << endl;
+		for (int f = 0; f < 3; f++) {
+			size_t bytes = size_t(factors[f]) * workload_live[w] * sizeof(ms_graph_api::Object);
+			for (int sized = 0; sized <= 1; sized++) {
+				RunMarkSweep(out, w, bytes, sized, target);
+				RunStopCopy(out, w, bytes, sized, target);
+				for (int t = 0; t < 3; t++) {
+					RunHybrid(out, w, bytes, sized, thresholds[t], target);
+				}
+			}
+		}
+	}
+	fclose(out);
+	cout << "Results in " << path << endl;
+	return 0;
+}
@@ -0,0 +1,454 @@
+/*
+ * gc-trace.h
+ *
+ *  Recording a mutator's allocations and stores to a trace file, and
+ *  replaying the trace on any of the collectors through the Collector
+ *  interface of gc-collector.h, so that every collector sees exactly the
+ *  same mutator.
+ *
+ *  A trace names objects the way the mutator reaches them: by a root and
+ *  the number of child links followed from the object the root holds.
+ *  Roots are numbered in the order they are created and keep their number
+ *  when they end. Nothing in a trace is an address, so the same trace
+ *  replays on moving and non-moving collectors alike.
+ *
+ *  The events are
+ *
+ *    ROOT  size site                        NewReference()
+ *    NEW   root depth size site             New() off the object at depth
+ *    STORE root depth [value depth]         WriteReference(), value NULL
+ *                                           if the value root is omitted
+ *    END   root                             EndLifetime()
+ *    GC                                     TriggerGC()
+ *
+ *  The file is the 8 bytes "GCTRACE1" followed by the events. An event is
+ *  one byte, the opcode in the low three bits and flags above them, then
+ *  its fields as LEB128 varints. Fields are delta encoded so the common
+ *  case takes a byte or nothing:
+ *
+ *    root    how many roots back from the newest one, so recent roots are
+ *            small numbers
+ *    size    zigzag difference from the last allocation's size, left out
+ *            (SAMESIZE flag) when there is none
+ *    site    site + 1, so "no site" (-1) is 0, left out (SAMESITE flag)
+ *            when it is the last allocation's site
+ *
+ *  A typical allocation is two to four bytes.
+ *
+ *  TraceWriter buffers the encoded events and writes them out in large
+ *  blocks. TraceReader maps the whole file read-only and decodes events in
+ *  place as it walks through the mapping front to back, so a trace is never
+ *  read into memory or copied: replay streams through the page cache at
+ *  the speed the varints decode.
+ */
+
+#ifndef GCTRACE_H_
+#define GCTRACE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "root-table.h"
+
+using namespace std;
+
+namespace gc_trace {
+
+enum TraceOp { TRACE_ROOT, TRACE_NEW, TRACE_STORE, TRACE_END, TRACE_GC };
+
+const int OPBITS = 7;
+const int SAMESIZE = 8;
+const int SAMESITE = 16;
+const int NULLVALUE = 32;   // a STORE of NULL, no value fields follow
+
+const char TRACEMAGIC[8] = { 'G', 'C', 'T', 'R', 'A', 'C', 'E', '1' };
+
+// One decoded event. Only the fields of its op are meaningful.
+struct TraceEvent {
+	int op;
+	int root;
+	int depth;
+	int value_root;    // -1 for a store of NULL
+	int value_depth;
+	size_t size;
+	int site;
+};
+
+class TraceWriter {
+  public:
+    TraceWriter() {
+    	file = NULL;
+    	roots = 0;
+    	last_size = 0;
+    	last_site = -1;
+    	events = 0;
+    	bytes = 0;
+    }
+
+    ~TraceWriter() { Close(); }
+
+    // Starts a trace at "path", replacing any file there.
+    bool Open(const char* path) {
+    	Close();
+    	file = fopen(path, "wb");
+    	if (file == NULL) {
+    		cout << "Error! Unable to open trace " << path << "!\n";
+    		return false;
+    	}
+    	roots = 0;
+    	last_size = 0;
+    	last_site = -1;
+    	events = 0;
+    	bytes = sizeof(TRACEMAGIC);
+    	buffer.clear();
+    	buffer.insert(buffer.end(), TRACEMAGIC, TRACEMAGIC + sizeof(TRACEMAGIC));
+    	return true;
+    }
+
+    // Writes out what is still buffered and ends the trace. False if any
+    // of it could not be written.
+    bool Close() {
+    	if (file == NULL) return true;
+    	bool ok = Flush();
+    	if (fclose(file) != 0) ok = false;
+    	file = NULL;
+    	if (!ok) cout << "Error! Unable to write trace!\n";
+    	return ok;
+    }
+
+    // Records NewReference() and returns the number of the new root.
+    int NewReference(size_t size, int site) {
+    	int flags = AllocationFlags(size, site);
+    	Op(TRACE_ROOT | flags);
+    	AllocationFields(flags, size, site);
+    	return roots++;
+    }
+
+    // Records New() off the object "depth" child links below root "root".
+    void New(int root, int depth, size_t size, int site) {
+    	int flags = AllocationFlags(size, site);
+    	Op(TRACE_NEW | flags);
+    	Root(root);
+    	Varint(depth);
+    	AllocationFields(flags, size, site);
+    }
+
+    // Records a store into the child field of the object at (root, depth)
+    // of the object at (value_root, value_depth), or of NULL if value_root
+    // is -1.
+    void WriteReference(int root, int depth, int value_root, int value_depth) {
+    	Op(TRACE_STORE | (value_root < 0 ? NULLVALUE : 0));
+    	Root(root);
+    	Varint(depth);
+    	if (value_root >= 0) {
+    		Root(value_root);
+    		Varint(value_depth);
+    	}
+    }
+
+    void EndLifetime(int root) {
+    	Op(TRACE_END);
+    	Root(root);
+    }
+
+    void TriggerGC() {
+    	Op(TRACE_GC);
+    }
+
+    long events;      // recorded so far
+    long bytes;       // trace size so far, header included
+
+  private:
+    static const size_t BUFFERBYTES = 1 << 20;
+
+    int AllocationFlags(size_t size, int site) {
+    	return (size == last_size ? SAMESIZE : 0) | (site == last_site ? SAMESITE : 0);
+    }
+
+    void AllocationFields(int flags, size_t size, int site) {
+    	if (!(flags & SAMESIZE)) {
+    		int64_t delta = int64_t(size) - int64_t(last_size);
+    		Varint((uint64_t(delta) << 1) ^ uint64_t(delta >> 63));
+    		last_size = size;
+    	}
+    	if (!(flags & SAMESITE)) {
+    		Varint(uint64_t(site + 1));
+    		last_site = site;
+    	}
+    }
+
+    void Op(int op) {
+    	events++;
+    	Byte(op);
+    }
+
+    void Root(int root) {
+    	Varint(uint64_t(roots - 1 - root));
+    }
+
+    void Varint(uint64_t v) {
+    	while (v >= 0x80) {
+    		Byte(int(v & 0x7f) | 0x80);
+    		v >>= 7;
+    	}
+    	Byte(int(v));
+    }
+
+    void Byte(int b) {
+    	buffer.push_back((unsigned char)b);
+    	bytes++;
+    	if (buffer.size() >= BUFFERBYTES) Flush();
+    }
+
+    bool Flush() {
+    	if (buffer.empty()) return true;
+    	bool ok = fwrite(&buffer[0], 1, buffer.size(), file) == buffer.size();
+    	buffer.clear();
+    	return ok;
+    }
+
+    FILE* file;
+    vector<unsigned char> buffer;
+    int roots;            // created so far
+    size_t last_size;
+    int last_site;
+
+    TraceWriter(const TraceWriter&);
+    TraceWriter& operator=(const TraceWriter&);
+};
+
+class TraceReader {
+  public:
+    TraceReader() {
+    	base = NULL;
+    	cursor = NULL;
+    	end = NULL;
+    	length = 0;
+    	roots = 0;
+    	last_size = 0;
+    	last_site = -1;
+    }
+
+    ~TraceReader() { Close(); }
+
+    // Maps the trace at "path" and positions the reader at its first event.
+    bool Open(const char* path) {
+    	Close();
+    	int fd = open(path, O_RDONLY);
+    	if (fd < 0) {
+    		cout << "Error! Unable to open trace " << path << "!\n";
+    		return false;
+    	}
+    	struct stat st;
+    	if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(TRACEMAGIC)) {
+    		cout << "Error! " << path << " is not a trace!\n";
+    		close(fd);
+    		return false;
+    	}
+    	length = size_t(st.st_size);
+    	void* p = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    	close(fd);
+    	if (p == MAP_FAILED) {
+    		cout << "Error! Unable to map trace " << path << "!\n";
+    		length = 0;
+    		return false;
+    	}
+    	madvise(p, length, MADV_SEQUENTIAL);
+    	base = (const unsigned char*)p;
+    	end = base + length;
+    	if (memcmp(base, TRACEMAGIC, sizeof(TRACEMAGIC)) != 0) {
+    		cout << "Error! " << path << " is not a trace!\n";
+    		Close();
+    		return false;
+    	}
+    	Rewind();
+    	return true;
+    }
+
+    void Close() {
+    	if (base != NULL) munmap((void*)base, length);
+    	base = NULL;
+    	cursor = NULL;
+    	end = NULL;
+    	length = 0;
+    }
+
+    // Back to the first event.
+    void Rewind() {
+    	cursor = base + sizeof(TRACEMAGIC);
+    	roots = 0;
+    	last_size = 0;
+    	last_site = -1;
+    }
+
+    // Decodes the next event into "e". False at the end of the trace, or
+    // at an event that runs past it.
+    bool Next(TraceEvent& e) {
+    	if (cursor >= end) return false;
+    	int op = *cursor++;
+    	e.op = op & OPBITS;
+    	switch (e.op) {
+    	case TRACE_ROOT:
+    		if (!Allocation(op, e)) return Truncated();
+    		e.root = roots++;
+    		return true;
+    	case TRACE_NEW:
+    		if (!Root(e.root) || !Field(e.depth) || !Allocation(op, e)) return Truncated();
+    		return true;
+    	case TRACE_STORE:
+    		if (!Root(e.root) || !Field(e.depth)) return Truncated();
+    		e.value_root = -1;
+    		e.value_depth = 0;
+    		if (!(op & NULLVALUE) && (!Root(e.value_root) || !Field(e.value_depth))) return Truncated();
+    		return true;
+    	case TRACE_END:
+    		if (!Root(e.root)) return Truncated();
+    		return true;
+    	case TRACE_GC:
+    		return true;
+    	}
+    	cout << "Error! Unknown trace event " << e.op << "!\n";
+    	cursor = end;
+    	return false;
+    }
+
+    size_t Bytes() const { return length; }
+
+  private:
+    bool Varint(uint64_t& v) {
+    	v = 0;
+    	for (int shift = 0; cursor < end && shift < 64; shift += 7) {
+    		unsigned char b = *cursor++;
+    		v |= uint64_t(b & 0x7f) << shift;
+    		if (b < 0x80) return true;
+    	}
+    	return false;
+    }
+
+    bool Field(int& field) {
+    	uint64_t v;
+    	if (!Varint(v)) return false;
+    	field = int(v);
+    	return true;
+    }
+
+    bool Root(int& root) {
+    	uint64_t v;
+    	if (!Varint(v) || v >= uint64_t(roots)) return false;
+    	root = roots - 1 - int(v);
+    	return true;
+    }
+
+    bool Allocation(int op, TraceEvent& e) {
+    	if (!(op & SAMESIZE)) {
+    		uint64_t v;
+    		if (!Varint(v)) return false;
+    		last_size = size_t(int64_t(last_size) + (int64_t(v >> 1) ^ -int64_t(v & 1)));
+    	}
+    	if (!(op & SAMESITE)) {
+    		uint64_t v;
+    		if (!Varint(v)) return false;
+    		last_site = int(v) - 1;
+    	}
+    	e.size = last_size;
+    	e.site = last_site;
+    	return true;
+    }
+
+    bool Truncated() {
+    	cout << "Error! Trace is truncated or corrupt!\n";
+    	cursor = end;
+    	return false;
+    }
+
+    const unsigned char* base;
+    const unsigned char* cursor;
+    const unsigned char* end;
+    size_t length;
+    int roots;
+    size_t last_size;
+    int last_site;
+
+    TraceReader(const TraceReader&);
+    TraceReader& operator=(const TraceReader&);
+};
+
+// The object "depth" child links below what root "root" holds, NULL if
+// the root has ended or the chain is shorter than that.
+template <class GC>
+typename GC::Object* TraceObject(GC& gc, vector<gc_roots::RootHandle>& handles, int root, int depth) {
+	typename GC::Object* obj = gc.Get(handles[root]);
+	for (int i = 0; i < depth && obj != NULL; i++) obj = gc.Child(obj);
+	return obj;
+}
+
+// Replays the trace from where the reader stands to its end on "gc".
+// Trace sites are registered with the collector as "site <n>". Events on
+// objects the collector does not have (because an allocation failed, or
+// the trace names a chain longer than the mutator built) cannot be
+// replayed; they are counted in "skipped". Returns the number of events
+// replayed.
+template <class GC>
+long Replay(GC& gc, TraceReader& trace, long& skipped) {
+	vector<gc_roots::RootHandle> handles;
+	vector<int> sites;
+	TraceEvent e;
+	long replayed = 0;
+	skipped = 0;
+	while (trace.Next(e)) {
+		int site = -1;
+		if ((e.op == TRACE_ROOT || e.op == TRACE_NEW) && e.site >= 0) {
+			while (int(sites.size()) <= e.site) {
+				sites.push_back(gc.AllocationSite("site " + to_string(sites.size())));
+			}
+			site = sites[e.site];
+		}
+		switch (e.op) {
+		case TRACE_ROOT:
+			handles.push_back(gc.NewReference("", e.size, site));
+			break;
+		case TRACE_NEW: {
+			typename GC::Object* parent = TraceObject(gc, handles, e.root, e.depth);
+			if (parent == NULL) {
+				skipped++;
+				continue;
+			}
+			gc.New("", parent, e.size, site);
+			break;
+		}
+		case TRACE_STORE: {
+			typename GC::Object* obj = TraceObject(gc, handles, e.root, e.depth);
+			typename GC::Object* value = NULL;
+			if (e.value_root >= 0) {
+				value = TraceObject(gc, handles, e.value_root, e.value_depth);
+			}
+			if (obj == NULL || (e.value_root >= 0 && value == NULL)) {
+				skipped++;
+				continue;
+			}
+			gc.WriteReference(obj, value);
+			break;
+		}
+		case TRACE_END:
+			gc.EndLifetime(handles[e.root]);
+			break;
+		case TRACE_GC:
+			gc.TriggerGC();
+			break;
+		}
+		replayed++;
+	}
+	return replayed;
+}
+
+} // gc_trace
+
+#endif /* GCTRACE_H_ */
@@ -0,0 +1,99 @@
+/*
+ * gc-types.h
+ *
+ *  Typed objects. A collector declares the object types it can hold as a
+ *  TypeList, with its own object class (the header every type derives
+ *  from) first. The header keeps the type's index in the list in its
+ *  "type" field. Every type describes itself to the collectors with a few
+ *  non-virtual members:
+ *
+ *    size_t Size() const             bytes the object takes up
+ *    Base* CopyTo(void* to)          copy-constructs it at "to"
+ *    template <class V>
+ *    void EachRef(V& v)              calls v(slot) on every reference slot
+ *
+ *  The TypeList turns those into tables of functions indexed by the type
+ *  field, so the collector pays one table lookup per object and then runs
+ *  code written for that type: EachRef() is instantiated for the
+ *  collector's own visitor and visits exactly the reference slots, with no
+ *  per-field checks. A table is only built for what a collector calls, so
+ *  the types of a heap whose objects never move need no CopyTo().
+ */
+
+#ifndef GCTYPES_H_
+#define GCTYPES_H_
+
+#include <stddef.h>
+
+namespace gc_types {
+
+// Position of T in Ts..., at compile time.
+template <class T, class... Ts> struct IndexOf;
+
+template <class T, class... Ts>
+struct IndexOf<T, T, Ts...> {
+	static const int value = 0;
+};
+
+template <class T, class U, class... Ts>
+struct IndexOf<T, U, Ts...> {
+	static const int value = 1 + IndexOf<T, Ts...>::value;
+};
+
+template <class Base, class... Ts>
+class TypeList {
+  public:
+    // Index of T, to be stored in the type field of a new T.
+    template <class T>
+    static int Id() {
+    	return IndexOf<T, Ts...>::value;
+    }
+
+    static size_t Size(Base* obj) {
+    	static size_t (*const fns[])(Base*) = { &SizeAs<Ts>... };
+    	return fns[obj->type](obj);
+    }
+
+    static Base* CopyTo(Base* obj, void* to) {
+    	static Base* (*const fns[])(Base*, void*) = { &CopyAs<Ts>... };
+    	return fns[obj->type](obj, to);
+    }
+
+    static void Destroy(Base* obj) {
+    	static void (*const fns[])(Base*) = { &DestroyAs<Ts>... };
+    	fns[obj->type](obj);
+    }
+
+    // Calls v(slot) on every reference slot of obj. One table per visitor
+    // type, each entry the type's EachRef() specialised for that visitor.
+    template <class V>
+    static void Trace(Base* obj, V& v) {
+    	static void (*const fns[])(Base*, V&) = { &TraceAs<Ts, V>... };
+    	fns[obj->type](obj, v);
+    }
+
+  private:
+    template <class T>
+    static size_t SizeAs(Base* obj) {
+    	return static_cast<T*>(obj)->Size();
+    }
+
+    template <class T>
+    static Base* CopyAs(Base* obj, void* to) {
+    	return static_cast<T*>(obj)->CopyTo(to);
+    }
+
+    template <class T>
+    static void DestroyAs(Base* obj) {
+    	static_cast<T*>(obj)->~T();
+    }
+
+    template <class T, class V>
+    static void TraceAs(Base* obj, V& v) {
+    	static_cast<T*>(obj)->EachRef(v);
+    }
+};
+
+} // gc_types
+
+#endif /* GCTYPES_H_ */
@@ -0,0 +1,158 @@
+/*
+ * heap-sizing.h
+ *
+ *  How big a heap should be, shared by the mark-sweep, stop-copy and
+ *  hybrid collectors.
+ *
+ *  A collector reserves its heap at the largest size it may grow to and
+ *  then only uses part of it, "heap bytes", which starts at the smallest.
+ *  After each collection the policy looks at what survived and at how much
+ *  of the time since the last collection went into this one. The heap
+ *  grows if the survivors take more than grow_occupancy percent of it, and
+ *  shrinks if they have stayed under shrink_occupancy percent for
+ *  shrink_after collections in a row; either way it is sized for them to
+ *  take the middle of the two occupancies. It also grows, by up to half
+ *  as much again, if collecting took more than gc_time_goal percent of the
+ *  time, but not past the survivors taking a quarter of the way from
+ *  shrink_occupancy to grow_occupancy, and not at all if they take less
+ *  than shrink_occupancy: a heap that is mostly empty already gains little
+ *  from growing, and one grown for time stays clear of shrinking. It
+ *  never leaves [min_bytes, max_bytes], and with both bounds the same it
+ *  keeps its size.
+ *
+ *  An allocation that does not fit even after a collection grows the heap
+ *  directly. One that does not fit the largest heap either is out of
+ *  memory: the collector prints its error, counts it here, calls
+ *  oom_handler if there is one, and returns NULL (or an invalid root
+ *  handle).
+ */
+
+#ifndef HEAPSIZING_H_
+#define HEAPSIZING_H_
+
+#include <iostream>
+#include <chrono>
+#include <algorithm>
+
+using namespace std;
+
+namespace gc_sizing {
+
+class HeapSizer {
+  public:
+    HeapSizer() {
+    	min_bytes = 0;
+    	max_bytes = 0;
+    	grow_occupancy = 70;
+    	shrink_occupancy = 30;
+    	shrink_after = 3;
+    	gc_time_goal = 10;
+    	oom_handler = NULL;
+    	low_collections = 0;
+    	grows = 0;
+    	shrinks = 0;
+    	out_of_memory = 0;
+    	gc_share = 0;
+    	last_end = chrono::steady_clock::now();
+    	start = last_end;
+    }
+
+    // The bounds, in bytes. The heap starts at min_bytes.
+    void Bounds(size_t min, size_t max) {
+    	min_bytes = min;
+    	max_bytes = std::max(min, max);
+    }
+
+    // Called as a collection starts.
+    void StartCollection() {
+    	start = chrono::steady_clock::now();
+    }
+
+    // Called once a collection of a heap of "heap_bytes" is over and
+    // "live_bytes" of it survived. Returns the size the heap should be
+    // from now on, which is "heap_bytes" if it is right as it is.
+    size_t AfterCollection(size_t heap_bytes, size_t live_bytes) {
+    	chrono::steady_clock::time_point end = chrono::steady_clock::now();
+    	double gc_us = chrono::duration<double, micro>(end - start).count();
+    	double total_us = chrono::duration<double, micro>(end - last_end).count();
+    	last_end = end;
+    	gc_share = total_us > 0 ? 100 * gc_us / total_us : 0;
+    	if (min_bytes == max_bytes) return heap_bytes;
+
+    	size_t fit = live_bytes * 200 / (grow_occupancy + shrink_occupancy);
+    	size_t target = heap_bytes;
+    	bool low = live_bytes * 100 < heap_bytes * shrink_occupancy;
+    	bool slow = gc_share > gc_time_goal && !low;
+    	if (live_bytes * 100 > heap_bytes * grow_occupancy || slow) {
+    		low_collections = 0;
+    		target = std::max(fit, heap_bytes);
+    		int floor_occupancy = (3 * shrink_occupancy + grow_occupancy) / 4;
+    		if (slow && floor_occupancy > 0) {
+    			target = std::max(target, std::min(heap_bytes + heap_bytes / 2,
+    			                                   live_bytes * 100 / floor_occupancy));
+    		}
+    	} else if (low) {
+    		if (++low_collections >= shrink_after) {
+    			low_collections = 0;
+    			target = fit;
+    		}
+    	} else {
+    		low_collections = 0;
+    	}
+    	return Clamp(target, live_bytes);
+    }
+
+    // The size a heap of "heap_bytes" grows to when an allocation of
+    // "bytes" does not fit it after a collection: by half, or by the
+    // allocation if that is more. "heap_bytes" when it cannot grow.
+    size_t GrowFor(size_t heap_bytes, size_t bytes) {
+    	return Clamp(heap_bytes + std::max(bytes, heap_bytes / 2), 0);
+    }
+
+    // Counts a resize from "from" to "to" bytes.
+    void Resized(size_t from, size_t to) {
+    	if (to > from) grows++;
+    	if (to < from) shrinks++;
+    }
+
+    // An allocation of "bytes" that did not fit the largest heap.
+    void OutOfMemory(size_t bytes) {
+    	out_of_memory++;
+    	if (oom_handler != NULL) oom_handler(bytes);
+    }
+
+    void ShowStats(size_t heap_bytes) {
+    	cout << "Heap size: " << heap_bytes << " bytes, between " << min_bytes << " and "
+    	     << max_bytes << endl;
+    	cout << "Grown " << grows << " times, shrunk " << shrinks << " times, "
+    	     << out_of_memory << " allocations out of memory" << endl;
+    	cout << "Last collection: " << gc_share << "% of the time" << endl << "------------------\n";
+    }
+
+    size_t min_bytes;
+    size_t max_bytes;
+    int grow_occupancy;       // percent
+    int shrink_occupancy;     // percent
+    int shrink_after;         // collections
+    double gc_time_goal;      // percent of the time spent collecting
+    void (*oom_handler)(size_t bytes);
+
+    int low_collections;
+    long grows;
+    long shrinks;
+    long out_of_memory;
+    double gc_share;
+
+  private:
+    // "bytes" within the bounds, and never less than "floor".
+    size_t Clamp(size_t bytes, size_t floor) {
+    	return std::max(std::min(std::max(bytes, min_bytes), max_bytes), std::min(floor, max_bytes));
+    }
+
+    chrono::steady_clock::time_point start;
+    chrono::steady_clock::time_point last_end;
+};
+
+} // gc_sizing
+
+#endif /* HEAPSIZING_H_ */
@@ -28,340 +28,1428 @@
  parsing or writing an adaptive mechanism where it intelligently assigns the
  objects directly to their respective heaps.
 
+ The stop-copy heap is a pair of semispaces collected the Cheney way, and
+ promotion is part of the same copy: an object old enough is moved into a
+ mark-sweep slot instead of to-space, and the forwarding pointer it leaves
+ behind redirects every other reference to it. Promotion costs one step per
+ promoted object.
+
+ A stop-copy collection only traces the young objects, so it has to know
+ about every pointer from the mark-sweep heap into the stop-copy heap
+ without looking at the whole mark-sweep heap. The mark-sweep slab is
+ divided into cards; storing a young pointer into an old object dirties
+ its card, and the collection scans only the dirty cards for extra roots.
+
+ Both heaps hold the typed objects of hyb-graph-api.h. The copy, the
+ promotion, the card scan and the mark visit their reference fields
+ through Types; the nursery is walked object by object by their sizes,
+ and an object in the mark-sweep heap takes up a run of granules.
+
+ Every mutator thread allocates in a thread-local allocation buffer (TLAB)
+ that it takes out of the nursery, so the shared bump pointer is only
+ touched, under a lock, once per TLAB. A thread that allocates a lot gets
+ bigger TLABs, aiming at TLABREFILLS refills per collection, and one that
+ allocates little does not hold on to much unused nursery.
+
+ Each of those threads attaches itself as a mutator with roots of its own,
+ and every collection first brings all of them to a safepoint (see
+ safepoint.h).
+
+ The age at which objects are promoted adapts to what the program does.
+ After every stop-copy collection the survivors are counted by age, and the
+ threshold drops to the age at which they start to crowd the nursery, so
+ a nursery that fills up with survivors promotes them on the next
+ collection rather than after "threshold" of them. The mark-sweep
+ collection in turn counts how many of the objects promoted since the last
+ one are dead already; if that is too many, they were promoted too soon
+ and the threshold goes up.
+
+ Objects can also skip the nursery altogether. The program names the
+ allocation sites it allocates at, and each site keeps count of how many
+ of its objects live to be promoted. A site where nearly all of them do is
+ pretenured: its objects are allocated in the mark-sweep heap from then on,
+ and are not copied through the nursery first. Should they start dying
+ before the next mark-sweep collection, the site goes back to the nursery.
+
+ Neither heap need have a fixed size. Each is reserved at its largest and
+ resized within that after its own collections (see heap-sizing.h). The
+ nursery is just given a different limit; the mark-sweep heap gains
+ granules at the end of the slab, and gives back only free granules at the
+ end.
+
  */
 
+#include <new>
+
 #include "hyb-graph-api.h"
 
+// Heap sizes in bytes
 #ifndef SCHEAPSIZE
-#define SCHEAPSIZE 100
+#define SCHEAPSIZE 6400
 #endif
 
 #ifndef MSHEAPSIZE
-#define MSHEAPSIZE 100
+#define MSHEAPSIZE 6400
 #endif
 
 #ifndef THRESHOLD
 #define THRESHOLD 3
 #endif
 
+// Highest tenuring threshold, and the share of the nursery, in percent,
+// that the survivors of a stop-copy collection may take before the
+// threshold is lowered
+#ifndef MAXTENURE
+#define MAXTENURE 15
+#endif
+
+#ifndef TARGETSURVIVOR
+#define TARGETSURVIVOR 50
+#endif
+
+// Percentage of the promoted objects found dead by the next mark-sweep
+// collection above which the tenuring threshold is raised
+#ifndef PREMATUREDEATH
+#define PREMATUREDEATH 50
+#endif
+
+// A nursery site is pretenured once PRETENURESAMPLE objects have been
+// allocated at it, if at least PRETENURERATIO percent as many have been
+// promoted; a pretenured site goes back to the nursery if more than the
+// rest of them die young
+#ifndef PRETENURESAMPLE
+#define PRETENURESAMPLE 64
+#endif
+
+#ifndef PRETENURERATIO
+#define PRETENURERATIO 80
+#endif
+
+// Collections an allocation runs before it gives up on a full nursery: one
+// that finds the survivors filling it and lowers the threshold, one whose
+// promotions may fail and collect the mark-sweep heap, and one that then
+// promotes
+#ifndef GCRETRIES
+#define GCRETRIES 3
+#endif
+
+#ifndef MARKSTACKSIZE
+#define MARKSTACKSIZE 4096
+#endif
+
+#ifndef GCTHREADS
+#define GCTHREADS 1
+#endif
+
+// log2 of the mark-sweep granules per card
+#ifndef CARDSHIFT
+#define CARDSHIFT 6
+#endif
+
+// TLABs a thread should take per collection, and the smallest TLAB in
+// objects
+#ifndef TLABREFILLS
+#define TLABREFILLS 50
+#endif
+
+#ifndef TLABMIN
+#define TLABMIN 8
+#endif
+
 
 namespace hyb_graph_api {
 
+// Objects in the mark-sweep heap start on a granule boundary and take up
+// whole granules.
+const size_t GRANULE = 16;
+
+static int Granules(size_t size) {
+	return int((size + GRANULE - 1) / GRANULE);
+}
+
 // default constructor, initializing heap sizes of both the stop-copy and
 // mark-sweep heaps. We also initialize "threshold", which is an age
 // threshold after which objects will move from the stop-copy heap to
-// the mark-sweep heap.
+// the mark-sweep heap; it is only the starting point, see AdaptThreshold().
 HybGraphUtil :: HybGraphUtil() {
-	ms_max_objects = MSHEAPSIZE;
-	sc_max_objects = SCHEAPSIZE;
+	ms_sizing.Bounds(MSHEAPSIZE, MSHEAPSIZE);
+	sc_sizing.Bounds(SCHEAPSIZE, SCHEAPSIZE);
+	state = false;
+	InitTenuring(THRESHOLD);
+	num_objects = 0;
+	MSInitHeap();
+	SCInitSpaces();
+	default_tlab = AddTlab();
+}
+
+// Lets the user define mark-sweep, stop-copy heap sizes (in bytes) and the
+// initial age threshold.
+HybGraphUtil :: HybGraphUtil(size_t ms_heap_bytes, size_t sc_heap_bytes, int thres) {
+	ms_sizing.Bounds(ms_heap_bytes, ms_heap_bytes);
+	sc_sizing.Bounds(sc_heap_bytes, sc_heap_bytes);
+	InitTenuring(thres);
 	state = false;
-	first = NULL;
-	last = NULL;
-	threshold = THRESHOLD;
 	num_objects = 0;
+	MSInitHeap();
+	SCInitSpaces();
+	default_tlab = AddTlab();
 }
 
-// Lets the user define mark-sweep, stop-copy heap sizes and age
-// threshold.
-HybGraphUtil :: HybGraphUtil(int ms_heap, int sc_heap, int thres) {
-	ms_max_objects = ms_heap;
-	sc_max_objects = sc_heap;
-	threshold = thres;
+// The same with heaps that start at the smaller sizes and may grow to
+// "ms_max" and "sc_max" bytes.
+HybGraphUtil :: HybGraphUtil(size_t ms_min_bytes, size_t sc_min_bytes, int thres,
+                             size_t ms_max, size_t sc_max) {
+	ms_sizing.Bounds(ms_min_bytes, ms_max);
+	sc_sizing.Bounds(sc_min_bytes, sc_max);
+	InitTenuring(thres);
 	state = false;
-	first = NULL;
-	last = NULL;
 	num_objects = 0;
+	MSInitHeap();
+	SCInitSpaces();
+	default_tlab = AddTlab();
+}
+
+// Destroys the objects left in either heap and releases both semispaces,
+// the mark-sweep slab and the TLABs.
+HybGraphUtil :: ~HybGraphUtil() {
+	for (int i = 0; i < int(safepoints.mutators.size()); i++) {
+		delete safepoints.mutators[i];
+	}
+	RetireTlabs();
+	for (int i = 0; i < int(tlabs.size()); i++) {
+		delete tlabs[i];
+	}
+	Flush(space[state], top);
+	for (int w = 0; w < int(alloc_bits.size()); w++) {
+		for (uint64_t bits = alloc_bits[w]; bits != 0; bits &= bits - 1) {
+			Types::Destroy(ObjectAt(w * 64 + __builtin_ctzll(bits)));
+		}
+	}
+	delete[] space[0];
+	delete[] space[1];
+	delete[] ms_heap;
 }
 
 // Function to start the Garbage Collection process. Sometimes used to
 // force garbage collection, but it is usually called when the heap is
 // full and it has to be freed up.
 void HybGraphUtil :: TriggerGC() {
-	if (int(h[state].size()) > 0) 
-    SCTriggerGC();
+	TriggerGC(gc_events::EXPLICIT);
+}
+
+// TriggerGC() for "cause", one of the causes in gc-events.h, which the
+// event log records with the collection.
+void HybGraphUtil :: TriggerGC(int cause) {
+	if (!safepoints.StopTheWorld()) return;
+	if (SCNumObjects() > 0) 
+    SCTriggerGC(cause);
 	else 
-    MSTriggerGC();
+    MSTriggerGC(cause);
+	safepoints.ResumeTheWorld();
 }
 
 
+// Evacuates what one reference field of a to-space object points to and
+// redirects the field to the copy.
+struct EvacuateVisitor {
+	HybGraphUtil* gc;
+	char*& free;
+
+	EvacuateVisitor(HybGraphUtil* collector, char*& to) : gc(collector), free(to) {}
+
+	void operator()(Object*& slot) {
+		slot = gc->Evacuate(slot, free);
+	}
+};
+
 // Function to start the Garbage Collection process in the stop-copy
-// heap. It is called by the TriggerGC() function. 
+// heap. It is called by the TriggerGC() function. A Cheney copy as in
+// SCGraphUtil: the roots and the objects the dirty cards point to are
+// evacuated first, then to-space is scanned until it has no uncopied
+// children left, every reference field of every type visited through
+// Types. Every survivor gets a year older. A root that has grown
+// older than the threshold is promoted with DFSShift(). Every root is
+// updated in place.
+// Objects that could not be promoted because the mark-sweep heap was full
+// stay young, and the mark-sweep heap is collected once the copy is over.
+// The mutator threads' roots count as roots, and the parents held by
+// New() are evacuated but not promoted. Like every collection this runs
+// with the mutators stopped. The nursery is resized for the survivors
+// before the next threshold is chosen for it.
 void HybGraphUtil :: SCTriggerGC() {
-	for(int i = 0; i < (int)sc_roots.size(); i++) {
-		
-    sc_roots[i]->age++;
-		if (sc_roots[i]->age > threshold) {
-			DFSShift(sc_roots[i]);
-			i--;
+	SCTriggerGC(gc_events::EXPLICIT);
+}
+
+// SCTriggerGC() for "cause", as in TriggerGC(int). The promotions done by
+// DFSShift() are timed as their own phase; the event ends before a
+// promotion failure collects the mark-sweep heap, which is an event of its
+// own.
+void HybGraphUtil :: SCTriggerGC(int cause) {
+	if (!safepoints.StopTheWorld()) return;
+	events.Begin(cause, gc_events::YOUNG);
+	size_t used = SCUsedBytes();
+	sc_sizing.StartCollection();
+	RetireTlabs();
+	if (events.On()) events.Before(SCNumObjects(), used);
+	promotion_failed = false;
+	promoted_bytes = 0;
+	long promoted_before = promoted_since;
+	char* to = space[!state];
+	char* scan = to;
+	char* free = to;
+
+	vector <Object**> slots;
+	RootSlots(slots);
+	for (int i = 0; i < int(slots.size()); i++) {
+		Object* root = *slots[i];
+		if (InNursery(root) && root->forward == NULL && root->age >= threshold) {
+			events.Phase(gc_events::ROOTS);
+			*slots[i] = DFSShift(root, free);
+			events.Phase(gc_events::PROMOTE);
 		} else {
-			DFSCopy(sc_roots[i], h[!state]);
-    }
+			*slots[i] = Evacuate(root, free);
+		}
+	}
+	if (held != NULL) held = Evacuate(held, free);
+	for (int m = 0; m < int(safepoints.mutators.size()); m++) {
+		Mutator* mutator = safepoints.mutators[m];
+		if (mutator->held != NULL) mutator->held = Evacuate(mutator->held, free);
+	}
 
+	ScanDirtyCards(free);
+	events.Phase(gc_events::ROOTS);
+	EvacuateVisitor visitor(this, free);
+	while (scan < free) {
+		Object* obj = (Object*)scan;
+		Types::Trace(obj, visitor);
+		scan += SlotBytes(Types::Size(obj));
 	}
-	Flush(h[state]);
+
+	Flush(space[state], top);
+	events.Phase(gc_events::COPY);
 	state = !state;
+	top = free;
+	limit = to + sc_max_bytes;
+	size_t bytes = sc_sizing.AfterCollection(sc_max_bytes, free - to) / sizeof(Object) * sizeof(Object);
+	if (bytes != sc_max_bytes) {
+		sc_sizing.Resized(sc_max_bytes, bytes);
+		ResizeNursery(bytes);
+	}
+	AdaptThreshold(to, free);
+	EvaluateSites(false);
+	events.Promoted(promoted_since - promoted_before, promoted_bytes);
+	if (events.On()) events.After(SCNumObjects(), SCUsedBytes());
+	events.End();
+
+	if (promotion_failed) MSTriggerGC(gc_events::PROMOTION_FAILURE);
+	safepoints.ResumeTheWorld();
+}
+
+// Sets the nursery to "bytes" by moving the limit of the active
+// semispace. Everything already in it stays below the limit.
+void HybGraphUtil :: ResizeNursery(size_t bytes) {
+	sc_max_bytes = bytes;
+	limit = space[state] + sc_max_bytes;
+}
+
+// Grows the nursery, for allocations that still fail after GCRETRIES
+// collections. False once it is at its largest. TLABs are taken out of
+// the nursery under tlab_lock, so the limit moves under it too.
+bool HybGraphUtil :: GrowNursery() {
+	lock_guard<mutex> guard(tlab_lock);
+	size_t bytes = sc_sizing.GrowFor(sc_max_bytes, sizeof(Object)) / sizeof(Object) * sizeof(Object);
+	if (bytes <= sc_max_bytes) return false;
+	sc_sizing.Resized(sc_max_bytes, bytes);
+	ResizeNursery(bytes);
+	return true;
+}
+
+// The addresses of every root reference: the collector's roots and each
+// mutator's roots.
+void HybGraphUtil :: RootSlots(vector <Object**>& slots) {
+	for (int i = 0; i < roots.size(); i++) {
+		slots.push_back(&roots[i]);
+	}
+	for (int m = 0; m < int(safepoints.mutators.size()); m++) {
+		gc_roots::RootTable <Object>& more = safepoints.mutators[m]->roots;
+		for (int i = 0; i < more.size(); i++) {
+			slots.push_back(&more[i]);
+		}
+	}
 }
 
+// Evacuates, or promotes if it is old enough, the young object one field
+// of an old object points to, and notes whether the field still points
+// into the stop-copy heap afterwards. Promotion may already have stored a
+// to-space object there.
+struct CardVisitor {
+	HybGraphUtil* gc;
+	char*& free;
+	bool young;
+
+	CardVisitor(HybGraphUtil* collector, char*& to) : gc(collector), free(to), young(false) {}
+
+	void operator()(Object*& slot) {
+		Object* child = slot;
+		if (child == NULL || gc->InMSHeap(child)) return;
+
+		if (gc->InNursery(child)) {
+			if (child->forward == NULL && child->age >= gc->threshold) {
+				child = gc->DFSShift(child, free);
+			} else {
+				child = gc->Evacuate(child, free);
+			}
+			slot = child;
+		}
+		if (!gc->InMSHeap(child)) young = true;
+	}
+};
+
+// Treats the stop-copy objects referred to from dirty cards as roots. Each
+// card on the remembered set is cleaned and the fields of the objects that
+// start in it looked at; the young objects they point to are evacuated, or
+// promoted if they are old enough, and the field updated. A card that still points into the
+// stop-copy heap afterwards stays dirty and on the list for the next
+// collection. The work is proportional to the number of dirty cards, not
+// to the size of the mark-sweep heap.
+void HybGraphUtil :: ScanDirtyCards(char*& free) {
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	dirty_cards = int(dirty_list.size());
+
+	vector <int> still_dirty;
+	CardVisitor visitor(this, free);
+	for (int i = 0; i < int(dirty_list.size()); i++) {
+		int card = dirty_list[i];
+		cards[card] = 0;
+		int first = card << CARDSHIFT;
+		int last = min(first + (1 << CARDSHIFT), ms_granules);
+		visitor.young = false;
+		for (int slot = first; slot < last; slot++) {
+			if (gc_bitmap::Test(alloc_bits, slot)) Types::Trace(ObjectAt(slot), visitor);
+		}
+		if (visitor.young && cards[card] == 0) {
+			cards[card] = 1;
+			still_dirty.push_back(card);
+		}
+	}
+	dirty_list.swap(still_dirty);
+
+	card_scan_us = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+}
+
+// Starts the tenuring threshold at "thres", within 1 and MAXTENURE, with
+// nothing observed yet.
+void HybGraphUtil :: InitTenuring(int thres) {
+	threshold = min(max(thres, 1), MAXTENURE);
+	tenure_target = threshold;
+	capacity_threshold = MAXTENURE;
+	sc_cycles = 0;
+	age_bytes.assign(MAXTENURE + 1, 0);
+	promoted_bytes = 0;
+	promoted_since = 0;
+	premature_deaths = 0;
+	tenuring_log.clear();
+}
+
+// Chooses the tenuring threshold for the next stop-copy collection from the
+// survivors of this one, the objects in [to, end). They are counted by age,
+// and capacity_threshold is the youngest age at which the total, from the
+// youngest up, passes TARGETSURVIVOR percent of the nursery: promoting from
+// that age on keeps the survivors within it. The threshold is the lower of
+// that and tenure_target. Costs one step per survivor.
+void HybGraphUtil :: AdaptThreshold(char* to, char* end) {
+	age_bytes.assign(MAXTENURE + 1, 0);
+	for (char* p = to; p < end; ) {
+		Object* obj = (Object*)p;
+		size_t bytes = SlotBytes(Types::Size(obj));
+		age_bytes[min(obj->age, MAXTENURE)] += bytes;
+		p += bytes;
+	}
+
+	size_t target = sc_max_bytes / 100 * TARGETSURVIVOR;
+	size_t total = 0;
+	capacity_threshold = MAXTENURE;
+	for (int age = 1; age <= MAXTENURE; age++) {
+		total += age_bytes[age];
+		if (total > target) {
+			capacity_threshold = age;
+			break;
+		}
+	}
+	threshold = min(tenure_target, capacity_threshold);
+
+	sc_cycles++;
+	TenuringRecord record;
+	record.cycle = sc_cycles;
+	record.survived = end - to;
+	record.promoted = promoted_bytes;
+	record.threshold = threshold;
+	tenuring_log.push_back(record);
+}
+
+// Shows the threshold each stop-copy collection chose, with what survived
+// it and what it promoted, and the survivors of the last one by age.
+void HybGraphUtil :: ShowTenuringStats() {
+	for (int i = 0; i < int(tenuring_log.size()); i++) {
+		TenuringRecord& record = tenuring_log[i];
+		cout << "Cycle " << record.cycle << ": survived " << record.survived
+		     << " bytes, promoted " << record.promoted << " bytes, threshold "
+		     << record.threshold << endl;
+	}
+	cout << "Survivors by age:";
+	for (int age = 1; age <= MAXTENURE; age++) {
+		if (age_bytes[age] > 0) cout << " " << age << ":" << age_bytes[age];
+	}
+	cout << endl;
+	cout << "Tenuring threshold: " << threshold << " (target " << tenure_target
+	     << ", capacity " << capacity_threshold << ")" << endl << "------------------\n";
+}
+
+// The id of the allocation site called "name", registering it the first
+// time. Sites are registered before mutator threads allocate at them.
+int HybGraphUtil :: AllocationSiteId(const string& name) {
+	for (int i = 0; i < int(sites.size()); i++) {
+		if (sites[i].name == name) return i;
+	}
+	AllocationSite site;
+	site.name = name;
+	sites.push_back(site);
+	return int(sites.size()) - 1;
+}
+
+// Allocates an object for "site": in the mark-sweep heap if the site is
+// pretenured, collecting that first if it is full, and in the TLAB
+// otherwise or if the mark-sweep heap has no room even then. NULL when
+// the nursery is full too. Site -1 is plain nursery allocation.
+Object* HybGraphUtil :: SiteAllocate(Tlab& tlab, const string& desc, int site, size_t size) {
+	if (site < 0) return SCAllocate(tlab, desc, size);
+
+	if (sites[site].pretenured) {
+		for (int z = 0; z < 2; z++) {
+			if (z > 0) MSTriggerGC(gc_events::HEAP_FULL);
+			lock_guard<mutex> guard(ms_lock);
+			Object* obj = MSAllocate(desc, size);
+			if (obj != NULL) {
+				obj->site = site;
+				gc_bitmap::Set(recent_bits, Slot(obj));
+				sites[site].allocated++;
+				return obj;
+			}
+		}
+	}
+
+	Object* obj = SCAllocate(tlab, desc, size);
+	if (obj != NULL) {
+		obj->site = site;
+		__atomic_fetch_add(&sites[site].allocated, 1, __ATOMIC_RELAXED);
+	}
+	return obj;
+}
+
+// Looks at the nursery sites after a stop-copy collection, or at the
+// pretenured ones after a mark-sweep collection, once PRETENURESAMPLE
+// objects have been allocated at them. A nursery site is pretenured if
+// at least PRETENURERATIO percent as many of its objects were promoted
+// meanwhile, and a pretenured site goes back to the nursery if more than
+// 100 - PRETENURERATIO percent of them died before a mark-sweep
+// collection. Either way its counts start over.
+void HybGraphUtil :: EvaluateSites(bool after_ms) {
+	for (int i = 0; i < int(sites.size()); i++) {
+		AllocationSite& site = sites[i];
+		if (site.pretenured != after_ms || site.allocated < PRETENURESAMPLE) continue;
+
+		bool change;
+		if (site.pretenured) {
+			change = site.died_young * 100 > site.allocated * (100 - PRETENURERATIO);
+		} else {
+			change = site.tenured * 100 >= site.allocated * PRETENURERATIO;
+		}
+		if (change) {
+			site.pretenured = !site.pretenured;
+			site.switches++;
+		}
+		site.allocated = 0;
+		site.tenured = 0;
+		site.died_young = 0;
+	}
+}
+
+// Shows where each allocation site allocates and what its objects have
+// done since it was last looked at.
+void HybGraphUtil :: ShowSiteStats() {
+	for (int i = 0; i < int(sites.size()); i++) {
+		AllocationSite& site = sites[i];
+		cout << "Site " << site.name << ": " << (site.pretenured ? "pretenured" : "nursery")
+		     << ", allocated " << site.allocated << ", promoted " << site.tenured
+		     << ", died young " << site.died_young << ", " << site.switches << " switches" << endl;
+	}
+	cout << "------------------\n";
+}
+
+// Shows how many cards the last stop-copy collection scanned and how long
+// it took.
+void HybGraphUtil :: ShowCardStats() {
+	cout << "Dirty cards: " << dirty_cards << " of " << cards.size() << endl;
+	cout << "Card scan time: " << card_scan_us << " us" << endl << "------------------\n";
+}
+
+
+// Promotes the young object one field of a promoted object points to, and
+// queues the copy for DFSShift() to go on from. An object copied or
+// promoted already is only redirected to, and one the mark-sweep heap has
+// no room for is evacuated instead; a young object left behind goes
+// through the card barrier.
+struct ShiftVisitor {
+	HybGraphUtil* gc;
+	char*& free;
+	Object* obj;
+
+	ShiftVisitor(HybGraphUtil* collector, char*& to) : gc(collector), free(to), obj(NULL) {}
+
+	void operator()(Object*& slot) {
+		Object* child = slot;
+		if (!gc->InNursery(child)) return;
+
+		if (child->forward != NULL) {
+			gc->WriteReference(obj, &slot, child->forward);
+			return;
+		}
+		Object* moved = gc->Promote(child);
+		if (moved == NULL) {
+			gc->WriteReference(obj, &slot, gc->Evacuate(child, free));
+			return;
+		}
+		slot = moved;
+		gc->shift_stack.push_back(moved);
+	}
+};
 
 // This is one of the most important functionalities of the hybrid
-// algorithm. This function performs a DFS from each of the root objects
-// in the stop-copy heap and then copies them to mark-sweep heap. This
-// copying is done to those roots whose age is greater than or equal to
-// the age threshold specified. The process is essentially creating a
-// new root object in the Mark-sweep heap and then copying all the chained
-// objects one by one. This is called during a Garbage Collection call,
-// therefore the heap of stop-copy is automatically flushed by another
-// utility function.
-void HybGraphUtil :: DFSShift(Object *root) {
-	SCEndLifetime(root);
-  MSNewReference("moved");
-  EndLifetime(root);
-  Object* new_root = ms_roots[ms_roots.size() - 1];
-	root = root->child;
-	while (root != NULL) {
-		Object *parent = new_root;
-		// Moving the children of the moved root.
-		// For facilitating mark and sweep.
-		new_root = MSNew("desc", parent);
-		root = root->child;
+// algorithm: promotion. The object itself moves into the mark-sweep heap,
+// keeping its description and age, and leaves a forwarding pointer so
+// every other reference to it is redirected as the copy goes on. The young
+// objects it refers to are promoted along with it, and theirs in turn,
+// depth first over shift_stack, so the promoted objects never point back
+// into the stop-copy heap. Should the mark-sweep heap run out, the rest
+// stays young and the card barrier records the pointers to it. Costs one
+// step per promoted object. Returns the object's new address.
+Object* HybGraphUtil :: DFSShift(Object* root, char*& free) {
+	Object* head = Promote(root);
+	if (head == NULL) return Evacuate(root, free);
+
+	ShiftVisitor visitor(this, free);
+	shift_stack.push_back(head);
+	while (!shift_stack.empty()) {
+		visitor.obj = shift_stack.back();
+		shift_stack.pop_back();
+		Types::Trace(visitor.obj, visitor);
 	}
+	return head;
 }
 
+// Moves one stop-copy object into the mark-sweep heap and forwards it
+// there. The description is handed over rather than copied. NULL when the
+// mark-sweep heap is full.
+Object* HybGraphUtil :: Promote(Object* obj) {
+	int slot = MSReserve(Types::Size(obj));
+	if (slot < 0) {
+		promotion_failed = true;
+		return NULL;
+	}
 
-// This is a basic utility function of the stop-copy algorithm. This function
-// copies live objects, ie, objects reachable from the roots from one heap to
-// another. The other heap is flushed, thereby reclaiming space occupied by the
-// "garbage".
-void HybGraphUtil :: DFSCopy(Object* root, vector<Object*> &to) {
-	if (root == NULL) return;
+	string desc;
+	desc.swap(obj->desc);
+	Object* moved = Types::CopyTo(obj, ObjectAt(slot));
+	moved->desc.swap(desc);
+	moved->forward = NULL;
+	moved->age = obj->age + 1;
+	obj->forward = moved;
+	gc_bitmap::Set(recent_bits, slot);
+	promoted_bytes += Granules(Types::Size(obj)) * GRANULE;
+	promoted_since++;
+	if (obj->site >= 0) sites[obj->site].tenured++;
+	return moved;
+}
 
-	to.push_back(root);
-	DFSCopy(root->child, to);
+
+// This is a basic utility function of the stop-copy algorithm. Copies one
+// object to to-space at "free", a year older, and leaves a forwarding
+// pointer in the original; an object copied or promoted already just
+// returns its forwarding pointer. Objects outside the stop-copy heap are
+// returned as they are.
+Object* HybGraphUtil :: Evacuate(Object* obj, char*& free) {
+	if (!InNursery(obj)) return obj;
+	if (obj->forward != NULL) return obj->forward;
+
+	Object* copy = Types::CopyTo(obj, free);
+	copy->forward = NULL;
+	copy->age++;
+	free += SlotBytes(Types::Size(obj));
+	obj->forward = copy;
+	return copy;
 }
 
 
-// All the elements of the heap are dropped, the destructors of the objects are
-// called and we retain the heap (vector) of size 0. Hence freeing the heap.
-void HybGraphUtil :: Flush(vector <Object*>& v) {
-	v.clear();
+// Runs the destructors of the objects left in a semispace, live copies and
+// garbage alike. The memory itself is reused by the next collection.
+void HybGraphUtil :: Flush(char* base, char* end) {
+	for (char* p = base; p < end; ) {
+		Object* obj = (Object*)p;
+		p += SlotBytes(Types::Size(obj));
+		Types::Destroy(obj);
+	}
 }
 
+// Reserves the two semispaces of the stop-copy heap at the largest nursery
+// size, with both bounds rounded down to whole objects, and starts the
+// nursery at the smallest. Nothing is constructed in them until
+// SCAllocate() or Evacuate() places an object there.
+void HybGraphUtil :: SCInitSpaces() {
+	held = NULL;
+	promotion_failed = false;
+	sc_sizing.Bounds(sc_sizing.min_bytes / sizeof(Object) * sizeof(Object),
+	                 sc_sizing.max_bytes / sizeof(Object) * sizeof(Object));
+	sc_max_bytes = sc_sizing.min_bytes;
+	space[0] = new char[sc_sizing.max_bytes];
+	space[1] = new char[sc_sizing.max_bytes];
+	top = space[state];
+	limit = space[state] + sc_max_bytes;
+}
+
+// Allocation in the active semispace through the default TLAB, NULL when
+// the semispace is full.
+Object* HybGraphUtil :: SCAllocate(const string& desc) {
+	return SCAllocate(*default_tlab, desc);
+}
+
+// Registers the TLAB of a new mutator thread. It starts out empty, and
+// sized for TLABREFILLS refills to fill the nursery.
+Tlab* HybGraphUtil :: AddTlab() {
+	lock_guard<mutex> guard(tlab_lock);
+	Tlab* tlab = new Tlab();
+	tlab->size = max(sc_max_bytes / TLABREFILLS / sizeof(Object), size_t(TLABMIN)) * sizeof(Object);
+	tlab->rate = double(tlab->size) * TLABREFILLS;
+	tlabs.push_back(tlab);
+	return tlab;
+}
+
+// Slow path of SCAllocate(): closes the thread's TLAB and gives it a new
+// one of its current size out of the nursery, or of "bytes" for an object
+// bigger than that, or the rest of the nursery if that is less. False when
+// the nursery has no room for "bytes" and it is time to collect.
+bool HybGraphUtil :: RefillTlab(Tlab& tlab, size_t bytes) {
+	lock_guard<mutex> guard(tlab_lock);
+	size_t left = limit - top;
+	if (left < bytes) return false;
+
+	CloseTlab(tlab);
+	bytes = min(max(tlab.size, bytes), left);
+	tlab.top = top;
+	tlab.end = top + bytes;
+	top += bytes;
+	tlab.refills++;
+	return true;
+}
+
+// Ends a TLAB. Its unused end is filled with empty objects, so the
+// semispace stays a run of objects that can be walked.
+void HybGraphUtil :: CloseTlab(Tlab& tlab) {
+	for (char* p = tlab.top; p < tlab.end; p += sizeof(Object)) {
+		new (p) Object();
+	}
+	tlab.top = NULL;
+	tlab.end = NULL;
+}
+
+// Ends every TLAB.
+void HybGraphUtil :: CloseTlabs() {
+	for (int i = 0; i < int(tlabs.size()); i++) {
+		CloseTlab(*tlabs[i]);
+	}
+}
+
+// Ends every TLAB before a stop-copy collection, as CloseTlabs() does, so
+// the semispace can be walked by Flush(). Each thread's next TLAB is sized
+// from its average allocation per cycle, so that it takes about
+// TLABREFILLS of them, but never more than its share of the nursery.
+void HybGraphUtil :: RetireTlabs() {
+	CloseTlabs();
+	size_t share = max(sc_max_bytes / tlabs.size() / sizeof(Object), size_t(TLABMIN));
+	for (int i = 0; i < int(tlabs.size()); i++) {
+		Tlab* tlab = tlabs[i];
+		tlab->rate = (tlab->rate + tlab->allocated) / 2;
+		tlab->allocated = 0;
+		size_t objects = size_t(tlab->rate / TLABREFILLS) / sizeof(Object);
+		tlab->size = min(max(objects, size_t(TLABMIN)), share) * sizeof(Object);
+	}
+}
+
+// Whether an object lives in the active semispace of the stop-copy heap.
+// During a collection that is from-space.
+bool HybGraphUtil :: InNursery(Object* obj) {
+	return (char*)obj >= space[state] && (char*)obj < top;
+}
 
-// Shows memory usage for the stop-copy component of the heap
+// Number of objects in the active semispace, counting the empty objects
+// the unused ends of TLABs are filled with. The TLABs are closed first so
+// the semispace can be walked.
+int HybGraphUtil :: SCNumObjects() {
+	CloseTlabs();
+	int objects = 0;
+	for (char* p = space[state]; p < top; p += SlotBytes(Types::Size((Object*)p))) {
+		objects++;
+	}
+	return objects;
+}
+
+// Bytes of the active semispace taken by objects, not counting the unused
+// ends of TLABs.
+size_t HybGraphUtil :: SCUsedBytes() {
+	size_t unused = 0;
+	for (int i = 0; i < int(tlabs.size()); i++) {
+		unused += tlabs[i]->end - tlabs[i]->top;
+	}
+	return (top - space[state]) - unused;
+}
+
+
+// Shows memory usage, in bytes, for the stop-copy component of the heap
 void HybGraphUtil :: SCShowMemoryUsage() {
-	cout << "Used Memory: " << (h[state].size()) << endl;
-	cout << "Free Memory: " << sc_max_objects - (h[state].size()) << endl << "------------------\n";
+	size_t used = SCUsedBytes();
+	cout << "Used Memory: " << used << " bytes" << endl;
+	cout << "Free Memory: " << sc_max_bytes - used << " bytes" << endl << "------------------\n";
 
 }
 
-// Shows memory usage for the entire heap, both the mark-sweep component
-// and stop copy component
+// Shows the size of each heap and how it has been resized.
+void HybGraphUtil :: ShowSizingStats() {
+	cout << "Nursery:" << endl;
+	sc_sizing.ShowStats(sc_max_bytes);
+	cout << "Mark-sweep heap:" << endl;
+	ms_sizing.ShowStats(ms_max_bytes);
+}
+
+// Shows memory usage, in bytes, for the entire heap, both the mark-sweep
+// component and stop copy component. Mark-sweep objects are counted in
+// whole granules.
 void HybGraphUtil :: ShowMemoryUsage() {
-	int used = num_objects + h[state].size();
-	int free = sc_max_objects + ms_max_objects - used;
-	cout << "Used Memory: " << used << endl;
-	cout << "Free Memory: " << free << endl << "------------------\n";
+	size_t used = ms_used_bytes + SCUsedBytes();
+	size_t free = sc_max_bytes + ms_max_bytes - used;
+	cout << "Used Memory: " << used << " bytes" << endl;
+	cout << "Free Memory: " << free << " bytes" << endl << "------------------\n";
 }
 
 
 // Creates a new reference object. Object* obj = new Object();. Essentially,
-// creates an object in the heap and a reference in the roots vector.
-void HybGraphUtil :: NewReference(const string& desc) {
-    int num_objects = (int)(h[state].size());
-
+// creates an object in the heap and a reference in the root table, and
+// returns the root's handle (an invalid one if the heap is full).
+gc_roots::RootHandle HybGraphUtil :: NewReference(const string& desc) {
   // if the heap is full, then we call TriggerGC() to free up some space.
-  // If there is not enough space in the stop-copy heap, the GC runs
-  // enough number of times so that some of the objects age and then move to
-  // the mark-sweep heap.
+  // If the survivors still fill the stop-copy heap, that collection has
+  // lowered the tenuring threshold, and the next ones move them to the
+  // mark-sweep heap.
   // By default, new objects are assumed to be short-lived because of the nested
   // block structure of any functional / object-oriented language. New objects are
   // allocated into the stop-copy heap and older (long-lived by extension of logic)
   // are moved to the mark-sweep heap.
-	if (num_objects == sc_max_objects) {
-        for (int z = 0; z < threshold && num_objects == sc_max_objects; z++) {
-			TriggerGC();
-        }
-	}
-	num_objects = (int)h[state].size();
-    
-    // pushing the object into the heap is simulated as adding an element
-    // at the end of a linked list.
-    if (num_objects == 0) {
-        num_objects++;
-        Object* obj = new Object(desc);
-        sc_roots.push_back(obj);
-        h[state].push_back(obj);
-     } else if (num_objects < sc_max_objects) {
-  	    num_objects++;
-	    Object* obj = new Object(desc);
-	    sc_roots.push_back(obj);
-	    h[state].push_back(obj);
-	 } else {
-	    cout << "SC Error! Unable to allocate memory!\n";
-     }
+	return NewReference(desc, sizeof(Object), -1);
+}
+
+// The same for an object of "size" bytes.
+gc_roots::RootHandle HybGraphUtil :: NewReference(const string& desc, size_t size) {
+	return NewReference(desc, size, -1);
+}
+
+// NewReference() at an allocation site, which decides the heap the object
+// starts out in.
+gc_roots::RootHandle HybGraphUtil :: NewReference(const string& desc, int site) {
+	return NewReference(desc, sizeof(Object), site);
+}
+
+// The same for an object of "size" bytes.
+gc_roots::RootHandle HybGraphUtil :: NewReference(const string& desc, size_t size, int site) {
+	safepoints.Poll();
+	Object* obj = CollectAndAllocate(*default_tlab, desc, site, size);
+	if (obj != NULL) {
+		return roots.Add(obj);
+	}
+	gc_roots::RootHandle none = { -1, 0 };
+	return none;
 }
 
 
 // Creating a new reference and making it point to an existing object
 // Object *obj = x;
-void HybGraphUtil :: NewReference(Object* obj) {
-	sc_roots.push_back(obj);
+gc_roots::RootHandle HybGraphUtil :: NewReference(Object* obj) {
+	return roots.Add(obj);
 }
 
 // New object that would be pointed to by an existing pointer.
 // This includes objects that are reffered to by other objects,
 // a self-referencing object, like a binary tree structure or a
-// linked-list.
+// linked-list. The parent is held across any collection this takes, so
+// we pick up its new address if it moves.
 Object* HybGraphUtil :: New(const string& desc, Object* parent) {
-    Object* obj = NULL;
-    int num_objects = (int)(h[state].size());
-	if (num_objects == sc_max_objects) {
-        for (int z = 0; z <= threshold && num_objects == sc_max_objects; z++) {
-        	TriggerGC();
-        }
-    }
-	num_objects = (int)h[state].size();
-    if (num_objects == 0) {
-    	num_objects++;
-    	obj = new Object(desc);
-    	h[state].push_back(obj);
-    	parent->child = obj;
-    } else if (num_objects < sc_max_objects) {
-		num_objects++;
-		obj = new Object(desc);
-		h[state].push_back(obj);
-		parent->child = obj;
-	} else {
-        cout << "sc Error! Unable to allocate memory!\n";
-    }
-    return obj;
+	return New(desc, parent, sizeof(Object), -1);
+}
+
+// The same for an object of "size" bytes.
+Object* HybGraphUtil :: New(const string& desc, Object* parent, size_t size) {
+	return New(desc, parent, size, -1);
+}
+
+// New() at an allocation site. Without a parent there would be nothing
+// to keep the object alive, so nothing is allocated.
+Object* HybGraphUtil :: New(const string& desc, Object* parent, int site) {
+	if (parent == NULL) {
+		cout << "Error! New() needs a parent object!\n";
+		return NULL;
+	}
+	return New(desc, parent, sizeof(Object), site);
+}
+
+// The same for an object of "size" bytes.
+Object* HybGraphUtil :: New(const string& desc, Object* parent, size_t size, int site) {
+	safepoints.Poll();
+	held = parent;
+	Object* obj = CollectAndAllocate(*default_tlab, desc, site, size);
+	parent = held;
+	held = NULL;
+
+	if (obj != NULL) {
+		WriteReference(parent, obj);
+	}
+	return obj;
+}
+
+// SiteAllocate() for an object of "size" bytes that has to be found room.
+// After a failure the heap is collected, up to GCRETRIES times, and then
+// the nursery grows. NULL when not even the largest nursery has room.
+// Whatever the caller needs to survive the collections has to be held or a
+// root.
+Object* HybGraphUtil :: CollectAndAllocate(Tlab& tlab, const string& desc, int site, size_t size) {
+	Object* obj = SiteAllocate(tlab, desc, site, size);
+	for (int z = 0; z < GCRETRIES && obj == NULL; z++) {
+		TriggerGC(gc_events::HEAP_FULL);
+		obj = SiteAllocate(tlab, desc, site, size);
+	}
+	while (obj == NULL && GrowNursery()) {
+		obj = SiteAllocate(tlab, desc, site, size);
+	}
+	if (obj == NULL) OutOfMemory(sc_sizing, size);
+	return obj;
+}
+
+// Allocates an array of "length" references, all NULL.
+RefArray* HybGraphUtil :: NewArray(const string& desc, int length) {
+	safepoints.Poll();
+	size_t size = sizeof(RefArray) + length * sizeof(Object*);
+	Object* p = CollectAndAllocate(*default_tlab, desc, -1, size);
+	if (p == NULL) return NULL;
+
+	p->~Object();
+	RefArray* array = new (p) RefArray(desc, length);
+	array->size = int(size);
+	array->type = Types::Id<RefArray>();
+	return array;
+}
+
+// An allocation of "size" bytes that did not fit the largest heap, counted
+// against that heap's sizer. The sizer's oom_handler runs with tlab_lock
+// held, so it may drop roots but must not allocate.
+void HybGraphUtil :: OutOfMemory(gc_sizing::HeapSizer& sizing, size_t size) {
+	cout << "Error! Unable to allocate memory!\n";
+	lock_guard<mutex> guard(tlab_lock);
+	sizing.OutOfMemory(size);
+}
+
+// Stores "value" into obj's child field.
+void HybGraphUtil :: WriteReference(Object* obj, Object* value) {
+	WriteReference(obj, &obj->child, value);
+}
+
+// Stores "value" into "slot", one of obj's reference fields. A store of a
+// stop-copy object into a mark-sweep object dirties the card obj starts
+// in.
+void HybGraphUtil :: WriteReference(Object* obj, Object** slot, Object* value) {
+	*slot = value;
+	if (value == NULL || !InMSHeap(obj) || InMSHeap(value)) return;
+
+	int card = Slot(obj) >> CARDSHIFT;
+	if (__atomic_load_n(&cards[card], __ATOMIC_RELAXED) == 0) {
+		lock_guard<mutex> guard(card_lock);
+		if (cards[card] == 0) {
+			__atomic_store_n(&cards[card], 1, __ATOMIC_RELAXED);
+			dirty_list.push_back(card);
+		}
+	}
 }
 
 // Getting rid of the root reference. This is typically when a pointer
 // falls out of scope causing a memory leak.
-void HybGraphUtil :: EndLifetime(Object *obj) {
-	int pos = -1;
-	for (int i = 0; i < int(sc_roots.size()); i++) {
-	    if (sc_roots[i] == obj) {
-	        pos = i;
-	        break;
-	    }
-	}
-	if (pos != -1) sc_roots.erase(sc_roots.begin() + pos);
-	else {
-		for (int i = 0; i < int(ms_roots.size()); i++) {
-		    if (ms_roots[i] == obj) {
-		        pos = i;
-		        break;
-		    }
+void HybGraphUtil :: EndLifetime(gc_roots::RootHandle reference) {
+	roots.Remove(reference);
+}
+
+// New() for a mutator thread, allocating in its TLAB. The parent is kept
+// in the mutator's "held" slot from before the safepoint poll until the
+// object is linked in, since any collection in between may move it.
+Object* HybGraphUtil :: New(const string& desc, Object* parent, Mutator* mutator) {
+	return New(desc, parent, -1, mutator);
+}
+
+// New() for a mutator thread at an allocation site.
+Object* HybGraphUtil :: New(const string& desc, Object* parent, int site, Mutator* mutator) {
+	if (parent == NULL) {
+		cout << "Error! New() needs a parent object!\n";
+		return NULL;
+	}
+	mutator->held = parent;
+	safepoints.Poll();
+	Object* obj = CollectAndAllocate(*mutator->tlab, desc, site, sizeof(Object));
+	parent = mutator->held;
+	mutator->held = NULL;
+
+	if (obj != NULL) {
+		WriteReference(parent, obj);
+	}
+	return obj;
+}
+
+// NewReference() for a mutator thread, allocating in its TLAB and putting
+// the root into its own root set.
+gc_roots::RootHandle HybGraphUtil :: NewReference(const string& desc, Mutator* mutator) {
+	return NewReference(desc, -1, mutator);
+}
+
+// NewReference() for a mutator thread at an allocation site.
+gc_roots::RootHandle HybGraphUtil :: NewReference(const string& desc, int site, Mutator* mutator) {
+	safepoints.Poll();
+	Object* obj = CollectAndAllocate(*mutator->tlab, desc, site, sizeof(Object));
+	if (obj != NULL) {
+		return mutator->roots.Add(obj);
+	}
+	gc_roots::RootHandle none = { -1, 0 };
+	return none;
+}
+
+// Attaches the calling thread as a mutator, with an empty root set and a
+// TLAB of its own. The TLAB is added once the thread is attached, when no
+// collection can be retiring TLABs until it reaches a safepoint.
+Mutator* HybGraphUtil :: AttachMutator() {
+	Mutator* mutator = new Mutator();
+	safepoints.Attach(mutator);
+	mutator->tlab = AddTlab();
+	return mutator;
+}
+
+// Detaches a mutator thread; its roots end with it. The rest of its TLAB
+// is filled with empty objects, as at a collection, before the thread
+// stops holding collections up.
+void HybGraphUtil :: DetachMutator(Mutator* mutator) {
+	{
+		lock_guard<mutex> guard(tlab_lock);
+		Tlab* tlab = mutator->tlab;
+		CloseTlab(*tlab);
+		tlabs.erase(find(tlabs.begin(), tlabs.end(), tlab));
+		delete tlab;
+	}
+	safepoints.Detach(mutator);
+	delete mutator;
+}
+
+// Safepoint poll for a mutator thread that goes a long way without
+// allocating.
+void HybGraphUtil :: Safepoint() {
+	safepoints.Poll();
+}
+
+
+// Reserves the mark-sweep slab at the largest heap size, with both bounds
+// rounded down to whole granules, and starts it at the smallest with every
+// granule free.
+void HybGraphUtil :: MSInitHeap() {
+	mark_stack.reserve(MARKSTACKSIZE);
+	mark_overflow = false;
+	gc_threads = GCTHREADS;
+	ms_sizing.Bounds(ms_sizing.min_bytes / GRANULE * GRANULE,
+	                 ms_sizing.max_bytes / GRANULE * GRANULE);
+	ms_granules = 0;
+	ms_max_bytes = 0;
+	ms_used_bytes = 0;
+	ms_cursor = 0;
+	dirty_list.clear();
+	dirty_cards = 0;
+	card_scan_us = 0;
+	ms_heap = new char[ms_sizing.max_bytes];
+	MSResizeHeap(ms_sizing.min_bytes);
+}
+
+// Sets the mark-sweep heap to "bytes" worth of granules. Granules added at
+// the end are zeroed, so promotion does not take their page faults in the
+// middle of a collection. Only free granules at the end can be given back,
+// so the heap may stay larger than asked. The bitmaps and the card table
+// follow the slab. Runs with the world stopped, or before any mutator
+// thread is attached.
+void HybGraphUtil :: MSResizeHeap(size_t bytes) {
+	int granules = int(bytes / GRANULE);
+	if (granules == ms_granules) return;
+
+	if (granules > ms_granules) {
+		memset(ms_heap + ms_granules * GRANULE, 0, (granules - ms_granules) * GRANULE);
+	} else {
+		int keep = ms_granules;
+		while (keep > granules && !gc_bitmap::Test(used_bits, keep - 1)) keep--;
+		if (keep == ms_granules) return;
+		granules = keep;
+	}
+	ms_granules = granules;
+	ms_cursor = min(ms_cursor, ms_granules);
+	ms_max_bytes = ms_granules * GRANULE;
+	used_bits.resize(gc_bitmap::Words(ms_granules), 0);
+	alloc_bits.resize(gc_bitmap::Words(ms_granules), 0);
+	mark_bits.resize(gc_bitmap::Words(ms_granules), 0);
+	recent_bits.resize(gc_bitmap::Words(ms_granules), 0);
+	cards.resize((ms_granules + (1 << CARDSHIFT) - 1) >> CARDSHIFT, 0);
+	int kept = 0;
+	for (int i = 0; i < int(dirty_list.size()); i++) {
+		if (dirty_list[i] < int(cards.size())) dirty_list[kept++] = dirty_list[i];
+	}
+	dirty_list.resize(kept);
+}
+
+// Grows the mark-sweep heap for MSNew() and MSNewReference(), when a
+// collection left no room. False once it is at its largest.
+bool HybGraphUtil :: MSGrowHeap() {
+	size_t bytes = ms_sizing.GrowFor(ms_max_bytes, sizeof(Object)) / GRANULE * GRANULE;
+	if (bytes <= ms_max_bytes) return false;
+	ms_sizing.Resized(ms_max_bytes, bytes);
+	MSResizeHeap(bytes);
+	return true;
+}
+
+// Allocates a plain object in the mark-sweep heap, NULL when it is full.
+Object* HybGraphUtil :: MSAllocate(const string& desc) {
+	return MSAllocate(desc, sizeof(Object));
+}
+
+// The same for an object of "size" bytes.
+Object* HybGraphUtil :: MSAllocate(const string& desc, size_t size) {
+	if (size < sizeof(Object)) size = sizeof(Object);
+	int slot = MSReserve(size);
+	if (slot < 0) return NULL;
+
+	Object* obj = new (ObjectAt(slot)) Object(desc);
+	obj->size = int(size);
+	return obj;
+}
+
+// Takes the granules for an object of "size" bytes, in the first run of
+// free granules it fits from the cursor on, and returns the first of them
+// for the caller to construct the object in. -1 when the heap is full; a
+// heap without that many free bytes is not searched at all.
+int HybGraphUtil :: MSReserve(size_t size) {
+	int granules = Granules(size);
+	if (ms_used_bytes + granules * GRANULE > ms_max_bytes) return -1;
+
+	int slot = MSFindRun(granules);
+	if (slot < 0) return -1;
+
+	gc_bitmap::SetRun(used_bits, slot, granules, true);
+	gc_bitmap::Set(alloc_bits, slot);
+	ms_cursor = slot + granules;
+	num_objects++;
+	ms_used_bytes += granules * GRANULE;
+	return slot;
+}
+
+// The first granule of a run of "granules" free granules, looked for from
+// the cursor to the end of the heap and then from the bottom. -1 when
+// there is none.
+int HybGraphUtil :: MSFindRun(int granules) {
+	for (int pass = 0; pass < 2; pass++) {
+		if (pass == 1 && ms_cursor == 0) break;
+		int slot = NextFreeGranule(pass == 0 ? ms_cursor : 0);
+		while (slot + granules <= ms_granules) {
+			int n = gc_bitmap::ClearRun(used_bits, slot, granules);
+			if (n == granules) return slot;
+			slot = NextFreeGranule(slot + n);
 		}
-		if (pos != -1) ms_roots.erase(ms_roots.begin() + pos);
 	}
+	return -1;
 }
 
-// Deleting root items for when they fall out of scope. Specifically for
-// the roots in the stop-copy heap.
-void HybGraphUtil :: SCEndLifetime(Object* obj) {
-    int pos = -1;
-    for (int i = 0; i < int(sc_roots.size()); i++) {
-        if (sc_roots[i] == obj) {
-            pos = i;
-            break;
-        }
-    }
-    if (pos != -1) sc_roots.erase(sc_roots.begin() + pos);
+// The first free granule at or after "from", ms_granules if there is none.
+// Whole words of used granules are skipped at once.
+int HybGraphUtil :: NextFreeGranule(int from) {
+	if (from >= ms_granules) return ms_granules;
+	int w = from >> 6;
+	uint64_t free = ~used_bits[w] & (~uint64_t(0) << (from & 63));
+	while (free == 0) {
+		if (++w == int(used_bits.size())) return ms_granules;
+		free = ~used_bits[w];
+	}
+	return min(w * 64 + __builtin_ctzll(free), ms_granules);
+}
+
+// Destroys a mark-sweep object and frees its granules.
+void HybGraphUtil :: MSFree(Object* obj) {
+	int slot = Slot(obj);
+	int granules = Granules(Types::Size(obj));
+	gc_bitmap::Clear(alloc_bits, slot);
+	gc_bitmap::Clear(recent_bits, slot);
+	gc_bitmap::SetRun(used_bits, slot, granules, false);
+	ms_used_bytes -= granules * GRANULE;
+	num_objects--;
+	Types::Destroy(obj);
 }
 
+// Whether an object lives in the mark-sweep slab rather than in the
+// stop-copy heap. Only slab objects have mark bits.
+bool HybGraphUtil :: InMSHeap(Object* obj) {
+	return (char*)obj >= ms_heap && (char*)obj < ms_heap + ms_max_bytes;
+}
+
+// Index in the side bitmaps of the granule a mark-sweep object starts at.
+int HybGraphUtil :: Slot(Object* obj) {
+	return int(((char*)obj - ms_heap) / GRANULE);
+}
+
+// The mark-sweep object that starts at granule "slot".
+Object* HybGraphUtil :: ObjectAt(int slot) {
+	return (Object*)(ms_heap + slot * GRANULE);
+}
+
+// Pushes what one field of a marked object points to.
+struct MarkVisitor {
+	HybGraphUtil* gc;
+
+	MarkVisitor(HybGraphUtil* collector) : gc(collector) {}
+
+	void operator()(Object*& slot) {
+		gc->MarkPush(slot);
+	}
+};
+
+// The same, for a field whose target an overflowing push may have
+// dropped: only a mark-sweep target that is still unmarked is pushed
+// again.
+struct RescanVisitor {
+	HybGraphUtil* gc;
+
+	RescanVisitor(HybGraphUtil* collector) : gc(collector) {}
+
+	void operator()(Object*& slot) {
+		if (gc->InMSHeap(slot) && !gc_bitmap::Test(gc->mark_bits, gc->Slot(slot))) {
+			gc->MarkPush(slot);
+		}
+	}
+};
+
+// Takes the mark-sweep object one reference field of a nursery object
+// points to as a root of the mark-sweep collection.
+struct MSRootVisitor {
+	HybGraphUtil* gc;
+	vector <Object*>& refs;
+
+	MSRootVisitor(HybGraphUtil* collector, vector <Object*>& roots) : gc(collector), refs(roots) {}
+
+	void operator()(Object*& slot) {
+		if (gc->InMSHeap(slot)) refs.push_back(slot);
+	}
+};
 
 // Utility function to Trigger the Garbage Collection mechanism
 // in the mark and sweep component. This is generally called when
 // the mark and sweep heap is full when we shift from the stop-copy
-// heap.
+// heap. More than one GC thread marks with the parallel marker.
+// Nursery objects are not traced, so every mark-sweep object one of their
+// reference fields points to is taken as a root, whether that nursery
+// object is live or not.
 void HybGraphUtil :: MSTriggerGC() {
-	for (int i = 0; i < int(ms_roots.size()); i++) {
-		DFSMark(ms_roots[i]);
+	MSTriggerGC(gc_events::EXPLICIT);
+}
+
+// MSTriggerGC() for "cause", as in TriggerGC(int).
+void HybGraphUtil :: MSTriggerGC(int cause) {
+	if (!safepoints.StopTheWorld()) return;
+	events.Begin(cause, gc_events::OLD);
+	events.Before(num_objects, ms_used_bytes);
+	ms_sizing.StartCollection();
+	vector <Object*> refs;
+	vector <Object**> slots;
+	RootSlots(slots);
+	for (int i = 0; i < int(slots.size()); i++) {
+		refs.push_back(*slots[i]);
+	}
+	CloseTlabs();
+	MSRootVisitor visitor(this, refs);
+	for (char* p = space[state]; p < top; ) {
+		Object* obj = (Object*)p;
+		Types::Trace(obj, visitor);
+		p += SlotBytes(Types::Size(obj));
+	}
+	events.Phase(gc_events::ROOTS);
+
+	if (gc_threads > 1) {
+		gc_parallel::ParallelMarker<Object, Types> marker(ms_heap, GRANULE, ms_granules,
+		                                                  mark_bits, gc_threads);
+		marker.Mark(refs);
+	} else {
+		for (int i = 0; i < int(refs.size()); i++) {
+			MarkPush(refs[i]);
+		}
+		ProcessMarkStack();
 	}
-	Sweep(first, NULL);
+	events.Phase(gc_events::MARK);
+	premature_deaths = 0;
+	Sweep();
+	events.Phase(gc_events::SWEEP);
+	CheckPromotions();
+	EvaluateSites(true);
+
+	size_t bytes = ms_sizing.AfterCollection(ms_max_bytes, ms_used_bytes);
+	bytes = bytes / GRANULE * GRANULE;
+	if (bytes != ms_max_bytes) {
+		size_t before = ms_max_bytes;
+		MSResizeHeap(bytes);
+		ms_sizing.Resized(before, ms_max_bytes);
+	}
+	events.After(num_objects, ms_used_bytes);
+	events.End();
+	safepoints.ResumeTheWorld();
 }
 
-// Simple Depth First Search to mark the nodes.
+// Raises tenure_target when more than PREMATUREDEATH percent of the
+// objects promoted since the last mark-sweep collection died before this
+// one, since they were promoted too young. The counts start over.
+void HybGraphUtil :: CheckPromotions() {
+	if (promoted_since > 0 && premature_deaths * 100 > promoted_since * PREMATUREDEATH) {
+		tenure_target = min(tenure_target + 1, MAXTENURE);
+		threshold = min(tenure_target, capacity_threshold);
+	}
+	promoted_since = 0;
+}
+
+// Pushes an object for marking; it is marked when popped. The push
+// prefetches the object so the miss overlaps with the rest of the stack.
+// A full stack marks the object unscanned and flags the overflow.
+// Stop-copy objects are not traced by the mark-sweep collector.
+void HybGraphUtil :: MarkPush(Object* obj) {
+	if (obj == NULL || !InMSHeap(obj)) return;
+
+	if (int(mark_stack.size()) == MARKSTACKSIZE) {
+		gc_bitmap::Set(mark_bits, Slot(obj));
+		mark_overflow = true;
+		return;
+	}
+	__builtin_prefetch(obj);
+	mark_stack.push_back(obj);
+}
+
+// Drains the mark stack and recovers from overflow until marking is
+// complete.
+void HybGraphUtil :: ProcessMarkStack() {
+	MarkVisitor visitor(this);
+	do {
+		while (!mark_stack.empty()) {
+			Object* obj = mark_stack.back();
+			mark_stack.pop_back();
+			int slot = Slot(obj);
+			if (gc_bitmap::Test(mark_bits, slot)) continue;
+
+			gc_bitmap::Set(mark_bits, slot);
+			Types::Trace(obj, visitor);
+		}
+		if (mark_overflow) {
+			mark_overflow = false;
+			RescanHeap();
+		}
+	} while (!mark_stack.empty() || mark_overflow);
+}
+
+// Pushes the unmarked children of marked mark-sweep objects, which is
+// where an overflowing push leaves its work.
+void HybGraphUtil :: RescanHeap() {
+	RescanVisitor visitor(this);
+	for (int w = 0; w < int(mark_bits.size()); w++) {
+		for (uint64_t bits = mark_bits[w]; bits != 0; bits &= bits - 1) {
+			Types::Trace(ObjectAt(w * 64 + __builtin_ctzll(bits)), visitor);
+		}
+	}
+}
+
+// Depth First Search to mark the nodes, iterative over the mark stack.
 void HybGraphUtil :: DFSMark (Object* root) {
-	if (root == NULL) return;
-	root->seen = true;
-	DFSMark(root->child);
+	MarkPush(root);
+	ProcessMarkStack();
 }
 
-// Sweeping the entire heap. We traverse the linked list in our simulation,
-// resetting the "seen" flag then and there. Any object that does not have
-// the seen flag set will be removed. Basic deletion of elements from a linked
-// list.
-void HybGraphUtil :: Sweep (Object* current, Object* prev) {
-	if (current == NULL) return;
+// Sweeping the entire mark-sweep heap from the bitmaps, 256 granules a
+// block. Blocks without garbage are skipped; otherwise the dead objects of
+// each word are dropped from the allocation bitmap at once, destroyed, and
+// their granules freed. The mark bitmap is cleared in bulk afterwards, and
+// allocation starts over from the bottom of the heap. Recent
+// objects that died count as premature deaths if they were promoted and
+// against their site if they were pretenured; they are all old by the
+// next collection.
+void HybGraphUtil :: Sweep () {
+	for (int w = 0; w < int(alloc_bits.size()); w += gc_bitmap::BLOCKWORDS) {
+		if (!gc_bitmap::AnyDead(&alloc_bits[w], &mark_bits[w])) continue;
 
-	if (current->seen == true) {
-		current->seen = false;
-		Sweep(current->next, current);
-	} else {
-		if ((current->next != NULL) & (prev != NULL)) {
-			// Object to be removed is neither the
-			// first nor the last item
-			Object* obsolete = current;
-			prev->next = current->next;
-			delete obsolete;
-			num_objects--;
-			Sweep(current->next, prev);
-		} else if (prev == NULL) {
-			// Object to be removed is the first item
-			Object* temp = current;
-			first = current->next;
-			delete temp;
-			num_objects--;
-			Sweep(first, prev);
-		} else if (current->next == NULL) {
-			// Object to be removed is the last item
-			prev->next = NULL;
-			last = prev;
-			Object* obsolete = current;
-			delete obsolete;
-			num_objects--;
+		for (int i = w; i < w + gc_bitmap::BLOCKWORDS; i++) {
+			uint64_t dead = alloc_bits[i] & ~mark_bits[i];
+			if (dead == 0) continue;
+
+			alloc_bits[i] &= mark_bits[i];
+			num_objects -= __builtin_popcountll(dead);
+			for (uint64_t recent = dead & recent_bits[i]; recent != 0; recent &= recent - 1) {
+				Object* obj = ObjectAt(i * 64 + __builtin_ctzll(recent));
+				if (obj->age > 0) {
+					premature_deaths++;
+				} else {
+					sites[obj->site].died_young++;
+				}
+			}
+			for (; dead != 0; dead &= dead - 1) {
+				int slot = i * 64 + __builtin_ctzll(dead);
+				Object* obj = ObjectAt(slot);
+				int granules = Granules(Types::Size(obj));
+				gc_bitmap::SetRun(used_bits, slot, granules, false);
+				ms_used_bytes -= granules * GRANULE;
+				Types::Destroy(obj);
+			}
 		}
 	}
+	mark_bits.assign(mark_bits.size(), 0);
+	recent_bits.assign(recent_bits.size(), 0);
+	ms_cursor = 0;
 }
 
 
-// Shows memory usage for the Mark and sweep component of the heap
+// Shows memory usage, in bytes, for the Mark and sweep component of the
+// heap
 void HybGraphUtil :: MSShowMemoryUsage() {
-	cout << "Used Memory: " << num_objects << endl;
-	cout << "Free Memory: " << ms_max_objects - num_objects << endl << "------------------\n";
+	cout << "Used Memory: " << ms_used_bytes << " bytes" << endl;
+	cout << "Free Memory: " << ms_max_bytes - ms_used_bytes << " bytes" << endl
+	     << "------------------\n";
 }
 
-// Creating a new root item in the mark and sweep heap. This is called
-// during the shifting phase of aged objects
-void HybGraphUtil :: MSNewReference(const string& desc) {
-    if (num_objects == ms_max_objects) {
-        TriggerGC();
+// Creating a new root item directly in the mark and sweep heap, for
+// objects known to be long-lived. Returns the root's handle.
+gc_roots::RootHandle HybGraphUtil :: MSNewReference(const string& desc) {
+    Object* obj = MSAllocate(desc);
+    if (obj == NULL) {
+        MSTriggerGC(gc_events::HEAP_FULL);
+        obj = MSAllocate(desc);
     }
-    if (num_objects == 0) {
-        	num_objects++;
-        	Object* obj = new Object(desc);
-        	ms_roots.push_back(obj);
-        	first = obj;
-        	last = obj;
-    } else if (num_objects < ms_max_objects) {
-  	    num_objects++;
-	    Object* obj = new Object(desc);
-	    ms_roots.push_back(obj);
-	    last->next = obj;
-	    last = obj;
-    } else {
-	    cout << "MS Error! Unable to allocate memory!\n";
+    if (obj == NULL && MSGrowHeap()) obj = MSAllocate(desc);
+    if (obj != NULL) {
+	    return roots.Add(obj);
     }
-}
-
-// Creating a new reference and making it point to an existing object
-// Object *obj = x;
-void HybGraphUtil :: MSNewReference(Object* obj) {
-	ms_roots.push_back(obj);
+    OutOfMemory(ms_sizing, sizeof(Object));
+    gc_roots::RootHandle none = { -1, 0 };
+    return none;
 }
 
 // New object that would be pointed to by an existing pointer.
@@ -369,47 +1457,29 @@ void HybGraphUtil :: MSNewReference(Object* obj) {
 // a self-referencing object, like a binary tree structure or a
 // linked-list.
 Object* HybGraphUtil :: MSNew(const string& desc, Object* parent) {
-    Object* obj = NULL;
-
-    if (num_objects == ms_max_objects) {
-      TriggerGC();
+    if (parent == NULL) {
+        cout << "Error! New() needs a parent object!\n";
+        return NULL;
     }
-    
-   if (num_objects == 0) {
-    	num_objects++;
-    	obj = new Object(desc);
-    	parent->child = obj;
-    	first = obj;
-    	last = obj;
-    } else if (num_objects < ms_max_objects) {
-	num_objects++;
-	obj = new Object(desc);
-	parent->child = obj;
-	last->next = obj;
-	last = obj;
+    Object* obj = MSAllocate(desc);
+    if (obj == NULL) {
+      MSTriggerGC(gc_events::HEAP_FULL);
+      obj = MSAllocate(desc);
+    }
+    if (obj == NULL && MSGrowHeap()) obj = MSAllocate(desc);
+    if (obj != NULL) {
+	WriteReference(parent, obj);
     } else {
-        cout << "ms Error! Unable to allocate memory!\n";
+        OutOfMemory(ms_sizing, sizeof(Object));
     }
-
     return obj;
 }
 
 // Reassigning a pointer to a different object. No creation of objects
-// involved.
-void HybGraphUtil :: MSOldReference (Object* o1, Object* o2){
-	o2 = o1;
-}
-
-// Deleting root items for when they fall out of scope.
-void HybGraphUtil :: MSEndLifetime(Object* obj) {
-    int pos = -1;
-    for (int i = 0; i < int(ms_roots.size()); i++) {
-        if (ms_roots[i] == obj) {
-            pos = i;
-            break;
-        }
-    }
-    if (pos != -1) ms_roots.erase(ms_roots.begin() + pos);
+// involved. The root "reference" now refers to obj. Roots are scanned
+// at every collection of either heap, so the store needs no barrier.
+void HybGraphUtil :: MSOldReference (gc_roots::RootHandle reference, Object* obj){
+	roots.Set(reference, obj);
 }
 
 } // hyb_graph_api
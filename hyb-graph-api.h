@@ -13,32 +13,207 @@
 #include <iostream>
 #include <vector>
 #include <string>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <new>
+#include <cstring>
 #include "sc-graph-api.h"
 #include "ms-graph-api.h"
+#include "gc-bitmap.h"
+#include "gc-types.h"
+#include "parallel-mark.h"
+#include "root-table.h"
+#include "safepoint.h"
+#include "heap-sizing.h"
+#include "gc-events.h"
 
 using namespace std;
 
 namespace hyb_graph_api {
 
+// The header of every object in either heap, followed by size -
+// sizeof(Object) bytes of raw payload that the collector never looks at.
+// Plain Objects are type 0; the other types below derive from it and
+// describe their reference fields (see gc-types.h).
 class Object {
   public:
-    bool seen;
     int age;
-    Object* next;
+    int site;         // allocation site, -1 for none
+    Object* forward;  // set once the object has been evacuated or promoted
+    int type;         // index in Types
+    int size;         // bytes asked for, header included
     Object* child;
     string desc;
     Object() {
     	age = 0;
-        next = NULL;
+    	site = -1;
+    	forward = NULL;
+    	type = 0;
+    	size = sizeof(Object);
         child = NULL;
         desc = "";
     }
     Object (const string& description) {
     	age = 0;
-    	next = NULL;
+    	site = -1;
+    	forward = NULL;
+    	type = 0;
+    	size = sizeof(Object);
     	child = NULL;
     	desc = description;
     }
+    char* Payload() { return (char*)(this + 1); }
+
+    size_t Size() const { return size; }
+
+    Object* CopyTo(void* to) {
+    	Object* copy = new (to) Object(*this);
+    	memcpy(copy->Payload(), Payload(), size - sizeof(Object));
+    	return copy;
+    }
+
+    template <class V>
+    void EachRef(V& v) {
+    	v(child);
+    }
+};
+
+// An object with REFS reference fields on top of child, and BYTES bytes of
+// raw payload the collector never looks at.
+template <int REFS, int BYTES>
+class Record : public Object {
+  public:
+    Object* refs[REFS];
+    char payload[BYTES];
+
+    Record (const string& description) : Object(description) {
+    	for (int i = 0; i < REFS; i++) refs[i] = NULL;
+    	memset(payload, 0, BYTES);
+    }
+
+    Object* CopyTo(void* to) { return new (to) Record(*this); }
+
+    template <class V>
+    void EachRef(V& v) {
+    	v(child);
+    	for (int i = 0; i < REFS; i++) v(refs[i]);
+    }
+};
+
+// Binary tree node: refs[0] and refs[1] are the subtrees, the payload a key.
+typedef Record<2, 8> TreeNode;
+// Hash map entry: child is the next entry in the bucket, refs[0] the value,
+// the payload the key.
+typedef Record<1, 16> MapEntry;
+
+// An array of "length" references stored right after the header.
+class RefArray : public Object {
+  public:
+    int length;
+
+    RefArray (const string& description, int n) : Object(description) {
+    	length = n;
+    	for (int i = 0; i < n; i++) Elems()[i] = NULL;
+    }
+
+    Object** Elems() { return (Object**)(this + 1); }
+
+    Object* CopyTo(void* to) {
+    	RefArray* copy = new (to) RefArray(*this);
+    	memcpy(copy->Elems(), Elems(), length * sizeof(Object*));
+    	return copy;
+    }
+
+    template <class V>
+    void EachRef(V& v) {
+    	v(child);
+    	Object** elems = Elems();
+    	for (int i = 0; i < length; i++) v(elems[i]);
+    }
+};
+
+// Every type the heap can hold. A new type is added here.
+typedef gc_types::TypeList<Object, Object, TreeNode, MapEntry, RefArray> Types;
+
+// Bytes an object of "size" bytes takes up in the nursery: a whole number
+// of sizeof(Object) slots, so the unused end of a TLAB can always be
+// filled with empty objects.
+inline size_t SlotBytes(size_t size) {
+	return (size + sizeof(Object) - 1) / sizeof(Object) * sizeof(Object);
+}
+
+// A thread-local allocation buffer: a stretch of the nursery that one
+// mutator thread bump-allocates into without synchronising with anyone.
+// "size" is what the thread takes at its next refill. It follows the
+// thread's allocation rate: "allocated" counts the bytes it allocated since
+// the last collection, and "rate" is their running average over
+// collections.
+class Tlab {
+  public:
+    char* top;
+    char* end;
+    size_t size;
+    size_t allocated;
+    double rate;
+    long refills;
+    Tlab() {
+    	top = NULL;
+    	end = NULL;
+    	size = 0;
+    	allocated = 0;
+    	rate = 0;
+    	refills = 0;
+    }
+};
+
+// What one stop-copy collection did: the bytes that survived it in the
+// nursery, the bytes it promoted, and the tenuring threshold it chose for
+// the next one.
+class TenuringRecord {
+  public:
+    long cycle;
+    size_t survived;
+    size_t promoted;
+    int threshold;
+};
+
+// An allocation site: a place in the program that allocates objects, which
+// New() and NewReference() are told about by its id. A site is either
+// allocated in the nursery, where "tenured" counts how many of the objects
+// allocated there ("allocated") lived to be promoted, or pretenured, ie.
+// allocated straight in the mark-sweep heap, where "died_young" counts how
+// many of them did not survive the next mark-sweep collection. Both counts
+// start over whenever the site is looked at; "switches" is the number of
+// times it changed heaps.
+class AllocationSite {
+  public:
+    string name;
+    bool pretenured;
+    long allocated;
+    long tenured;
+    long died_young;
+    int switches;
+    AllocationSite() {
+    	pretenured = false;
+    	allocated = 0;
+    	tenured = 0;
+    	died_young = 0;
+    	switches = 0;
+    }
+};
+
+// A mutator thread attached to the collector: its roots, the parent New()
+// keeps across a collection for it, and its TLAB.
+class Mutator {
+  public:
+    gc_roots::RootTable <Object> roots;
+    Object* held;
+    Tlab* tlab;
+    Mutator() {
+    	held = NULL;
+    	tlab = NULL;
+    }
 };
 
 class HybGraphUtil {
@@ -46,61 +221,289 @@ class HybGraphUtil {
     
     // constructors
     HybGraphUtil();
-    HybGraphUtil(int ms_heap, int sc_heap, int thres);
+    HybGraphUtil(size_t ms_heap_bytes, size_t sc_heap_bytes, int thres);
+    HybGraphUtil(size_t ms_min_bytes, size_t sc_min_bytes, int thres, size_t ms_max, size_t sc_max);
+    ~HybGraphUtil();
     
-    // utility data members
+    // utility data members. Heap sizes are in bytes, as they are now.
+    // num_objects and ms_used_bytes count the objects in the mark-sweep
+    // heap and the granules they cover, in bytes; ms_granules is the size
+    // of that heap in granules.
     int num_objects;
     int threshold;
-    int ms_max_objects;
+    size_t ms_max_bytes;
+    size_t ms_used_bytes;
+    int ms_granules;
+
+    // Each heap moves between the bounds of its own sizer (see
+    // heap-sizing.h), checked after every collection of that heap. The
+    // nursery also grows when allocations still fail after GCRETRIES
+    // collections, and the mark-sweep heap when MSNew() does not fit after
+    // one.
+    gc_sizing::HeapSizer ms_sizing;
+    gc_sizing::HeapSizer sc_sizing;
+
+    // Every collection of either heap is logged here once the log is
+    // enabled (see gc-events.h): a stop-copy collection as young, with what
+    // it promoted, and a mark-sweep one as old.
+    gc_events::EventLog events;
+
+    // Adaptive tenuring. "threshold" is the age at which a stop-copy
+    // collection promotes, and is chosen again after each one as the lower
+    // of two ages. capacity_threshold is the youngest age at which the
+    // survivors of the last collection (age_bytes, by age), counted from
+    // the youngest, add up to more than TARGETSURVIVOR percent of the
+    // nursery. tenure_target is raised when a mark-sweep collection finds
+    // that more than PREMATUREDEATH percent of the objects promoted since
+    // the last one (promoted_since) have died already (premature_deaths).
+    // Every stop-copy collection adds a line to tenuring_log.
+    int tenure_target;
+    int capacity_threshold;
+    long sc_cycles;
+    vector <size_t> age_bytes;
+    size_t promoted_bytes;
+    long promoted_since;
+    long premature_deaths;
+    vector <TenuringRecord> tenuring_log;
+
+    // Allocation sites, indexed by id. A site whose objects are mostly
+    // promoted is pretenured, and one whose pretenured objects die young
+    // goes back to the nursery (see EvaluateSites()). Sites are registered
+    // before any mutator thread allocates at them; pretenured allocation
+    // by mutator threads takes ms_lock.
+    vector <AllocationSite> sites;
+    mutex ms_lock;
     
-    // container for root objects
-    vector <Object*> ms_roots;
+    // container for root objects, in either heap. A stop-copy collection
+    // moves objects, so it updates these; a root keeps its handle when its
+    // object is promoted.
+    gc_roots::RootTable <Object> roots;
+
+    // Mutator threads. With threads attached, every thread using the heap
+    // has to be one of them, and the root table above, as well as MSNew()
+    // and MSNewReference(), belong to whichever thread is not. Every
+    // collection first stops each mutator at a safepoint. A mutator's roots
+    // are updated like the others; any other pointer it holds goes stale
+    // across a safepoint.
+    gc_safepoint::Safepoints <Mutator> safepoints;
     
-    // pointers for scanning the heap
-    Object* first;
-    Object* last;
+    // The mark-sweep heap is one contiguous slab reserved for
+    // ms_sizing.max_bytes, of which the first ms_granules granules are in
+    // use. An object starts on a granule and covers as many as its size
+    // takes; used_bits has a bit for every granule some object covers.
+    // Allocation looks for a run of free granules from ms_cursor on (next
+    // fit), and starts over from the bottom of the heap after a sweep.
+    char* ms_heap;
+    int ms_cursor;
+    vector <uint64_t> used_bits;
+
+    // Side bitmaps indexed by mark-sweep granule: the granules that start
+    // an allocated object, the objects reached by the last mark, and the
+    // objects promoted or pretenured since the last mark-sweep collection.
+    vector <uint64_t> alloc_bits;
+    vector <uint64_t> mark_bits;
+    vector <uint64_t> recent_bits;
+
+    // Bounded explicit mark stack, overflow is recovered by rescanning the
+    // mark-sweep heap.
+    vector <Object*> mark_stack;
+    bool mark_overflow;
+
+    // GC worker threads for marking the mark-sweep heap, 1 for serial.
+    int gc_threads;
+
+    // Card table over the mark-sweep slab, one byte per card of 2^CARDSHIFT
+    // granules. The write barrier dirties the card an object starts in when
+    // a pointer to a stop-copy object is stored into one of its fields, and
+    // records the card in dirty_list (the remembered set) the first time it
+    // becomes dirty.
+    // dirty_cards and card_scan_us describe the last stop-copy collection.
+    vector <uint8_t> cards;
+    vector <int> dirty_list;
+    mutex card_lock;
+    int dirty_cards;
+    double card_scan_us;
   	
     // utility functions for the mark-sweep component
+    void MSInitHeap();
+    void MSResizeHeap(size_t bytes);
+    bool MSGrowHeap();
+    Object* MSAllocate(const string& desc);
+    Object* MSAllocate(const string& desc, size_t size);
+    int MSReserve(size_t size);
+    int MSFindRun(int granules);
+    int NextFreeGranule(int from);
+    void MSFree(Object* obj);
+    bool InMSHeap(Object* obj);
+    int Slot(Object* obj);
+    Object* ObjectAt(int slot);
+    void MarkPush(Object* obj);
+    void ProcessMarkStack();
+    void RescanHeap();
     void DFSMark(Object* root);
-  	void Sweep(Object* current, Object* prev);
+  	void Sweep();
    	void MSTriggerGC();
+   	void MSTriggerGC(int cause);
    	void MSShowMemoryUsage();
    	Object* MSNew(const string& desc, Object* parent);
-   	void MSNewReference(const string& desc);
-   	void MSNewReference(Object* obj);
-   	void MSOldReference(Object* obj1, Object* obj2);
-   	void MSEndLifetime(Object* reference);
+   	gc_roots::RootHandle MSNewReference(const string& desc);
+   	void MSOldReference(gc_roots::RootHandle reference, Object* obj);
 
    	
     // Utility data members for the stop-copy component
     bool state;
-    int sc_max_objects;
+    size_t sc_max_bytes;
 
-    // container for the root objects
-    vector <Object*> sc_roots;
-    
     // the two heaps in the stop-copy component, the active and inactive
-    // heap
-    vector <Object*> h[2];
+    // heap: semispaces reserved for sc_sizing.max_bytes, bump-allocated at
+    // "top" in space[state] up to "limit", sc_max_bytes in.
+    char* space[2];
+    char* top;
+    char* limit;
+
+    // a reference New() holds across a collection, updated like a root
+    Object* held;
+
+    // The TLABs of the mutator threads, owned by the collector. New() and
+    // NewReference() allocate in default_tlab. Taking a TLAB out of the
+    // nursery, ie. moving "top", is done under tlab_lock; a collection
+    // needs every other mutator thread stopped.
+    vector <Tlab*> tlabs;
+    Tlab* default_tlab;
+    mutex tlab_lock;
+
+    // set by a collection that found the mark-sweep heap too full to
+    // promote everything it should have
+    bool promotion_failed;
+
+    // The promoted objects whose young children DFSShift() still has to
+    // promote.
+    vector <Object*> shift_stack;
 	  
     // Utility functions for the stop-copy component
-    void DFSCopy(Object* root, vector<Object*> &to);
-    void Flush(vector<Object*> &v);
+    void SCInitSpaces();
+    Object* SCAllocate(const string& desc);
+    Object* SCAllocate(Tlab& tlab, const string& desc);
+    Object* SCAllocate(Tlab& tlab, const string& desc, size_t size);
+    Tlab* AddTlab();
+    bool RefillTlab(Tlab& tlab, size_t bytes);
+    void CloseTlab(Tlab& tlab);
+    void CloseTlabs();
+    void RetireTlabs();
+    bool InNursery(Object* obj);
+    int SCNumObjects();
+    size_t SCUsedBytes();
+    Object* Evacuate(Object* obj, char*& free);
+    void Flush(char* base, char* end);
     void SCShowMemoryUsage();
-    void SCEndLifetime(Object* reference);
     void SCTriggerGC();
+    void SCTriggerGC(int cause);
+    void ResizeNursery(size_t bytes);
+    bool GrowNursery();
+    void ScanDirtyCards(char*& free);
+    void ShowCardStats();
 
 
     // Integrative utility functions for the hybrid algorithm
-    void DFSShift(Object *root);
+    Object* DFSShift(Object* root, char*& free);
+    Object* Promote(Object* obj);
+    void InitTenuring(int thres);
+    void AdaptThreshold(char* to, char* end);
+    void CheckPromotions();
+    void ShowTenuringStats();
+    int AllocationSiteId(const string& name);
+    Object* SiteAllocate(Tlab& tlab, const string& desc, int site, size_t size);
+    void EvaluateSites(bool after_ms);
+    void ShowSiteStats();
+    Object* CollectAndAllocate(Tlab& tlab, const string& desc, int site, size_t size);
+    void OutOfMemory(gc_sizing::HeapSizer& sizing, size_t size);
+    void ShowSizingStats();
     void ShowMemoryUsage();
+
+    // Object allocation and reference lifetime. "size" is the size of the
+    // object in bytes, header included: a plain Object followed by raw
+    // payload. Without it an object is just the header.
     Object* New(const string& desc, Object* parent);
-    void NewReference(const string& desc);
-    void NewReference(Object* obj);
-    void EndLifetime(Object* reference);
+    Object* New(const string& desc, Object* parent, size_t size);
+    gc_roots::RootHandle NewReference(const string& desc);
+    gc_roots::RootHandle NewReference(const string& desc, size_t size);
+    gc_roots::RootHandle NewReference(Object* obj);
+    void EndLifetime(gc_roots::RootHandle reference);
     void TriggerGC();
+    void TriggerGC(int cause);
+
+    // The same at an allocation site, from AllocationSiteId(), and for an
+    // object of "size" bytes at one
+    Object* New(const string& desc, Object* parent, int site);
+    gc_roots::RootHandle NewReference(const string& desc, int site);
+    Object* New(const string& desc, Object* parent, size_t size, int site);
+    gc_roots::RootHandle NewReference(const string& desc, size_t size, int site);
+
+    // The same for mutator threads, which attach and detach themselves.
+    // Safepoint() is the explicit safepoint poll.
+    Object* New(const string& desc, Object* parent, Mutator* mutator);
+    Object* New(const string& desc, Object* parent, int site, Mutator* mutator);
+    gc_roots::RootHandle NewReference(const string& desc, Mutator* mutator);
+    gc_roots::RootHandle NewReference(const string& desc, int site, Mutator* mutator);
+    Mutator* AttachMutator();
+    void DetachMutator(Mutator* mutator);
+    void Safepoint();
+    void RootSlots(vector <Object**>& slots);
+
+    // Every pointer store into an object goes through WriteReference() so
+    // the card-marking barrier sees it; without a slot the store is to
+    // obj->child. Mutator threads dirty cards under card_lock.
+    void WriteReference(Object* obj, Object* value);
+    void WriteReference(Object* obj, Object** slot, Object* value);
+
+    // Typed objects, allocated like NewReference() without the root: they
+    // collect first if the object does not fit, and return NULL if it still
+    // does not. Reference fields are set through WriteReference(); only
+    // roots survive a collection with their addresses up to date.
+    template <class T>
+    T* NewObject(const string& desc);
+    RefArray* NewArray(const string& desc, int length);
+
+  private:
+    // the slab and the semispaces are owned by the collector, so it cannot
+    // be copied
+    HybGraphUtil(const HybGraphUtil&);
+    HybGraphUtil& operator=(const HybGraphUtil&);
 };
 
+// Bump-pointer allocation in a thread's TLAB, the fast path. Only when the
+// TLAB is used up does the thread go to the shared nursery for the next
+// one. NULL when the nursery is full.
+inline Object* HybGraphUtil :: SCAllocate(Tlab& tlab, const string& desc) {
+	return SCAllocate(tlab, desc, sizeof(Object));
+}
+
+// The same for an object of "size" bytes, which takes up SlotBytes(size).
+inline Object* HybGraphUtil :: SCAllocate(Tlab& tlab, const string& desc, size_t size) {
+	if (size < sizeof(Object)) size = sizeof(Object);
+	size_t bytes = SlotBytes(size);
+	if (tlab.end - tlab.top < (ptrdiff_t)bytes && !RefillTlab(tlab, bytes)) return NULL;
+
+	Object* obj = new (tlab.top) Object(desc);
+	obj->size = int(size);
+	tlab.top += bytes;
+	tlab.allocated += bytes;
+	return obj;
+}
+
+template <class T>
+T* HybGraphUtil :: NewObject(const string& desc) {
+	safepoints.Poll();
+	Object* p = CollectAndAllocate(*default_tlab, desc, -1, sizeof(T));
+	if (p == NULL) return NULL;
+
+	p->~Object();
+	T* obj = new (p) T(desc);
+	obj->size = int(sizeof(T));
+	obj->type = Types::Id<T>();
+	return obj;
+}
+
 } // hyb_graph_api
 
 #endif /* HYBGRAPHAPI_H_ */
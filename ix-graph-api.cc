@@ -0,0 +1,736 @@
+/*
+ * ix-graph-api.cc
+ *
+  Mark-region collection (Immix, Blackburn and McKinley) aims for the
+  space efficiency of mark-sweep with the allocation speed and locality of
+  a copying collector.
+
+  It works as follows:
+  The heap is divided into blocks, and each block into lines of LINEBYTES.
+  Objects are bump-allocated into runs of free lines (holes), so objects
+  allocated together sit together, as in a copying heap. When the heap is
+  full, everything reachable from the roots is marked, with the same mark
+  stack, side bitmaps and parallel marker as the mark-sweep collector.
+  Dead objects are destroyed, and each line with part of a live object on
+  it is marked. A line is only reused once nothing on it is alive, so a
+  block ends up free (no marked lines), recyclable (some free lines) or
+  full, and allocation goes through the holes in recyclable blocks before
+  it starts on free ones.
+
+  Reclaiming whole lines rather than objects leaves a block with a few
+  survivors mostly useless. Such sparsely occupied blocks are defragmented
+  opportunistically: their live objects are copied (evacuated) into the
+  holes of the other blocks, with the same bump allocator the program
+  uses, the references to them redirected, and the blocks become free.
+  Only as many blocks are evacuated as the holes elsewhere can take; an
+  object that finds no room stays where it is. Only evacuated objects
+  ever move.
+
+  Objects of more than one line are a poor fit for holes. One that does
+  not fit the current hole is put in a separate overflow block, rather
+  than skipping over holes that the small objects could still use.
+
+  Several mutator threads can share the heap. Each attaches itself, keeps
+  its own roots, and takes the allocation lock for every allocation. A
+  collection first brings all of them to a safepoint (see safepoint.h).
+ */
+
+#include <new>
+#include <cstring>
+#include <algorithm>
+
+#include "ix-graph-api.h"
+
+// Heap size in bytes
+#ifndef IXHEAPSIZE
+#define IXHEAPSIZE 32768
+#endif
+
+#ifndef MARKSTACKSIZE
+#define MARKSTACKSIZE 4096
+#endif
+
+#ifndef GCTHREADS
+#define GCTHREADS 1
+#endif
+
+// Live occupancy, in percent, up to which a block is evacuated
+#ifndef EVACOCCUPANCY
+#define EVACOCCUPANCY 25
+#endif
+
+namespace ix_graph_api {
+
+// Bytes per bitmap bit, per line and per block. A block has 64 lines, so
+// its line marks are one word.
+const size_t GRANULE = 8;
+const size_t LINEBYTES = 128;
+const int LINES = 64;
+const size_t BLOCKBYTES = LINEBYTES * LINES;
+const int BLOCKGRANULES = int(BLOCKBYTES / GRANULE);
+
+// Bytes an object of "size" takes up in the heap.
+static size_t Rounded(size_t size) {
+	return (size + GRANULE - 1) / GRANULE * GRANULE;
+}
+
+// Lines "first" to "last" of a block, as a line mark word.
+static uint64_t LineRange(int first, int last) {
+	uint64_t upto = (last == LINES - 1) ? ~uint64_t(0) : (uint64_t(1) << (last + 1)) - 1;
+	return upto & ~((uint64_t(1) << first) - 1);
+}
+
+// default constructor
+// initalizes the number of objects, heap-size and the heap
+IXGraphUtil :: IXGraphUtil() {
+	num_objects = 0;
+	max_bytes = IXHEAPSIZE;
+	num_blocks = int((max_bytes + BLOCKBYTES - 1) / BLOCKBYTES);
+	max_bytes = num_blocks * BLOCKBYTES;
+	used_bytes = 0;
+	requested_bytes = 0;
+	heap = new char[max_bytes];
+	line_marks.assign(num_blocks, 0);
+	alloc_bits.assign(gc_bitmap::Words(num_blocks * BLOCKGRANULES), 0);
+	mark_bits.assign(gc_bitmap::Words(num_blocks * BLOCKGRANULES), 0);
+	gc_threads = GCTHREADS;
+	mark_stack.reserve(MARKSTACKSIZE);
+	mark_overflow = false;
+	evac_occupancy = EVACOCCUPANCY;
+	marked_lines = 0;
+	evacuated_blocks = 0;
+	evacuated_objects = 0;
+	evacuated_bytes = 0;
+	ResetAllocator();
+}
+
+// Allows the user to specify heap-size, in bytes. The heap is rounded up
+// to whole blocks.
+IXGraphUtil :: IXGraphUtil(size_t heap_bytes) {
+	num_objects = 0;
+	max_bytes = heap_bytes;
+	num_blocks = int((max_bytes + BLOCKBYTES - 1) / BLOCKBYTES);
+	max_bytes = num_blocks * BLOCKBYTES;
+	used_bytes = 0;
+	requested_bytes = 0;
+	heap = new char[max_bytes];
+	line_marks.assign(num_blocks, 0);
+	alloc_bits.assign(gc_bitmap::Words(num_blocks * BLOCKGRANULES), 0);
+	mark_bits.assign(gc_bitmap::Words(num_blocks * BLOCKGRANULES), 0);
+	gc_threads = GCTHREADS;
+	mark_stack.reserve(MARKSTACKSIZE);
+	mark_overflow = false;
+	evac_occupancy = EVACOCCUPANCY;
+	marked_lines = 0;
+	evacuated_blocks = 0;
+	evacuated_objects = 0;
+	evacuated_bytes = 0;
+	ResetAllocator();
+}
+
+// Destroys the objects still on the heap and releases it.
+IXGraphUtil :: ~IXGraphUtil() {
+	for (int i = 0; i < int(safepoints.mutators.size()); i++) {
+		delete safepoints.mutators[i];
+	}
+	for (int w = 0; w < int(alloc_bits.size()); w++) {
+		for (uint64_t bits = alloc_bits[w]; bits != 0; bits &= bits - 1) {
+			Types::Destroy(ObjectAt(w * 64 + __builtin_ctzll(bits)));
+		}
+	}
+	delete[] heap;
+}
+
+// Allocates an object that is just the header.
+Object* IXGraphUtil :: Allocate(const string& desc) {
+	return Allocate(desc, sizeof(Object));
+}
+
+// Allocates an object of "size" bytes at the bump pointer. Returns NULL
+// when no hole is left that it fits in; the callers decide whether to
+// collect and retry.
+Object* IXGraphUtil :: Allocate(const string& desc, size_t size) {
+	if (size < sizeof(Object)) size = sizeof(Object);
+	if (size > BLOCKBYTES) return NULL;
+
+	char* p = BumpAllocate(Rounded(size));
+	if (p == NULL) return NULL;
+
+	Object* obj = new (p) Object(desc);
+	obj->size = int(size);
+	gc_bitmap::Set(alloc_bits, Slot(obj));
+	num_objects++;
+	used_bytes += Rounded(size);
+	requested_bytes += size;
+	return obj;
+}
+
+// Allocation as the mutator threads do it: a safepoint poll, then
+// Allocate() under the allocation lock.
+Object* IXGraphUtil :: LockedAllocate(const string& desc, size_t size) {
+	safepoints.Poll();
+	lock_guard<mutex> guard(alloc_lock);
+	return Allocate(desc, size);
+}
+
+// Bumps the cursor over "size" bytes, moving on to the next hole that is
+// large enough if the current one is not. Medium objects try the overflow
+// block before they skip any holes.
+char* IXGraphUtil :: BumpAllocate(size_t size) {
+	if (size > LINEBYTES && size_t(limit - cursor) < size) {
+		char* p = OverflowAllocate(size);
+		if (p != NULL) return p;
+	}
+	while (size_t(limit - cursor) < size) {
+		if (!NextHole()) return NULL;
+	}
+	char* p = cursor;
+	cursor += size;
+	return p;
+}
+
+// Bump allocation in the overflow block, which is a free block taken
+// whole. NULL when the overflow block is full and no free block is left.
+char* IXGraphUtil :: OverflowAllocate(size_t size) {
+	if (size_t(overflow_limit - overflow_cursor) < size) {
+		if (free_blocks.empty()) return NULL;
+		int block = free_blocks.back();
+		free_blocks.pop_back();
+		overflow_cursor = heap + block * BLOCKBYTES;
+		overflow_limit = overflow_cursor + BLOCKBYTES;
+	}
+	char* p = overflow_cursor;
+	overflow_cursor += size;
+	return p;
+}
+
+// Moves the cursor to the next hole: the next run of unmarked lines in
+// the current block, else the first one in the next recyclable block,
+// else a free block. False when the heap has no hole left.
+bool IXGraphUtil :: NextHole() {
+	while (true) {
+		if (alloc_block >= 0 && alloc_line < LINES) {
+			uint64_t marks = line_marks[alloc_block];
+			uint64_t holes = ~marks & (~uint64_t(0) << alloc_line);
+			if (holes != 0) {
+				int first = __builtin_ctzll(holes);
+				uint64_t after = marks & (~uint64_t(0) << first);
+				int end = (after != 0) ? __builtin_ctzll(after) : LINES;
+				char* base = heap + alloc_block * BLOCKBYTES;
+				cursor = base + first * LINEBYTES;
+				limit = base + end * LINEBYTES;
+				alloc_line = end;
+				return true;
+			}
+		}
+		if (!recyclable_blocks.empty()) {
+			alloc_block = recyclable_blocks.back();
+			recyclable_blocks.pop_back();
+		} else if (!free_blocks.empty()) {
+			alloc_block = free_blocks.back();
+			free_blocks.pop_back();
+		} else {
+			return false;
+		}
+		alloc_line = 0;
+	}
+}
+
+// Index of the granule an object starts at, and of its bits in the
+// bitmaps.
+int IXGraphUtil :: Slot(Object* obj) {
+	return int(((char*)obj - heap) / GRANULE);
+}
+
+// The object starting at granule "slot".
+Object* IXGraphUtil :: ObjectAt(int slot) {
+	return (Object*)(heap + slot * GRANULE);
+}
+
+// This is triggered when there is not enough space on the heap. Every
+// mutator thread is stopped at a safepoint for the collection. If another
+// thread was collecting already, its collection stands in for this one.
+void IXGraphUtil :: TriggerGC() {
+	TriggerGC(gc_events::EXPLICIT);
+}
+
+// TriggerGC() for "cause", one of the causes in gc-events.h, which the
+// event log records with the collection.
+void IXGraphUtil :: TriggerGC(int cause) {
+	if (!safepoints.StopTheWorld()) return;
+	events.Begin(cause, gc_events::FULL_HEAP);
+	events.Before(num_objects, used_bytes);
+	Collect();
+	events.After(num_objects, used_bytes);
+	events.End();
+	safepoints.ResumeTheWorld();
+}
+
+// The collection proper, with the world stopped: mark, destroy the dead,
+// mark the lines of what is left, evacuate the sparse blocks, and start
+// allocating again from the first hole.
+void IXGraphUtil :: Collect() {
+	if (gc_threads > 1) {
+		gc_parallel::ParallelMarker<Object, Types> marker(heap, GRANULE, num_blocks * BLOCKGRANULES,
+		                                                  mark_bits, gc_threads);
+		vector <Object*> refs(roots.Refs());
+		for (int m = 0; m < int(safepoints.mutators.size()); m++) {
+			const vector <Object*>& more = safepoints.mutators[m]->roots.Refs();
+			refs.insert(refs.end(), more.begin(), more.end());
+			if (safepoints.mutators[m]->held != NULL) refs.push_back(safepoints.mutators[m]->held);
+		}
+		marker.Mark(refs);
+		events.Phase(gc_events::MARK);
+	} else {
+		MarkRoots();
+		events.Phase(gc_events::ROOTS);
+		ProcessMarkStack();
+		events.Phase(gc_events::MARK);
+	}
+
+	SweepDead();
+	MarkLines();
+	events.Phase(gc_events::SWEEP);
+	if (Evacuate()) MarkLines();
+	events.Phase(gc_events::COPY);
+	mark_bits.assign(mark_bits.size(), 0);
+	ResetAllocator();
+	events.Phase(gc_events::SWEEP);
+}
+
+// The addresses of every root reference: the collector's roots, and each
+// mutator's roots and held parent.
+void IXGraphUtil :: RootSlots(vector <Object**>& slots) {
+	for (int i = 0; i < roots.size(); i++) {
+		slots.push_back(&roots[i]);
+	}
+	for (int m = 0; m < int(safepoints.mutators.size()); m++) {
+		Mutator* mutator = safepoints.mutators[m];
+		for (int i = 0; i < mutator->roots.size(); i++) {
+			slots.push_back(&mutator->roots[i]);
+		}
+		slots.push_back(&mutator->held);
+	}
+}
+
+// Pushes every root onto the mark stack.
+void IXGraphUtil :: MarkRoots() {
+	vector <Object**> slots;
+	RootSlots(slots);
+	for (int i = 0; i < int(slots.size()); i++) {
+		MarkPush(*slots[i]);
+	}
+}
+
+// Pushes what one reference slot of a marked object points to.
+struct MarkVisitor {
+	IXGraphUtil* gc;
+
+	MarkVisitor(IXGraphUtil* collector) : gc(collector) {}
+
+	void operator()(Object*& slot) {
+		gc->MarkPush(slot);
+	}
+};
+
+// The same, for a slot whose target an overflowing push may have dropped:
+// only a target that is still unmarked is pushed again.
+struct RescanVisitor {
+	IXGraphUtil* gc;
+
+	RescanVisitor(IXGraphUtil* collector) : gc(collector) {}
+
+	void operator()(Object*& slot) {
+		if (slot != NULL && !gc_bitmap::Test(gc->mark_bits, gc->Slot(slot))) {
+			gc->MarkPush(slot);
+		}
+	}
+};
+
+// Redirects one reference slot to the copy of an evacuated target.
+struct ForwardVisitor {
+	void operator()(Object*& slot) {
+		if (slot != NULL && slot->forward != NULL) slot = slot->forward;
+	}
+};
+
+// Pushes an object onto the mark stack, or when the stack is full marks
+// it without scanning it and leaves the overflow for RescanHeap().
+void IXGraphUtil :: MarkPush(Object* obj) {
+	if (obj == NULL) return;
+
+	if (int(mark_stack.size()) == MARKSTACKSIZE) {
+		gc_bitmap::Set(mark_bits, Slot(obj));
+		mark_overflow = true;
+		return;
+	}
+	__builtin_prefetch(obj);
+	mark_stack.push_back(obj);
+}
+
+// Drains the mark stack, then recovers from any overflow until the heap
+// has been marked completely.
+void IXGraphUtil :: ProcessMarkStack() {
+	MarkVisitor visitor(this);
+	do {
+		while (!mark_stack.empty()) {
+			Object* obj = mark_stack.back();
+			mark_stack.pop_back();
+			int slot = Slot(obj);
+			if (gc_bitmap::Test(mark_bits, slot)) continue;
+
+			gc_bitmap::Set(mark_bits, slot);
+			Types::Trace(obj, visitor);
+		}
+		if (mark_overflow) {
+			mark_overflow = false;
+			RescanHeap();
+		}
+	} while (!mark_stack.empty() || mark_overflow);
+}
+
+// Finds the marked objects whose children were dropped by an overflowing
+// push and pushes those children again. Only marked slots are visited.
+void IXGraphUtil :: RescanHeap() {
+	RescanVisitor visitor(this);
+	for (int w = 0; w < int(mark_bits.size()); w++) {
+		for (uint64_t bits = mark_bits[w]; bits != 0; bits &= bits - 1) {
+			Types::Trace(ObjectAt(w * 64 + __builtin_ctzll(bits)), visitor);
+		}
+	}
+}
+
+// Destroys every object that is allocated but not marked, a word of the
+// bitmaps at a time.
+void IXGraphUtil :: SweepDead() {
+	for (int w = 0; w < int(alloc_bits.size()); w++) {
+		uint64_t dead = alloc_bits[w] & ~mark_bits[w];
+		alloc_bits[w] &= mark_bits[w];
+		for (; dead != 0; dead &= dead - 1) {
+			Object* obj = ObjectAt(w * 64 + __builtin_ctzll(dead));
+			used_bytes -= Rounded(obj->size);
+			requested_bytes -= obj->size;
+			num_objects--;
+			Types::Destroy(obj);
+		}
+	}
+}
+
+// Opportunistic defragmentation. The blocks with no more than
+// evac_occupancy percent of their lines marked are candidates, the
+// emptiest first, for as long as the holes in the other blocks have
+// room for their marked lines. The allocator is pointed at those holes,
+// and each candidate's objects are copied out through it, leaving a
+// forwarding pointer behind; then every root and every reference held by
+// a live object is redirected to the copies, and the originals are
+// destroyed. An object the allocator has no more room for stays where it
+// is. False if nothing was evacuated, so the line marks still stand.
+bool IXGraphUtil :: Evacuate() {
+	evacuated_blocks = 0;
+	evacuated_objects = 0;
+	evacuated_bytes = 0;
+
+	vector <pair<int, int> > candidates;
+	long room = 0;
+	for (int b = 0; b < num_blocks; b++) {
+		int lines = __builtin_popcountll(line_marks[b]);
+		room += LINES - lines;
+		if (lines > 0 && lines * 100 <= LINES * evac_occupancy) {
+			candidates.push_back(make_pair(lines, b));
+		}
+	}
+	sort(candidates.begin(), candidates.end());
+	evacuating.assign(num_blocks, 0);
+	long needed = 0;
+	int chosen = 0;
+	for (; chosen < int(candidates.size()); chosen++) {
+		int lines = candidates[chosen].first;
+		if (needed + lines > room - (LINES - lines)) break;
+		needed += lines;
+		room -= LINES - lines;
+		evacuating[candidates[chosen].second] = 1;
+	}
+	if (chosen == 0) {
+		evacuating.clear();
+		return false;
+	}
+
+	ResetAllocator();
+	for (int c = 0; c < chosen; c++) {
+		int first = candidates[c].second * BLOCKGRANULES / 64;
+		bool emptied = true;
+		for (int w = first; w < first + BLOCKGRANULES / 64; w++) {
+			for (uint64_t bits = mark_bits[w]; bits != 0; bits &= bits - 1) {
+				Object* obj = ObjectAt(w * 64 + __builtin_ctzll(bits));
+				size_t size = Rounded(obj->size);
+				char* to = BumpAllocate(size);
+				if (to == NULL) {
+					emptied = false;
+					continue;
+				}
+				Object* copy = Types::CopyTo(obj, to);
+				gc_bitmap::Set(alloc_bits, Slot(copy));
+				gc_bitmap::Set(mark_bits, Slot(copy));
+				obj->forward = copy;
+				evacuated_objects++;
+				evacuated_bytes += size;
+			}
+		}
+		if (emptied) evacuated_blocks++;
+	}
+	evacuating.clear();
+
+	vector <Object**> slots;
+	RootSlots(slots);
+	for (int i = 0; i < int(slots.size()); i++) {
+		Object* obj = *slots[i];
+		if (obj != NULL && obj->forward != NULL) *slots[i] = obj->forward;
+	}
+	ForwardVisitor visitor;
+	for (int w = 0; w < int(mark_bits.size()); w++) {
+		for (uint64_t bits = mark_bits[w]; bits != 0; bits &= bits - 1) {
+			Types::Trace(ObjectAt(w * 64 + __builtin_ctzll(bits)), visitor);
+		}
+	}
+
+	for (int c = 0; c < chosen; c++) {
+		int first = candidates[c].second * BLOCKGRANULES / 64;
+		for (int w = first; w < first + BLOCKGRANULES / 64; w++) {
+			for (uint64_t bits = mark_bits[w]; bits != 0; bits &= bits - 1) {
+				int slot = w * 64 + __builtin_ctzll(bits);
+				Object* obj = ObjectAt(slot);
+				if (obj->forward == NULL) continue;
+				gc_bitmap::Clear(alloc_bits, slot);
+				gc_bitmap::Clear(mark_bits, slot);
+				Types::Destroy(obj);
+			}
+		}
+	}
+	return true;
+}
+
+// Marks every line that a live object covers any part of.
+void IXGraphUtil :: MarkLines() {
+	line_marks.assign(num_blocks, 0);
+	marked_lines = 0;
+	for (int w = 0; w < int(mark_bits.size()); w++) {
+		for (uint64_t bits = mark_bits[w]; bits != 0; bits &= bits - 1) {
+			int slot = w * 64 + __builtin_ctzll(bits);
+			size_t offset = slot * GRANULE;
+			int block = int(offset / BLOCKBYTES);
+			size_t in_block = offset % BLOCKBYTES;
+			int first = int(in_block / LINEBYTES);
+			int last = int((in_block + Rounded(ObjectAt(slot)->size) - 1) / LINEBYTES);
+			line_marks[block] |= LineRange(first, last);
+		}
+	}
+	for (int b = 0; b < num_blocks; b++) {
+		marked_lines += __builtin_popcountll(line_marks[b]);
+	}
+}
+
+// Sorts the blocks into free, recyclable and full by their line marks,
+// and empties the allocation cursors. Both lists are popped from the back,
+// so they hold the blocks in descending order and allocation works its way
+// up the heap. Blocks being evacuated are left out of both.
+void IXGraphUtil :: ResetAllocator() {
+	free_blocks.clear();
+	recyclable_blocks.clear();
+	full_count = 0;
+	for (int b = num_blocks - 1; b >= 0; b--) {
+		if (!evacuating.empty() && evacuating[b]) continue;
+		if (line_marks[b] == 0) {
+			free_blocks.push_back(b);
+		} else if (line_marks[b] != ~uint64_t(0)) {
+			recyclable_blocks.push_back(b);
+		} else {
+			full_count++;
+		}
+	}
+	free_count = int(free_blocks.size());
+	recyclable_count = int(recyclable_blocks.size());
+	cursor = limit = heap;
+	overflow_cursor = overflow_limit = heap;
+	alloc_block = -1;
+	alloc_line = LINES;
+}
+
+// Shows the memory used and free, in bytes, and how fragmented it is:
+// internally, the share of the used bytes lost to rounding up to whole
+// granules, and externally, the share of the free bytes that is not in
+// free blocks, ie. is in holes or in the unused ends of marked lines.
+void IXGraphUtil :: ShowMemoryUsage() {
+	size_t free_bytes = max_bytes - used_bytes;
+	size_t empty_blocks = 0;
+	for (int b = 0; b < num_blocks; b++) {
+		int first = b * BLOCKGRANULES / 64;
+		bool empty = true;
+		for (int w = first; w < first + BLOCKGRANULES / 64 && empty; w++) {
+			if (alloc_bits[w] != 0) empty = false;
+		}
+		if (empty) empty_blocks++;
+	}
+	size_t stranded = free_bytes - empty_blocks * BLOCKBYTES;
+	cout << "Used Memory: " << used_bytes << " bytes" << endl;
+	cout << "Free Memory: " << free_bytes << " bytes" << endl;
+	cout << "Internal fragmentation: "
+	     << (used_bytes ? 100.0 * (used_bytes - requested_bytes) / used_bytes : 0) << "%" << endl;
+	cout << "External fragmentation: "
+	     << (free_bytes ? 100.0 * stranded / free_bytes : 0) << "%" << endl << "------------------\n";
+}
+
+// Reports how the last collection left the blocks and what it evacuated.
+void IXGraphUtil :: ShowRegionStats() {
+	cout << "Blocks: " << free_count << " free, " << recyclable_count << " recyclable, "
+	     << full_count << " full" << endl;
+	cout << "Marked lines: " << marked_lines << " of " << long(num_blocks) * LINES << endl;
+	cout << "Evacuated: " << evacuated_blocks << " blocks, " << evacuated_objects
+	     << " objects, " << evacuated_bytes << " bytes" << endl << "------------------\n";
+}
+
+// Creates a new reference object. Object* obj = new Object();. Essentially,
+// creates an object in the heap and a reference in the root table, and
+// returns the root's handle (an invalid one if the heap is full).
+gc_roots::RootHandle IXGraphUtil :: NewReference(const string& desc) {
+	return NewReference(desc, sizeof(Object));
+}
+
+// The same for an object of "size" bytes.
+gc_roots::RootHandle IXGraphUtil :: NewReference(const string& desc, size_t size) {
+	Object* obj = LockedAllocate(desc, size);
+
+	// if the heap is full, then we call TriggerGC() to free up some space.
+	if (obj == NULL) {
+		TriggerGC(gc_events::HEAP_FULL);
+		obj = LockedAllocate(desc, size);
+	}
+
+	if (obj != NULL) {
+		return roots.Add(obj);
+	}
+	cout << "Error! Unable to allocate memory!\n";
+	gc_roots::RootHandle none = { -1, 0 };
+	return none;
+}
+
+// The allocation path of the typed objects: if the object does not fit,
+// the heap is collected once. NULL when it still does not fit.
+Object* IXGraphUtil :: CollectAndAllocate(const string& desc, size_t size) {
+	Object* obj = LockedAllocate(desc, size);
+	if (obj == NULL) {
+		TriggerGC(gc_events::HEAP_FULL);
+		obj = LockedAllocate(desc, size);
+	}
+	if (obj == NULL) cout << "Error! Unable to allocate memory!\n";
+	return obj;
+}
+
+// Allocates an array of "length" references, all NULL.
+RefArray* IXGraphUtil :: NewArray(const string& desc, int length) {
+	size_t size = sizeof(RefArray) + length * sizeof(Object*);
+	Object* p = CollectAndAllocate(desc, size);
+	if (p == NULL) return NULL;
+
+	p->~Object();
+	RefArray* array = new (p) RefArray(desc, length);
+	array->size = int(size);
+	array->type = Types::Id<RefArray>();
+	return array;
+}
+
+// Creating a new reference and making it point to an existing object
+// Object *obj = x;
+gc_roots::RootHandle IXGraphUtil :: NewReference(Object* obj) {
+	return roots.Add(obj);
+}
+
+// New object that would be pointed to by an existing pointer.
+// This includes objects that are reffered to by other objects,
+// a self-referencing object, like a binary tree structure or a
+// linked-list.
+Object* IXGraphUtil :: New(const string& desc, Object* parent) {
+	return New(desc, parent, sizeof(Object));
+}
+
+// The same for an object of "size" bytes. The parent is held as a
+// temporary root across the collection, since evacuation may move it.
+Object* IXGraphUtil :: New(const string& desc, Object* parent, size_t size) {
+	Object* obj = LockedAllocate(desc, size);
+	if (obj == NULL) {
+		gc_roots::RootHandle held = roots.Add(parent);
+		TriggerGC(gc_events::HEAP_FULL);
+		parent = roots.Get(held);
+		roots.Remove(held);
+		obj = LockedAllocate(desc, size);
+	}
+
+	if (obj != NULL) {
+		parent->child = obj;
+	} else {
+		cout << "Error! Unable to allocate memory!\n";
+	}
+	return obj;
+}
+
+// Getting rid of the root reference. This is typically when a pointer
+// falls out of scope causing a memory leak.
+void IXGraphUtil :: EndLifetime(gc_roots::RootHandle reference) {
+	roots.Remove(reference);
+}
+
+// New() for a mutator thread. The parent is kept in the mutator's "held"
+// slot from before the safepoint poll until the object is linked in, since
+// any collection in between may move it.
+Object* IXGraphUtil :: New(const string& desc, Object* parent, Mutator* mutator) {
+	mutator->held = parent;
+	Object* obj = LockedAllocate(desc, sizeof(Object));
+	if (obj == NULL) {
+		TriggerGC(gc_events::HEAP_FULL);
+		obj = LockedAllocate(desc, sizeof(Object));
+	}
+	parent = mutator->held;
+	mutator->held = NULL;
+
+	if (obj != NULL) {
+		parent->child = obj;
+	} else {
+		cout << "Error! Unable to allocate memory!\n";
+	}
+	return obj;
+}
+
+// NewReference() for a mutator thread: the new root is the mutator's.
+gc_roots::RootHandle IXGraphUtil :: NewReference(const string& desc, Mutator* mutator) {
+	Object* obj = LockedAllocate(desc, sizeof(Object));
+	if (obj == NULL) {
+		TriggerGC(gc_events::HEAP_FULL);
+		obj = LockedAllocate(desc, sizeof(Object));
+	}
+	if (obj != NULL) {
+		return mutator->roots.Add(obj);
+	}
+	cout << "Error! Unable to allocate memory!\n";
+	gc_roots::RootHandle none = { -1, 0 };
+	return none;
+}
+
+// Attaches the calling thread as a mutator, with an empty root set.
+Mutator* IXGraphUtil :: AttachMutator() {
+	Mutator* mutator = new Mutator();
+	safepoints.Attach(mutator);
+	return mutator;
+}
+
+// Detaches a mutator thread; its roots end with it.
+void IXGraphUtil :: DetachMutator(Mutator* mutator) {
+	safepoints.Detach(mutator);
+	delete mutator;
+}
+
+// Safepoint poll for a mutator thread that goes a long way without
+// allocating.
+void IXGraphUtil :: Safepoint() {
+	safepoints.Poll();
+}
+
+} // ix_graph_api
@@ -0,0 +1,294 @@
+/*
+ * ix-graph-api.h
+ *
+ *  Mark-region (Immix) collector. The same interface as the other
+ *  collectors, over a heap of blocks and lines.
+ */
+
+#ifndef IXGRAPHAPI_H_
+#define IXGRAPHAPI_H_
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <new>
+#include <cstring>
+#include <mutex>
+#include "gc-bitmap.h"
+#include "gc-types.h"
+#include "parallel-mark.h"
+#include "root-table.h"
+#include "safepoint.h"
+#include "gc-events.h"
+
+using namespace std;
+
+namespace ix_graph_api {
+
+// An object is this header followed by size - sizeof(Object) bytes of raw
+// payload that the collector never looks at, as in the mark-sweep heap.
+// "forward" is set only while an evacuated object waits for the
+// references to it to be redirected to its copy. Plain Objects are type 0;
+// the other types below derive from it and describe their reference
+// fields (see gc-types.h).
+class Object {
+  public:
+    Object* forward;
+    Object* child;
+    int size;       // bytes asked for, header included
+    int type;       // index in Types
+    string desc;
+    Object() {
+        forward = NULL;
+        child = NULL;
+        size = sizeof(Object);
+        type = 0;
+        desc = "";
+    }
+    Object (const string& description) {
+    	forward = NULL;
+    	child = NULL;
+    	size = sizeof(Object);
+    	type = 0;
+    	desc = description;
+    }
+    char* Payload() { return (char*)(this + 1); }
+
+    size_t Size() const { return size; }
+
+    Object* CopyTo(void* to) {
+    	Object* copy = new (to) Object(*this);
+    	memcpy(copy->Payload(), Payload(), size - sizeof(Object));
+    	return copy;
+    }
+
+    template <class V>
+    void EachRef(V& v) {
+    	v(child);
+    }
+};
+
+// An object with REFS reference fields on top of child, and BYTES bytes of
+// raw payload the collector never looks at.
+template <int REFS, int BYTES>
+class Record : public Object {
+  public:
+    Object* refs[REFS];
+    char payload[BYTES];
+
+    Record (const string& description) : Object(description) {
+    	for (int i = 0; i < REFS; i++) refs[i] = NULL;
+    	memset(payload, 0, BYTES);
+    }
+
+    Object* CopyTo(void* to) { return new (to) Record(*this); }
+
+    template <class V>
+    void EachRef(V& v) {
+    	v(child);
+    	for (int i = 0; i < REFS; i++) v(refs[i]);
+    }
+};
+
+// Binary tree node: refs[0] and refs[1] are the subtrees, the payload a key.
+typedef Record<2, 8> TreeNode;
+// Hash map entry: child is the next entry in the bucket, refs[0] the value,
+// the payload the key.
+typedef Record<1, 16> MapEntry;
+
+// An array of "length" references stored right after the header.
+class RefArray : public Object {
+  public:
+    int length;
+
+    RefArray (const string& description, int n) : Object(description) {
+    	length = n;
+    	for (int i = 0; i < n; i++) Elems()[i] = NULL;
+    }
+
+    Object** Elems() { return (Object**)(this + 1); }
+
+    Object* CopyTo(void* to) {
+    	RefArray* copy = new (to) RefArray(*this);
+    	memcpy(copy->Elems(), Elems(), length * sizeof(Object*));
+    	return copy;
+    }
+
+    template <class V>
+    void EachRef(V& v) {
+    	v(child);
+    	Object** elems = Elems();
+    	for (int i = 0; i < length; i++) v(elems[i]);
+    }
+};
+
+// Every type the heap can hold. A new type is added here.
+typedef gc_types::TypeList<Object, Object, TreeNode, MapEntry, RefArray> Types;
+
+// A mutator thread attached to the collector, with roots of its own, and
+// "held", the parent that New() keeps across a collection for it.
+class Mutator {
+  public:
+    gc_roots::RootTable <Object> roots;
+    Object* held;
+    Mutator() {
+    	held = NULL;
+    }
+};
+
+class IXGraphUtil {
+  public:
+
+    // constructors, heap sizes are in bytes
+    IXGraphUtil();
+    IXGraphUtil(size_t heap_bytes);
+    ~IXGraphUtil();
+
+    // utility data members. used_bytes counts the bytes objects take up,
+    // rounded to granules, requested_bytes what was asked for.
+    int num_objects;
+    size_t max_bytes;
+    size_t used_bytes;
+    size_t requested_bytes;
+
+    // container for root items. Evacuation moves objects, so these are the
+    // only references the collector updates; other pointers held by the
+    // caller go stale across a TriggerGC().
+    gc_roots::RootTable <Object> roots;
+
+    // Mutator threads. Allocation is serialised on alloc_lock, and
+    // TriggerGC() stops every mutator at a safepoint. A mutator's roots are
+    // updated like the others.
+    gc_safepoint::Safepoints <Mutator> safepoints;
+    mutex alloc_lock;
+
+    // The heap is one contiguous region of whole blocks, and every block is
+    // 64 lines. line_marks has one word per block with a bit per line,
+    // set for the lines that held something live at the last collection;
+    // the clear bits are the holes allocation can reuse. No object is
+    // larger than a block.
+    char* heap;
+    int num_blocks;
+    vector <uint64_t> line_marks;
+
+    // Side bitmaps with one bit per granule, as in the mark-sweep heap: the
+    // granules that start an allocated object and the objects reached by
+    // the current mark.
+    vector <uint64_t> alloc_bits;
+    vector <uint64_t> mark_bits;
+
+    // Bump allocation. Small objects go into the current hole, [cursor,
+    // limit), in block alloc_block; the next hole is looked for from line
+    // alloc_line on, then in the recyclable blocks (with some free lines)
+    // and last in the free blocks. An object of more than a line that does
+    // not fit the current hole goes to the overflow block instead, so it
+    // does not cost the small objects their holes.
+    char* cursor;
+    char* limit;
+    int alloc_block;
+    int alloc_line;
+    char* overflow_cursor;
+    char* overflow_limit;
+    vector <int> recyclable_blocks;
+    vector <int> free_blocks;
+
+    // Number of GC worker threads marking in parallel; 1 keeps marking on
+    // the calling thread.
+    int gc_threads;
+
+    // Explicit mark stack, bounded at MARKSTACKSIZE entries, with the same
+    // overflow handling as the mark-sweep collector.
+    vector <Object*> mark_stack;
+    bool mark_overflow;
+
+    // Blocks with at most evac_occupancy percent of their lines marked
+    // are evacuated into the holes of the other blocks, as far as those
+    // have room. "evacuating" flags them while the allocator copies their
+    // objects out.
+    int evac_occupancy;
+    vector <char> evacuating;
+
+    // What the last collection found: blocks by state, lines marked, and
+    // the blocks, objects and bytes it evacuated.
+    int free_count;
+    int recyclable_count;
+    int full_count;
+    long marked_lines;
+    int evacuated_blocks;
+    long evacuated_objects;
+    long evacuated_bytes;
+
+    // Every collection is logged here once the log is enabled (see
+    // gc-events.h), the evacuation as its copy phase.
+    gc_events::EventLog events;
+
+    // Utility functions
+    Object* Allocate(const string& desc);
+    Object* Allocate(const string& desc, size_t size);
+    Object* LockedAllocate(const string& desc, size_t size);
+    char* BumpAllocate(size_t size);
+    char* OverflowAllocate(size_t size);
+    bool NextHole();
+    int Slot(Object* obj);
+    Object* ObjectAt(int slot);
+    void TriggerGC();
+    void TriggerGC(int cause);
+    void Collect();
+    void RootSlots(vector <Object**>& slots);
+    void MarkRoots();
+    void MarkPush(Object* obj);
+    void ProcessMarkStack();
+    void RescanHeap();
+    void SweepDead();
+    bool Evacuate();
+    void MarkLines();
+    void ResetAllocator();
+    void ShowMemoryUsage();
+    void ShowRegionStats();
+
+    // Functions dealing with memory allocation and references falling
+    // out of scope
+    Object* New(const string& desc, Object* parent);
+    Object* New(const string& desc, Object* parent, size_t size);
+    gc_roots::RootHandle NewReference(const string& desc);
+    gc_roots::RootHandle NewReference(const string& desc, size_t size);
+    gc_roots::RootHandle NewReference(Object* obj);
+    void EndLifetime(gc_roots::RootHandle reference);
+
+    // The same for mutator threads, which attach and detach themselves.
+    // Safepoint() is the explicit safepoint poll.
+    Object* New(const string& desc, Object* parent, Mutator* mutator);
+    gc_roots::RootHandle NewReference(const string& desc, Mutator* mutator);
+    Mutator* AttachMutator();
+    void DetachMutator(Mutator* mutator);
+    void Safepoint();
+
+    // Typed objects. These collect first if the object does not fit and
+    // return NULL if it still does not. Fields are set by the caller; only
+    // roots survive an evacuation with their addresses up to date.
+    template <class T>
+    T* NewObject(const string& desc);
+    RefArray* NewArray(const string& desc, int length);
+    Object* CollectAndAllocate(const string& desc, size_t size);
+
+  private:
+    // the heap is owned by the collector, so it cannot be copied
+    IXGraphUtil(const IXGraphUtil&);
+    IXGraphUtil& operator=(const IXGraphUtil&);
+};
+
+template <class T>
+T* IXGraphUtil :: NewObject(const string& desc) {
+	Object* p = CollectAndAllocate(desc, sizeof(T));
+	if (p == NULL) return NULL;
+
+	p->~Object();
+	T* obj = new (p) T(desc);
+	obj->size = sizeof(T);
+	obj->type = Types::Id<T>();
+	return obj;
+}
+
+} // ix_graph_api
+
+#endif /* IXGRAPHAPI_H_ */
@@ -4,112 +4,113 @@
  *  Created on: 08-Apr-2012
  *      Author: shankar
  *
+ *  Runs one workload on the collectors. With no arguments, each collector
+ *  not cancelled below runs it as its own instantiation of the workload.
+ *  Otherwise the arguments name the collectors to run it on (ms, sc, hyb,
+ *  mc, ix), picked at run time through AnyCollector.
  */
 
-#include "ms-graph-api.h"
-#include "sc-graph-api.h"
-#include "hyb-graph-api.h"
+#include "gc-collector.h"
 
 
 #define CANCELMSTEST // comment if you want to run MS test
 #define CANCELSCTEST // comment if you want to run SC test
 //#define CANCELHYBTEST // comment if you want to run hybrid test
+#define CANCELMCTEST // comment if you want to run mark-compact test
+#define CANCELIXTEST // comment if you want to run mark-region test
 
 
 using namespace std;
+using namespace gc_collector;
 
-int main() {
-
-#ifndef CANCELMSTEST
-#define CANCELMSTEST
-
-	ms_graph_api::MSGraphUtil msgc;
+// 25 roots with a chain of three objects hanging off each. The roots then
+// end one at a time, with a collection after each.
+template <class GC>
+static void GraphWorkload(GC& gc) {
 	for (int i = 0; i < 25; i++) {
-		msgc.NewReference("root");
+		gc.NewReference("root");
 	}
-	cout << "\nMark and Sweep.\n";
-	msgc.ShowMemoryUsage();
+	cout << "\n" << gc.Name() << ".\n";
+	gc.ShowMemoryUsage();
 
 	for (int i = 0; i < 25; i++) {
-		ms_graph_api::Object* obj1 = msgc.New("", msgc.roots[i]);
-		ms_graph_api::Object* obj2 = msgc.New("", obj1);
-		msgc.New("", obj2);
+		typename GC::Object* obj1 = gc.New("", gc.Root(i));
+		typename GC::Object* obj2 = gc.New("", obj1);
+		gc.New("", obj2);
 	}
 
-	msgc.ShowMemoryUsage();
+	gc.ShowMemoryUsage();
 
 	for (int i = 0; i < 25; i++) {
-		msgc.EndLifetime(msgc.roots[0]);
-		msgc.TriggerGC();
-		msgc.ShowMemoryUsage();
+		gc.EndLifetime(gc.RootAt(0));
+		gc.TriggerGC();
+		gc.ShowMemoryUsage();
 	}
+	gc.ShowStats();
+}
 
-#endif
+// The collector called "name", with a heap big enough for the workload.
+// NULL for a name that is not one.
+static AnyCollector* NewCollector(const string& name) {
+	if (name == "ms") return AnyCollector::Make<MarkSweep>();
+	if (name == "sc") return AnyCollector::Make<StopCopy>(100 * sizeof(sc_graph_api::Object));
+	if (name == "hyb") return AnyCollector::Make<Hybrid>();
+	if (name == "mc") return AnyCollector::Make<MarkCompact>(100 * sizeof(mc_graph_api::Object));
+	if (name == "ix") return AnyCollector::Make<MarkRegion>();
+	cout << "Error! No collector called " << name << "!\n";
+	return NULL;
+}
 
-#ifndef CANCELSCTEST
-#define CANCELSCTEST
+int main(int argc, char** argv) {
 
-	  using namespace sc_graph_api;
-    SCGraphUtil scgc(100);
-		for (int i = 0; i < 25; i++) {
-			scgc.NewReference("root");
+	if (argc > 1) {
+		for (int i = 1; i < argc; i++) {
+			AnyCollector* gc = NewCollector(argv[i]);
+			if (gc == NULL) return 1;
+			GraphWorkload(*gc);
+			delete gc;
 		}
-		cout << "\nStop-Copy.\n";
-		scgc.ShowMemoryUsage();
+		return 0;
+	}
 
-		for (int i = 0; i < 25; i++) {
-			sc_graph_api::Object* obj1 = scgc.New("", scgc.roots[i]);
-			sc_graph_api::Object* obj2 = scgc.New("", obj1);
-			scgc.New("", obj2);
-		}
+#ifndef CANCELMSTEST
+#define CANCELMSTEST
 
-		scgc.ShowMemoryUsage();
+	Collector<MarkSweep> msgc;
+	GraphWorkload(msgc);
 
-		for (int i = 0; i < 25; i++) {
-			scgc.EndLifetime(scgc.roots[0]);
-			scgc.TriggerGC();
-			scgc.ShowMemoryUsage();
-		}
+#endif
+
+#ifndef CANCELSCTEST
+#define CANCELSCTEST
+
+	Collector<StopCopy> scgc(100 * sizeof(sc_graph_api::Object));
+	GraphWorkload(scgc);
 
 #endif
 
 #ifndef CANCELHYBTEST
 #define CANCELHYBTEST
-	
-  using namespace hyb_graph_api;
-	HybGraphUtil gc;
-	for (int i = 0; i < 25; i++) {
-		gc.NewReference("root");
-	}
-	cout << "\nHybrid.\n";
-	gc.ShowMemoryUsage();
-  cout << "MarkSweep heap:\n";
-  gc.MSShowMemoryUsage();
-  cout << "StopCopy heap:\n";
-  gc.SCShowMemoryUsage();
-  cout << endl;
-	for (int i = 0; i < 25; i++) {
-		Object* obj1 = gc.New("", gc.sc_roots[i]);
-		Object* obj2 = gc.New("", obj1);
-		gc.New("", obj2);
-	}
 
-  gc.ShowMemoryUsage();
-  cout << "MarkSweep heap:\n";
-  gc.MSShowMemoryUsage();
-  cout << "StopCopy heap:\n";
-  gc.SCShowMemoryUsage();
-  cout << endl;
-  for (int i = 0; i < 25; i++) {
-    if (gc.sc_roots.size() > 0) gc.sc_roots.pop_back(); else gc.ms_roots.pop_back();
-    gc.TriggerGC();
-    gc.ShowMemoryUsage();
-    cout << "MarkSweep heap:\n";
-    gc.MSShowMemoryUsage();
-    cout << "StopCopy heap:\n";
-    gc.SCShowMemoryUsage();
-    cout << endl;
-  }
+	Collector<Hybrid> gc;
+	GraphWorkload(gc);
+
+#endif
+
+#ifndef CANCELMCTEST
+#define CANCELMCTEST
+
+	Collector<MarkCompact> mcgc(100 * sizeof(mc_graph_api::Object));
+	GraphWorkload(mcgc);
+
+#endif
+
+#ifndef CANCELIXTEST
+#define CANCELIXTEST
+
+	Collector<MarkRegion> ixgc;
+	GraphWorkload(ixgc);
+
 #endif
 
   return 0;
@@ -0,0 +1,488 @@
+/*
+ * mc-graph-api.cc
+ *
+  Mark-compact gets the best of the other two collectors: like mark-sweep
+  it needs no copy reserve, the whole heap holds objects, and like
+  stop-copy it leaves the free memory in one piece, so allocation is a
+  pointer bump and there is no fragmentation.
+
+  It works as follows:
+  Objects are bump-allocated back to back from the bottom of the heap.
+  When the heap is full the collector marks everything reachable from the
+  roots and then slides the marked objects down over the dead ones, in
+  the order they were allocated (LISP2). The slide takes three more
+  passes over the heap:
+
+    1. Compute forwarding addresses: walking the heap from the bottom, each
+       live object is given the address of the next free byte below it,
+       kept in its "forward" field.
+    2. Update references: every root and every reference slot of every
+       live object is redirected to the forwarding address of what it
+       points to.
+    3. Relocate: walking the heap from the bottom again, each live object
+       is moved to its forwarding address and each dead one is destroyed.
+
+  An object only ever moves down, so it never lands on a live object that
+  has not been moved yet. It may land on part of its own old bytes, in
+  which case it goes through a scratch buffer. Afterwards all the live
+  objects sit at the bottom of the heap, and "top" is the end of the last
+  one.
+
+  Objects come in the same types as in the stop-copy heap. Every pass
+  looks the type up once per object and runs that type's own code.
+ */
+
+#include <new>
+#include <algorithm>
+#include <chrono>
+
+#include "mc-graph-api.h"
+
+// Heap size in bytes
+#ifndef MCHEAPSIZE
+#define MCHEAPSIZE 2800
+#endif
+
+namespace mc_graph_api {
+
+// Microseconds elapsed since "start".
+static double Micros(chrono::steady_clock::time_point start) {
+	return chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+}
+
+// Bytes an object of "size" bytes takes: at least the header, and a whole
+// number of pointers.
+static size_t ObjectBytes(size_t size) {
+	if (size < sizeof(Object)) size = sizeof(Object);
+	return (size + sizeof(Object*) - 1) / sizeof(Object*) * sizeof(Object*);
+}
+
+// default constructor
+// initializes the heap size
+MCGraphUtil :: MCGraphUtil() {
+	max_bytes = MCHEAPSIZE;
+	heap = new char[max_bytes];
+	top = heap;
+	live_objects = 0;
+	live_bytes = 0;
+	moved_bytes = 0;
+	for (int i = 0; i < 4; i++) phase_us[i] = 0;
+}
+
+// Lets the user specify heap-size, in bytes
+MCGraphUtil :: MCGraphUtil(size_t heap_bytes) {
+	max_bytes = heap_bytes / sizeof(Object*) * sizeof(Object*);
+	heap = new char[max_bytes];
+	top = heap;
+	live_objects = 0;
+	live_bytes = 0;
+	moved_bytes = 0;
+	for (int i = 0; i < 4; i++) phase_us[i] = 0;
+}
+
+// Destroys whatever is still allocated and releases the heap.
+MCGraphUtil :: ~MCGraphUtil() {
+	for (int i = 0; i < int(safepoints.mutators.size()); i++) {
+		delete safepoints.mutators[i];
+	}
+	char* p = heap;
+	while (p < top) {
+		Object* obj = (Object*)p;
+		p += Types::Size(obj);
+		Types::Destroy(obj);
+	}
+	delete[] heap;
+}
+
+// Bump-pointer allocation. Returns NULL when the heap is full.
+Object* MCGraphUtil :: Allocate(const string& desc) {
+	return Allocate(desc, sizeof(Object));
+}
+
+// The same for a plain object of "size" bytes, rounded up to whole
+// pointers so the object after it stays aligned.
+Object* MCGraphUtil :: Allocate(const string& desc, size_t size) {
+	size = ObjectBytes(size);
+	if (top + size > heap + max_bytes) return NULL;
+
+	Object* obj = new (top) Object(desc);
+	obj->size = int(size);
+	top += size;
+	return obj;
+}
+
+// Allocate() as the mutator threads do it: a safepoint poll, then the
+// pointer bump under the allocation lock.
+Object* MCGraphUtil :: LockedAllocate(const string& desc, size_t size) {
+	safepoints.Poll();
+	size = ObjectBytes(size);
+	char* p = BumpBytes(size);
+	if (p == NULL) return NULL;
+
+	Object* obj = new (p) Object(desc);
+	obj->size = int(size);
+	return obj;
+}
+
+// Room for a typed object of "size" bytes, collecting first if the heap
+// is too full. Returns NULL when even a collection does not help.
+char* MCGraphUtil :: AllocateBytes(size_t size) {
+	safepoints.Poll();
+	char* p = BumpBytes(size);
+	if (p == NULL) {
+		TriggerGC(gc_events::HEAP_FULL);
+		p = BumpBytes(size);
+	}
+	if (p == NULL) {
+		cout << "Error! Unable to allocate memory!\n";
+	}
+	return p;
+}
+
+// Moves the bump pointer over "size" bytes under the allocation lock. NULL
+// when the heap is too full.
+char* MCGraphUtil :: BumpBytes(size_t size) {
+	lock_guard<mutex> guard(alloc_lock);
+	if (top + size > heap + max_bytes) return NULL;
+
+	char* p = top;
+	top += size;
+	return p;
+}
+
+// Allocates an array of "length" references, all NULL.
+RefArray* MCGraphUtil :: NewArray(const string& desc, int length) {
+	size_t size = sizeof(RefArray) + length * sizeof(Object*);
+	char* p = AllocateBytes(size);
+	if (p == NULL) return NULL;
+
+	RefArray* array = new (p) RefArray(desc, length);
+	array->size = int(size);
+	array->type = Types::Id<RefArray>();
+	return array;
+}
+
+// Stops every mutator thread at a safepoint and collects. If another
+// thread was collecting already, its collection stands in for this one.
+void MCGraphUtil :: TriggerGC() {
+	TriggerGC(gc_events::EXPLICIT);
+}
+
+// TriggerGC() for "cause", one of the causes in gc-events.h, which the
+// event log records with the collection.
+void MCGraphUtil :: TriggerGC(int cause) {
+	if (!safepoints.StopTheWorld()) return;
+	events.Begin(cause, gc_events::FULL_HEAP);
+	if (events.On()) events.Before(NumObjects(), size_t(top - heap));
+	Collect();
+	events.After(live_objects, live_bytes);
+	events.End();
+	safepoints.ResumeTheWorld();
+}
+
+// Number of objects in the heap, live or not.
+long MCGraphUtil :: NumObjects() {
+	long n = 0;
+	for (char* p = heap; p < top; p += Types::Size((Object*)p)) {
+		n++;
+	}
+	return n;
+}
+
+// The addresses of every root reference: the collector's roots, and each
+// mutator's roots and held parent.
+void MCGraphUtil :: RootSlots(vector <Object**>& slots) {
+	for (int i = 0; i < roots.size(); i++) {
+		slots.push_back(&roots[i]);
+	}
+	for (int m = 0; m < int(safepoints.mutators.size()); m++) {
+		Mutator* mutator = safepoints.mutators[m];
+		for (int i = 0; i < mutator->roots.size(); i++) {
+			slots.push_back(&mutator->roots[i]);
+		}
+		slots.push_back(&mutator->held);
+	}
+}
+
+// Marks everything reachable from the roots, then slides the live objects
+// down to the bottom of the heap.
+void MCGraphUtil :: Collect() {
+	vector <Object**> slots;
+	RootSlots(slots);
+	events.Phase(gc_events::ROOTS);
+
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	Mark(slots);
+	phase_us[0] = Micros(start);
+	events.Phase(gc_events::MARK);
+
+	start = chrono::steady_clock::now();
+	ComputeForwarding();
+	phase_us[1] = Micros(start);
+
+	start = chrono::steady_clock::now();
+	UpdateReferences(slots);
+	phase_us[2] = Micros(start);
+
+	start = chrono::steady_clock::now();
+	Relocate();
+	phase_us[3] = Micros(start);
+	events.Phase(gc_events::COMPACT);
+}
+
+// Pushes the unmarked objects that one reference slot points to, marking
+// them as they go on the stack so none is pushed twice.
+struct MarkVisitor {
+	vector <Object*>& stack;
+
+	MarkVisitor(vector <Object*>& mark_stack) : stack(mark_stack) {}
+
+	void operator()(Object*& slot) {
+		if (slot != NULL && !slot->marked) {
+			slot->marked = true;
+			stack.push_back(slot);
+		}
+	}
+};
+
+// Depth first mark from the roots, with an explicit stack so that long
+// chains cannot overflow the native stack.
+void MCGraphUtil :: Mark(vector <Object**>& slots) {
+	vector <Object*> stack;
+	MarkVisitor visitor(stack);
+	for (int i = 0; i < int(slots.size()); i++) {
+		visitor(*slots[i]);
+	}
+	while (!stack.empty()) {
+		Object* obj = stack.back();
+		stack.pop_back();
+		Types::Trace(obj, visitor);
+	}
+}
+
+// First pass of the slide: gives every marked object the address it will
+// move to. Dead objects are skipped over, so the live ones keep their
+// order and end up back to back.
+void MCGraphUtil :: ComputeForwarding() {
+	char* free = heap;
+	live_objects = 0;
+	moved_bytes = 0;
+	char* p = heap;
+	while (p < top) {
+		Object* obj = (Object*)p;
+		size_t size = Types::Size(obj);
+		if (obj->marked) {
+			obj->forward = (Object*)free;
+			if (free != p) moved_bytes += size;
+			free += size;
+			live_objects++;
+		}
+		p += size;
+	}
+	live_bytes = long(free - heap);
+}
+
+// Redirects one reference slot to the forwarding address of its target.
+struct ForwardVisitor {
+	void operator()(Object*& slot) {
+		if (slot != NULL) slot = slot->forward;
+	}
+};
+
+// Second pass: every root and every reference held by a live object is
+// pointed at the new address of its target. The objects have not moved
+// yet, so the forwarding addresses can still be read in place.
+void MCGraphUtil :: UpdateReferences(vector <Object**>& slots) {
+	ForwardVisitor visitor;
+	for (int i = 0; i < int(slots.size()); i++) {
+		visitor(*slots[i]);
+	}
+	char* p = heap;
+	while (p < top) {
+		Object* obj = (Object*)p;
+		if (obj->marked) Types::Trace(obj, visitor);
+		p += Types::Size(obj);
+	}
+}
+
+// Last pass: moves every live object down to its forwarding address and
+// destroys the dead ones. An object that overlaps its new place is copied
+// out to the scratch buffer first.
+void MCGraphUtil :: Relocate() {
+	char* p = heap;
+	while (p < top) {
+		Object* obj = (Object*)p;
+		size_t size = Types::Size(obj);
+		p += size;
+		if (!obj->marked) {
+			Types::Destroy(obj);
+			continue;
+		}
+
+		Object* to = obj->forward;
+		if (to != obj) {
+			if ((char*)obj - (char*)to < (ptrdiff_t)size) {
+				if (scratch.size() < size) scratch.resize(size);
+				Object* tmp = Types::CopyTo(obj, scratch.data());
+				Types::Destroy(obj);
+				Types::CopyTo(tmp, to);
+				Types::Destroy(tmp);
+			} else {
+				Types::CopyTo(obj, to);
+				Types::Destroy(obj);
+			}
+		}
+		to->marked = false;
+		to->forward = NULL;
+	}
+	top = heap + live_bytes;
+}
+
+
+// Displays the memory used and free, in bytes. Objects are laid out back
+// to back at their exact size and the free memory is always one block at
+// the top of the heap, so there is no fragmentation of either kind.
+void MCGraphUtil :: ShowMemoryUsage() {
+	long used = long(top - heap);
+	long free = long(max_bytes) - used;
+	cout << "Used Memory: " << used << " bytes" << endl;
+	cout << "Free Memory: " << free << " bytes" << endl;
+	cout << "Internal fragmentation: 0%" << endl;
+	cout << "External fragmentation: 0%" << endl << "------------------\n";
+}
+
+
+// Reports, for the last collection, what survived, how much of it had to
+// move, and the time spent in each phase.
+void MCGraphUtil :: ShowCompactStats() {
+	cout << "Live: " << live_objects << " objects, " << live_bytes << " bytes" << endl;
+	cout << "Moved: " << moved_bytes << " bytes" << endl;
+	cout << "Mark: " << phase_us[0] << " us, forwarding: " << phase_us[1]
+	     << " us, update: " << phase_us[2] << " us, relocate: " << phase_us[3] << " us"
+	     << endl << "------------------\n";
+}
+
+
+// Creates a new reference object. Object* obj = new Object();. Essentially,
+// creates an object in the heap and a reference in the root table, and
+// returns the root's handle (an invalid one if the heap is full).
+gc_roots::RootHandle MCGraphUtil :: NewReference(const string& desc) {
+	return NewReference(desc, sizeof(Object));
+}
+
+// The same for an object of "size" bytes.
+gc_roots::RootHandle MCGraphUtil :: NewReference(const string& desc, size_t size) {
+	Object* obj = LockedAllocate(desc, size);
+
+	// if the heap is full, then we call TriggerGC() to free up some space.
+	if (obj == NULL) {
+		TriggerGC(gc_events::HEAP_FULL);
+		obj = LockedAllocate(desc, size);
+	}
+
+	if (obj != NULL) {
+		return roots.Add(obj);
+	}
+	cout << "Error! Unable to allocate memory!\n";
+	gc_roots::RootHandle none = { -1, 0 };
+	return none;
+}
+
+// Creating a new reference and making it point to an existing object
+// Object *obj = x;
+gc_roots::RootHandle MCGraphUtil :: NewReference(Object* obj) {
+	return roots.Add(obj);
+}
+
+// New object that would be pointed to by an existing pointer.
+// This includes objects that are reffered to by other objects,
+// a self-referencing object, like a binary tree structure or a
+// linked-list.
+Object* MCGraphUtil :: New(const string& desc, Object* parent) {
+	return New(desc, parent, sizeof(Object));
+}
+
+// The same for an object of "size" bytes.
+Object* MCGraphUtil :: New(const string& desc, Object* parent, size_t size) {
+	// The parent is held as a temporary root across the collection, so it
+	// survives and we pick up its new address.
+	Object* obj = LockedAllocate(desc, size);
+	if (obj == NULL) {
+		gc_roots::RootHandle held = roots.Add(parent);
+		TriggerGC(gc_events::HEAP_FULL);
+		parent = roots.Get(held);
+		roots.Remove(held);
+		obj = LockedAllocate(desc, size);
+	}
+
+	if (obj != NULL) {
+		parent->child = obj;
+	} else {
+		cout << "Error! Unable to allocate memory!\n";
+	}
+
+	return obj;
+}
+
+// Getting rid of the root reference. This is typically when a pointer
+// falls out of scope causing a memory leak.
+void MCGraphUtil :: EndLifetime(gc_roots::RootHandle reference) {
+	roots.Remove(reference);
+}
+
+// New() for a mutator thread. The parent is kept in the mutator's "held"
+// slot from before the safepoint poll until the object is linked in, since
+// any collection in between may move it.
+Object* MCGraphUtil :: New(const string& desc, Object* parent, Mutator* mutator) {
+	mutator->held = parent;
+	Object* obj = LockedAllocate(desc, sizeof(Object));
+	if (obj == NULL) {
+		TriggerGC(gc_events::HEAP_FULL);
+		obj = LockedAllocate(desc, sizeof(Object));
+	}
+	parent = mutator->held;
+	mutator->held = NULL;
+
+	if (obj != NULL) {
+		parent->child = obj;
+	} else {
+		cout << "Error! Unable to allocate memory!\n";
+	}
+	return obj;
+}
+
+// NewReference() for a mutator thread: the new root is the mutator's.
+gc_roots::RootHandle MCGraphUtil :: NewReference(const string& desc, Mutator* mutator) {
+	Object* obj = LockedAllocate(desc, sizeof(Object));
+	if (obj == NULL) {
+		TriggerGC(gc_events::HEAP_FULL);
+		obj = LockedAllocate(desc, sizeof(Object));
+	}
+	if (obj != NULL) {
+		return mutator->roots.Add(obj);
+	}
+	cout << "Error! Unable to allocate memory!\n";
+	gc_roots::RootHandle none = { -1, 0 };
+	return none;
+}
+
+// Attaches the calling thread as a mutator, with an empty root set.
+Mutator* MCGraphUtil :: AttachMutator() {
+	Mutator* mutator = new Mutator();
+	safepoints.Attach(mutator);
+	return mutator;
+}
+
+// Detaches a mutator thread; its roots end with it.
+void MCGraphUtil :: DetachMutator(Mutator* mutator) {
+	safepoints.Detach(mutator);
+	delete mutator;
+}
+
+// Safepoint poll for a mutator thread that goes a long way without
+// allocating.
+void MCGraphUtil :: Safepoint() {
+	safepoints.Poll();
+}
+
+} // mc_graph_api
@@ -0,0 +1,253 @@
+/*
+ * mc-graph-api.h
+ *
+ *  Sliding mark-compact collector. The same interface as the other
+ *  collectors, over a single heap that is compacted in place.
+ */
+
+#ifndef MCGRAPHAPI_H_
+#define MCGRAPHAPI_H_
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <new>
+#include <cstring>
+#include <mutex>
+#include "root-table.h"
+#include "gc-types.h"
+#include "safepoint.h"
+#include "gc-events.h"
+
+using namespace std;
+
+namespace mc_graph_api {
+
+// The header of every object in the heap. Plain Objects are type 0; the
+// other types below derive from it, as in the stop-copy heap (see
+// gc-types.h). "forward" is only meaningful during a collection, where it
+// holds the address the object is about to slide down to.
+class Object {
+public:
+
+  int type;         // index in Types
+  int size;         // bytes taken, header included, in whole pointers
+  bool marked;
+  Object* forward;
+  Object* child;
+  string desc;
+
+  Object() {
+      type = 0;
+      size = sizeof(Object);
+      marked = false;
+      forward = NULL;
+      child = NULL;
+      desc = "";
+  }
+
+  Object (const string& description) {
+      type = 0;
+      size = sizeof(Object);
+      marked = false;
+      forward = NULL;
+      child = NULL;
+      desc = description;
+  }
+
+  char* Payload() { return (char*)(this + 1); }
+
+  size_t Size() const { return size; }
+
+  Object* CopyTo(void* to) {
+      Object* copy = new (to) Object(*this);
+      memcpy(copy->Payload(), Payload(), size - sizeof(Object));
+      return copy;
+  }
+
+  template <class V>
+  void EachRef(V& v) {
+      v(child);
+  }
+
+};
+
+// An object with REFS reference fields on top of child, and BYTES bytes of
+// raw payload the collector never looks at.
+template <int REFS, int BYTES>
+class Record : public Object {
+public:
+
+  Object* refs[REFS];
+  char payload[BYTES];
+
+  Record (const string& description) : Object(description) {
+      for (int i = 0; i < REFS; i++) refs[i] = NULL;
+      memset(payload, 0, BYTES);
+  }
+
+  Object* CopyTo(void* to) { return new (to) Record(*this); }
+
+  template <class V>
+  void EachRef(V& v) {
+      v(child);
+      for (int i = 0; i < REFS; i++) v(refs[i]);
+  }
+
+};
+
+// Binary tree node: refs[0] and refs[1] are the subtrees, the payload a key.
+typedef Record<2, 8> TreeNode;
+// Hash map entry: child is the next entry in the bucket, refs[0] the value,
+// the payload the key.
+typedef Record<1, 16> MapEntry;
+
+// An array of "length" references stored right after the header.
+class RefArray : public Object {
+public:
+
+  int length;
+
+  RefArray (const string& description, int n) : Object(description) {
+      length = n;
+      for (int i = 0; i < n; i++) Elems()[i] = NULL;
+  }
+
+  Object** Elems() { return (Object**)(this + 1); }
+
+  Object* CopyTo(void* to) {
+      RefArray* copy = new (to) RefArray(*this);
+      memcpy(copy->Elems(), Elems(), length * sizeof(Object*));
+      return copy;
+  }
+
+  template <class V>
+  void EachRef(V& v) {
+      v(child);
+      Object** elems = Elems();
+      for (int i = 0; i < length; i++) v(elems[i]);
+  }
+
+};
+
+// Every type the heap can hold. A new type is added here.
+typedef gc_types::TypeList<Object, Object, TreeNode, MapEntry, RefArray> Types;
+
+// A mutator thread attached to the collector, with roots of its own, and
+// "held", the parent that New() keeps across a collection for it.
+class Mutator {
+  public:
+    gc_roots::RootTable <Object> roots;
+    Object* held;
+    Mutator() {
+    	held = NULL;
+    }
+};
+
+class MCGraphUtil {
+  public:
+
+    // constructors
+    MCGraphUtil();
+    MCGraphUtil(size_t heap_bytes);
+    ~MCGraphUtil();
+
+    // max_bytes is the heap size. There is no copy reserve: the whole
+    // heap is usable, and objects are bump-allocated in it at "top".
+    size_t max_bytes;
+    char* heap;
+    char* top;
+
+    // List of all the roots. A collection moves objects, so these are the
+    // only references the collector updates; other pointers held by the
+    // caller go stale across a TriggerGC().
+    gc_roots::RootTable <Object> roots;
+
+    // Mutator threads, as in the stop-copy collector: the bump pointer
+    // moves under alloc_lock and TriggerGC() stops every mutator at a
+    // safepoint. Any pointer a mutator holds outside its roots goes stale
+    // across a safepoint.
+    gc_safepoint::Safepoints <Mutator> safepoints;
+    mutex alloc_lock;
+
+    // What the last collection did: the objects and bytes that survived,
+    // the bytes that actually had to move, and the time each of the four
+    // phases took, in microseconds.
+    long live_objects;
+    long live_bytes;
+    long moved_bytes;
+    double phase_us[4];
+
+    // Every collection is logged here once the log is enabled (see
+    // gc-events.h), its last three phases together as the compaction.
+    // Counting the objects before it takes a walk of the heap, which is
+    // only done with the log on.
+    gc_events::EventLog events;
+
+    // Utility functions
+    Object* Allocate(const string& desc);
+    Object* Allocate(const string& desc, size_t size);
+    Object* LockedAllocate(const string& desc, size_t size);
+    char* AllocateBytes(size_t size);
+    char* BumpBytes(size_t size);
+    void TriggerGC();
+    void TriggerGC(int cause);
+    long NumObjects();
+    void Collect();
+    void RootSlots(vector <Object**>& slots);
+    void Mark(vector <Object**>& slots);
+    void ComputeForwarding();
+    void UpdateReferences(vector <Object**>& slots);
+    void Relocate();
+    void ShowMemoryUsage();
+    void ShowCompactStats();
+
+    // Functions dealing with memory allocation and references falling
+    // out of scope. "size" is the size of the object in bytes, header
+    // included, rounded up to whole pointers; without it an object is just
+    // the header.
+    Object* New(const string& desc, Object* parent);
+    Object* New(const string& desc, Object* parent, size_t size);
+    gc_roots::RootHandle NewReference(const string& desc);
+    gc_roots::RootHandle NewReference(const string& desc, size_t size);
+    gc_roots::RootHandle NewReference(Object* obj);
+    void EndLifetime(gc_roots::RootHandle reference);
+
+    // The same for mutator threads, which attach and detach themselves.
+    // Safepoint() is the explicit safepoint poll.
+    Object* New(const string& desc, Object* parent, Mutator* mutator);
+    gc_roots::RootHandle NewReference(const string& desc, Mutator* mutator);
+    Mutator* AttachMutator();
+    void DetachMutator(Mutator* mutator);
+    void Safepoint();
+
+    // Typed objects. These collect first if the object does not fit and
+    // return NULL if it still does not. Only roots survive a collection
+    // with their addresses up to date.
+    template <class T>
+    T* NewObject(const string& desc);
+    RefArray* NewArray(const string& desc, int length);
+
+  private:
+    // Scratch space for sliding an object onto its own old bytes.
+    vector <char> scratch;
+
+    // the heap is owned by the collector, so it cannot be copied
+    MCGraphUtil(const MCGraphUtil&);
+    MCGraphUtil& operator=(const MCGraphUtil&);
+};
+
+template <class T>
+T* MCGraphUtil :: NewObject(const string& desc) {
+	char* p = AllocateBytes(sizeof(T));
+	if (p == NULL) return NULL;
+
+	T* obj = new (p) T(desc);
+	obj->size = int(sizeof(T));
+	obj->type = Types::Id<T>();
+	return obj;
+}
+
+} // mc_graph_api
+
+#endif /* MCGRAPHAPI_H_ */
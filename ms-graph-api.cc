@@ -26,137 +26,957 @@
   time-critical applications impossible. In addition, the entire working
   memory must be examined, much of it twice, potentially causing problems
   in paged memory systems.
+
+  The freeze can be shortened with concurrent marking. The initial mark
+  only records the roots; a background thread then traces while the
+  program carries on. To keep the program from hiding an object from the
+  marker, every pointer store made while marking logs the value it
+  overwrites (a snapshot-at-the-beginning, or SATB, barrier), and objects
+  allocated during marking are born marked. Everything reachable when
+  marking began is then guaranteed to be marked, and the final mark only
+  has to trace from the logged values.
+
+  Without a second thread the work can instead be spread over the
+  allocations themselves (incremental marking). Objects are white
+  (unmarked), grey (marked, children not yet looked at) or black (marked
+  and scanned). Every allocation scans a bounded number of grey objects,
+  and once marking is over sweeps a bounded number of blocks. A pointer
+  store made while marking shades the stored object grey (Dijkstra's
+  insertion barrier), so a black object can never point to a white one.
+
+  Objects differ in size, and the heap is counted in bytes. It is split
+  into pages of 256 granules, each page holding objects of one size class
+  (segregated fits), so a free slot of the right size is always at the
+  head of its class's free list. Objects over half a page get whole pages
+  of their own. Rounding a request up to its class is internal
+  fragmentation; free memory stuck in pages of other classes, or in the
+  ends of pages, is external fragmentation.
+
+  Several mutator threads can share the heap. Each attaches itself, keeps
+  its own roots, and takes the allocation lock for every allocation. A
+  collection first brings all of them to a safepoint (see safepoint.h),
+  and marks from every thread's roots.
+
+  The heap need not have a fixed size. It is reserved at its largest and
+  grown or shrunk a page at a time within that, following the policy in
+  heap-sizing.h. Objects do not move, so shrinking stops allocation past
+  the new end and gives the pages there back as they empty.
    
  */
 
 
+// Heap size in bytes
 #ifndef MSHEAPSIZE
-#define MSHEAPSIZE 100
+#define MSHEAPSIZE 8192
+#endif
+
+#ifndef MARKSTACKSIZE
+#define MARKSTACKSIZE 4096
+#endif
+
+#ifndef LAZYSWEEP
+#define LAZYSWEEP false
+#endif
+
+#ifndef GCTHREADS
+#define GCTHREADS 1
+#endif
+
+// Heap occupancy, in percent, that starts a concurrent mark
+#ifndef CMOCCUPANCY
+#define CMOCCUPANCY 60
+#endif
+
+// Entries in the mutator's SATB buffer before it is handed to the marker
+#ifndef SATBBUFFERSIZE
+#define SATBBUFFERSIZE 256
 #endif
 
+// Units of work per incremental step, and the same budget in microseconds
+// (0 to budget by work only)
+#ifndef INCBUDGET
+#define INCBUDGET 64
+#endif
+
+#ifndef INCBUDGETUS
+#define INCBUDGETUS 0
+#endif
+
+#include <new>
+
 #include "ms-graph-api.h"
 
 
 namespace ms_graph_api {
 
+// Bytes per bitmap bit, and per page (one sweep block of bits)
+const size_t GRANULE = 8;
+const size_t PAGEBYTES = GRANULE * 64 * gc_bitmap::BLOCKWORDS;
+
+// Slot sizes of the size classes, picked to leave little over at the end
+// of a page. Anything bigger is a large object.
+const int CLASSBYTES[] = { 56, 64, 72, 80, 96, 112, 128, 144, 168, 200, 256,
+                           288, 336, 408, 512, 680, 1024 };
+const int NUMCLASSES = sizeof(CLASSBYTES) / sizeof(CLASSBYTES[0]);
+
+// page_class of a free page, and of the pages of a large object
+const int FREEPAGE = -1;
+const int LARGEPAGE = -2;
+const int LARGETAIL = -3;
+
+// Size class for an object of "size" bytes, -1 for a large object.
+static int SizeClass(size_t size) {
+	for (int c = 0; c < NUMCLASSES; c++) {
+		if (size <= size_t(CLASSBYTES[c])) return c;
+	}
+	return -1;
+}
+
 // default constructor
-// initalizes the heap traversal pointers and the number of objects
-// and heap-size
+// initalizes the number of objects, heap-size and the heap
 MSGraphUtil :: MSGraphUtil() {
-	first = NULL;
-	last = NULL;
 	num_objects = 0;
-	max_objects = MSHEAPSIZE;
+	sizing.Bounds(MSHEAPSIZE, MSHEAPSIZE);
+	InitHeap();
 }
 
-// Allows the user to specify heap-size.
-MSGraphUtil :: MSGraphUtil(int heap_size) {
-	first = NULL;
-	last = NULL;
+// Allows the user to specify heap-size, in bytes.
+MSGraphUtil :: MSGraphUtil(size_t heap_bytes) {
 	num_objects = 0;
-	max_objects = heap_size;
+	sizing.Bounds(heap_bytes, heap_bytes);
+	InitHeap();
+}
+
+// A heap that starts at "min_bytes" and may grow to "max_bytes".
+MSGraphUtil :: MSGraphUtil(size_t min_bytes, size_t max_bytes) {
+	num_objects = 0;
+	sizing.Bounds(min_bytes, max_bytes);
+	InitHeap();
+}
+
+// Destroys the objects still on the heap and releases it. A concurrent
+// marker still running is waited for first.
+MSGraphUtil :: ~MSGraphUtil() {
+	if (marker_thread.joinable()) marker_thread.join();
+	for (int i = 0; i < int(safepoints.mutators.size()); i++) {
+		delete safepoints.mutators[i];
+	}
+	for (int w = 0; w < int(alloc_bits.size()); w++) {
+		for (uint64_t bits = alloc_bits[w]; bits != 0; bits &= bits - 1) {
+			Types::Destroy(ObjectAt(w * 64 + __builtin_ctzll(bits)));
+		}
+	}
+	delete[] heap;
+}
+
+// Reserves the heap at its largest, with both bounds rounded up to whole
+// pages, and starts it at the smallest with every page free. Pages are cut
+// into slots as size classes need them.
+void MSGraphUtil :: InitHeap() {
+	size_t min_pages = (sizing.min_bytes + PAGEBYTES - 1) / PAGEBYTES;
+	size_t max_pages = (sizing.max_bytes + PAGEBYTES - 1) / PAGEBYTES;
+	sizing.Bounds(min_pages * PAGEBYTES, max_pages * PAGEBYTES);
+	num_pages = int(min_pages);
+	max_bytes = num_pages * PAGEBYTES;
+	used_bytes = 0;
+	requested_bytes = 0;
+	mark_stack.reserve(MARKSTACKSIZE);
+	mark_overflow = false;
+	alloc_bits.assign(num_pages * gc_bitmap::BLOCKWORDS, 0);
+	mark_bits.assign(num_pages * gc_bitmap::BLOCKWORDS, 0);
+	lazy_sweep = LAZYSWEEP;
+	gc_threads = GCTHREADS;
+	mark_mode = STW_MARK;
+	cm_occupancy = CMOCCUPANCY;
+	marking = false;
+	cm_done = false;
+	inc_budget = INCBUDGET;
+	inc_budget_us = INCBUDGETUS;
+	max_pause_us = 0;
+	full_collections = 0;
+	root_cursor = 0;
+	sweep_cursor = int(alloc_bits.size());
+	heap = new char[sizing.max_bytes];
+	page_limit = num_pages;
+	page_class.assign(num_pages, FREEPAGE);
+	listed.assign(num_pages, 1);
+	free_lists.assign(NUMCLASSES, (Object*)NULL);
+	free_page_hint = 0;
+}
+
+// Sets the heap size to "bytes", rounded up to whole pages. Pages added
+// at the end are free. Objects do not move, so a smaller heap only stops
+// allocating past its new end, page_limit, at once: the slots there come
+// off the free lists, the sweep no longer lists them, and the pages are
+// given back by TrimHeap() as they empty. Not to be called while the
+// marker thread runs, as it resizes the bitmaps.
+void MSGraphUtil :: ResizeHeap(size_t bytes) {
+	int pages = int((bytes + PAGEBYTES - 1) / PAGEBYTES);
+	if (pages >= num_pages) {
+		page_limit = pages;
+		if (pages > num_pages) {
+			sizing.Resized(max_bytes, pages * PAGEBYTES);
+			SetPages(pages);
+		}
+		return;
+	}
+
+	page_limit = pages;
+	for (int c = 0; c < NUMCLASSES; c++) {
+		Object** link = &free_lists[c];
+		while (*link != NULL) {
+			if ((char*)*link - heap >= ptrdiff_t(page_limit * PAGEBYTES)) {
+				*link = (*link)->next;
+			} else {
+				link = &(*link)->next;
+			}
+		}
+	}
+	for (int p = page_limit; p < num_pages; p++) {
+		listed[p] = 0;
+	}
+	TrimHeap();
+}
+
+// Gives back the free pages at the end of the heap past page_limit.
+void MSGraphUtil :: TrimHeap() {
+	int pages = num_pages;
+	while (pages > page_limit && page_class[pages - 1] == FREEPAGE) pages--;
+	if (pages == num_pages) return;
+
+	sizing.Resized(max_bytes, pages * PAGEBYTES);
+	SetPages(pages);
+}
+
+// Makes the heap "pages" pages long, resizing everything kept per page. A
+// sweep that was already over stays over; one that is pending carries on
+// over the pages that are left.
+void MSGraphUtil :: SetPages(int pages) {
+	bool swept = (sweep_cursor == int(alloc_bits.size()));
+	num_pages = pages;
+	max_bytes = num_pages * PAGEBYTES;
+	alloc_bits.resize(num_pages * gc_bitmap::BLOCKWORDS, 0);
+	mark_bits.resize(num_pages * gc_bitmap::BLOCKWORDS, 0);
+	page_class.resize(num_pages, FREEPAGE);
+	listed.resize(num_pages, 1);
+	if (swept || sweep_cursor > int(alloc_bits.size())) sweep_cursor = int(alloc_bits.size());
+	if (free_page_hint > num_pages) free_page_hint = num_pages;
+}
+
+// Applies the sizing policy once a collection is over. What survived is
+// used_bytes once the heap is swept; with the sweep left to the
+// allocation path, it is read off the mark bitmap instead.
+void MSGraphUtil :: SizeHeap() {
+	if (marking) return;
+	size_t bytes = max_bytes;
+	if (sweep_cursor == int(alloc_bits.size())) {
+		bytes = sizing.AfterCollection(max_bytes, used_bytes);
+	} else if (sweep_cursor == 0) {
+		bytes = sizing.AfterCollection(max_bytes, MarkedBytes());
+	}
+	if (bytes != max_bytes) {
+		ResizeHeap(bytes);
+	} else {
+		TrimHeap();
+	}
+}
+
+// Bytes taken by the objects the last mark found live, counted a page at
+// a time from the mark bitmap, before the sweep has cleared any of it.
+size_t MSGraphUtil :: MarkedBytes() {
+	size_t bytes = 0;
+	for (int p = 0; p < num_pages; p++) {
+		int w = p * gc_bitmap::BLOCKWORDS;
+		if (page_class[p] >= 0) {
+			int marked = 0;
+			for (int i = w; i < w + gc_bitmap::BLOCKWORDS; i++) {
+				marked += __builtin_popcountll(mark_bits[i]);
+			}
+			bytes += size_t(marked) * CLASSBYTES[page_class[p]];
+		} else if (page_class[p] == LARGEPAGE && gc_bitmap::Test(mark_bits, w * 64)) {
+			bytes += (ObjectAt(w * 64)->size + PAGEBYTES - 1) / PAGEBYTES * PAGEBYTES;
+		}
+	}
+	return bytes;
+}
+
+// Allocates an object that is just the header.
+Object* MSGraphUtil :: Allocate(const string& desc) {
+	return Allocate(desc, sizeof(Object));
+}
+
+// Allocates an object of "size" bytes from its size class, or from whole
+// pages if it is large. Returns NULL when the heap has no room for it; the
+// callers decide whether to collect and retry.
+// In concurrent mode this is also where cycles are paced: a finished
+// concurrent mark gets its final mark here, and a fully swept heap above
+// the occupancy threshold (in bytes) starts the next one. In incremental
+// mode every allocation pays for one step of the current cycle.
+Object* MSGraphUtil :: Allocate(const string& desc, size_t size) {
+	if (mark_mode == CONCURRENT_MARK) {
+		if (marking && cm_done.load(memory_order_acquire)) {
+			sizing.StartCollection();
+			events.Begin(gc_events::OCCUPANCY, gc_events::FULL_HEAP);
+			events.Before(num_objects, used_bytes);
+			FinishConcurrentMark();
+			events.After(num_objects, used_bytes);
+			events.End();
+		} else if (!marking && sweep_cursor == int(alloc_bits.size()) &&
+		           used_bytes * 100 >= max_bytes * cm_occupancy) {
+			StartConcurrentMark();
+		}
+	} else if (mark_mode == INCREMENTAL_MARK) {
+		IncrementalStep();
+	}
+
+	if (size < sizeof(Object)) size = sizeof(Object);
+	int size_class = SizeClass(size);
+	Object* obj = (size_class >= 0) ? AllocateSmall(size_class) : AllocateLarge(size);
+	if (obj == NULL) return NULL;
+
+	int slot = Slot(obj);
+	gc_bitmap::Set(alloc_bits, slot);
+	// An object allocated while marking, or into a part of the heap the
+	// lazy sweep has not reached yet, is allocated marked so the sweep does
+	// not take it for garbage. The marker thread may be setting bits in the
+	// same word, hence the atomic update.
+	if (marking || (slot >> 6) >= sweep_cursor) {
+		gc_bitmap::AtomicSet(mark_bits, slot);
+	}
+	new (obj) Object(desc);
+	obj->size = int(size);
+	num_objects++;
+	requested_bytes += size;
+	return obj;
+}
+
+// Pops a slot off the class's free list. When the list is empty and a lazy
+// sweep is pending, just enough pages are swept to refill it; failing
+// that, a free page is cut into slots of the class.
+Object* MSGraphUtil :: AllocateSmall(int size_class) {
+	while (free_lists[size_class] == NULL && sweep_cursor < int(alloc_bits.size())) {
+		SweepBlock(sweep_cursor);
+		sweep_cursor += gc_bitmap::BLOCKWORDS;
+	}
+	if (free_lists[size_class] == NULL && !CarvePage(size_class)) return NULL;
+
+	Object* obj = free_lists[size_class];
+	free_lists[size_class] = obj->next;
+	used_bytes += CLASSBYTES[size_class];
+	return obj;
+}
+
+// Takes a run of free pages for a large object. The object's bits are
+// those of its first page; the other pages are marked as its tail. If no
+// run is long enough, any pending sweep is finished and the search is
+// tried once more.
+Object* MSGraphUtil :: AllocateLarge(size_t size) {
+	int pages = int((size + PAGEBYTES - 1) / PAGEBYTES);
+	int first = FindPages(pages);
+	if (first < 0 && sweep_cursor < int(alloc_bits.size())) {
+		Sweep();
+		first = FindPages(pages);
+	}
+	if (first < 0) return NULL;
+
+	page_class[first] = LARGEPAGE;
+	for (int p = first + 1; p < first + pages; p++) {
+		page_class[p] = LARGETAIL;
+	}
+	used_bytes += pages * PAGEBYTES;
+	return (Object*)(heap + first * PAGEBYTES);
+}
+
+// Cuts a free page into slots of a size class and threads them onto the
+// class's free list in address order. False when no page is free.
+bool MSGraphUtil :: CarvePage(int size_class) {
+	int page = FindPages(1);
+	if (page < 0) return false;
+
+	page_class[page] = size_class;
+	listed[page] = 1;
+	int slots = int(PAGEBYTES / CLASSBYTES[size_class]);
+	for (int i = slots - 1; i >= 0; i--) {
+		Object* obj = (Object*)(heap + page * PAGEBYTES + i * CLASSBYTES[size_class]);
+		obj->next = free_lists[size_class];
+		free_lists[size_class] = obj;
+	}
+	return true;
+}
+
+// First run of "pages" free pages below page_limit, -1 if there is none.
+// free_page_hint is
+// kept at or before the first free page, so full pages at the start of the
+// heap are not looked at again and again.
+int MSGraphUtil :: FindPages(int pages) {
+	int first_free = -1, run = 0;
+	for (int p = free_page_hint; p < page_limit; p++) {
+		if (page_class[p] != FREEPAGE) {
+			run = 0;
+			continue;
+		}
+		if (first_free < 0) first_free = p;
+		if (++run == pages) {
+			int first = p - pages + 1;
+			free_page_hint = (first == first_free) ? p + 1 : first_free;
+			return first;
+		}
+	}
+	free_page_hint = (first_free < 0) ? page_limit : first_free;
+	return -1;
+}
+
+// Makes a run of pages free again.
+void MSGraphUtil :: ReleasePages(int first, int pages) {
+	for (int p = first; p < first + pages; p++) {
+		page_class[p] = FREEPAGE;
+	}
+	if (first < free_page_hint) free_page_hint = first;
+}
+
+// Accounts for a dead object and destroys it. Its slot is left for the
+// caller to reuse; a large object's pages are freed.
+void MSGraphUtil :: Release(Object* obj) {
+	int page = int(((char*)obj - heap) / PAGEBYTES);
+	requested_bytes -= obj->size;
+	num_objects--;
+	if (page_class[page] == LARGEPAGE) {
+		int pages = int((obj->size + PAGEBYTES - 1) / PAGEBYTES);
+		used_bytes -= pages * PAGEBYTES;
+		ReleasePages(page, pages);
+	} else {
+		used_bytes -= CLASSBYTES[page_class[page]];
+	}
+	Types::Destroy(obj);
 }
 
-// This is triggered when there is not enough space on the heap. In our
-// simulation, that is when num_objects equals max_objects.
+// Frees an object right away. Its slot goes back on its class's free list,
+// unless the page is still waiting to be swept, which will list it.
+void MSGraphUtil :: Free(Object* obj) {
+	int page = int(((char*)obj - heap) / PAGEBYTES);
+	int size_class = page_class[page];
+	gc_bitmap::Clear(alloc_bits, Slot(obj));
+	Release(obj);
+	if (size_class >= 0 && listed[page]) {
+		obj->next = free_lists[size_class];
+		free_lists[size_class] = obj;
+	}
+}
+
+// Index of the granule an object starts at, and of its bits in the
+// bitmaps.
+int MSGraphUtil :: Slot(Object* obj) {
+	return int(((char*)obj - heap) / GRANULE);
+}
+
+// The object starting at granule "slot".
+Object* MSGraphUtil :: ObjectAt(int slot) {
+	return (Object*)(heap + slot * GRANULE);
+}
+
+// Pushes what one reference slot of a marked object points to.
+struct MarkVisitor {
+	MSGraphUtil* gc;
+
+	MarkVisitor(MSGraphUtil* collector) : gc(collector) {}
+
+	void operator()(Object*& slot) {
+		gc->MarkPush(slot);
+	}
+};
+
+// The same, for a slot whose target an overflowing push may have dropped:
+// only a target that is still unmarked is pushed again.
+struct RescanVisitor {
+	MSGraphUtil* gc;
+
+	RescanVisitor(MSGraphUtil* collector) : gc(collector) {}
+
+	void operator()(Object*& slot) {
+		if (slot != NULL && !gc_bitmap::Test(gc->mark_bits, gc->Slot(slot))) {
+			gc->MarkPush(slot);
+		}
+	}
+};
+
+// Shades what one reference slot of a grey object points to.
+struct ShadeVisitor {
+	MSGraphUtil* gc;
+
+	ShadeVisitor(MSGraphUtil* collector) : gc(collector) {}
+
+	void operator()(Object*& slot) {
+		gc->Shade(slot);
+	}
+};
+
+// The marker thread's visitor. The mutator may be storing into the slot,
+// so it is read atomically, and the target is marked with an atomic
+// fetch-or before it is pushed.
+struct ConcurrentVisitor {
+	MSGraphUtil* gc;
+
+	ConcurrentVisitor(MSGraphUtil* collector) : gc(collector) {}
+
+	void operator()(Object*& slot) {
+		Object* child = __atomic_load_n(&slot, __ATOMIC_ACQUIRE);
+		if (child != NULL && gc_bitmap::AtomicSet(gc->mark_bits, gc->Slot(child))) {
+			__builtin_prefetch(child);
+			gc->cm_stack.push_back(child);
+		}
+	}
+};
+
+// This is triggered when there is not enough space on the heap, ie. when
+// an allocation found no room for its size. Every mutator thread is
+// stopped at a safepoint for the collection. If another thread was
+// collecting already, its collection stands in for this one.
 void MSGraphUtil :: TriggerGC() {
+	TriggerGC(gc_events::EXPLICIT);
+}
+
+// TriggerGC() for "cause", one of the causes in gc-events.h, which the
+// event log records with the collection.
+void MSGraphUtil :: TriggerGC(int cause) {
+	if (!safepoints.StopTheWorld()) return;
+	events.Begin(cause, gc_events::FULL_HEAP);
+	events.Before(num_objects, used_bytes);
+	Collect();
+	events.After(num_objects, used_bytes);
+	events.End();
+	safepoints.ResumeTheWorld();
+}
+
+// The collection proper, with the world stopped. A lazy sweep
+// still pending from the last cycle is finished first, so marking starts
+// from a clean mark bitmap. In lazy mode the sweep is then left to the
+// allocation path and the pause covers marking only. With more than one
+// GC thread the mark is done by the parallel work-stealing marker. In
+// concurrent mode a full collection is a concurrent cycle run to the end.
+// In incremental mode the heap filled up before the cycle could finish, so
+// the rest of the marking is done here in one go and sweeping is left to
+// the allocation path.
+void MSGraphUtil :: Collect() {
+	sizing.StartCollection();
+	if (mark_mode == CONCURRENT_MARK) {
+		if (!marking) StartConcurrentMark();
+		FinishConcurrentMark();
+		return;
+	}
+
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	if (mark_mode == INCREMENTAL_MARK) {
+		full_collections++;
+		if (marking) {
+			MarkVisitor visitor(this);
+			for (int i = 0; i < int(grey_stack.size()); i++) {
+				Types::Trace(grey_stack[i], visitor);
+			}
+			grey_stack.clear();
+			MarkRoots();
+			ProcessMarkStack();
+			events.Phase(gc_events::MARK);
+			marking = false;
+			StartSweep();
+			RecordPause(start);
+			return;
+		}
+	}
+
+	Sweep();
+	events.Phase(gc_events::SWEEP);
+
+	if (gc_threads > 1) {
+		gc_parallel::ParallelMarker<Object, Types> marker(heap, GRANULE, int(max_bytes / GRANULE),
+		                                                  mark_bits, gc_threads);
+		vector <Object*> refs(roots.Refs());
+		for (int m = 0; m < int(safepoints.mutators.size()); m++) {
+			const vector <Object*>& more = safepoints.mutators[m]->roots.Refs();
+			refs.insert(refs.end(), more.begin(), more.end());
+		}
+		marker.Mark(refs);
+		events.Phase(gc_events::MARK);
+	} else {
+		MarkRoots();
+		events.Phase(gc_events::ROOTS);
+		ProcessMarkStack();
+		events.Phase(gc_events::MARK);
+	}
+
+	StartSweep();
+	if (!lazy_sweep && mark_mode != INCREMENTAL_MARK) Sweep();
+	events.Phase(gc_events::SWEEP);
+	SizeHeap();
+	RecordPause(start);
+}
+
+// Pushes the roots of the collector and of every mutator thread onto the
+// mark stack.
+void MSGraphUtil :: MarkRoots() {
 	for (int i = 0; i < int(roots.size()); i++) {
-		DFSMark(roots[i]);
+		MarkPush(roots[i]);
+	}
+	for (int m = 0; m < int(safepoints.mutators.size()); m++) {
+		gc_roots::RootTable <Object>& more = safepoints.mutators[m]->roots;
+		for (int i = 0; i < more.size(); i++) {
+			MarkPush(more[i]);
+		}
 	}
+}
 
-	Sweep(first, NULL);
+// Initial mark, the first (short) pause of a concurrent cycle. The roots
+// are marked and become the marker thread's starting work; from here on
+// the write barrier is armed and new objects are allocated marked.
+void MSGraphUtil :: StartConcurrentMark() {
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	Sweep();
+	events.Phase(gc_events::SWEEP);
+	if (marker_thread.joinable()) marker_thread.join();
+
+	cm_stack.clear();
+	for (int i = 0; i < int(roots.size()); i++) {
+		if (roots[i] != NULL && gc_bitmap::AtomicSet(mark_bits, Slot(roots[i]))) {
+			cm_stack.push_back(roots[i]);
+		}
+	}
+	events.Phase(gc_events::ROOTS);
+	cm_done = false;
+	marking = true;
+	marker_thread = thread(&MSGraphUtil::ConcurrentMark, this);
+	RecordPause(start);
 }
 
-// Simple Depth First Search to mark the nodes.
-void MSGraphUtil :: DFSMark (Object* root) {
-	if (root == NULL)
-	  return;
-	
-	root->seen = true;
-	DFSMark(root->child);
-}
-
-// Sweeping the entire heap. We traverse the linked list in our simulation,
-// resetting the "seen" flag then and there. Any object that does not have
-// the seen flag set will be removed. Basic deletion of elements from a linked
-// list.
-void MSGraphUtil :: Sweep (Object* current, Object* prev) {
-	if (current == NULL) return;
-
-	if (current->seen == true) {
-		current->seen = false;
-		Sweep(current->next, current);
+// The marker thread. Objects are marked as they are pushed, with an atomic
+// fetch-or since the mutator allocates marked objects into the same bitmap
+// words. Whenever the stack runs dry it takes whatever the mutator's
+// barrier has queued; once both are empty it signals that the final mark
+// can be done.
+void MSGraphUtil :: ConcurrentMark() {
+	vector <Object*> logged;
+	ConcurrentVisitor visitor(this);
+	while (true) {
+		while (!cm_stack.empty()) {
+			Object* obj = cm_stack.back();
+			cm_stack.pop_back();
+			Types::Trace(obj, visitor);
+		}
+
+		satb_lock.lock();
+		logged.swap(satb_queue);
+		satb_lock.unlock();
+		if (logged.empty()) break;
+
+		for (int i = 0; i < int(logged.size()); i++) {
+			if (gc_bitmap::AtomicSet(mark_bits, Slot(logged[i]))) {
+				cm_stack.push_back(logged[i]);
+			}
+		}
+		logged.clear();
+	}
+	cm_done.store(true, memory_order_release);
+}
+
+// Final mark, the second pause. The marker thread is waited for (this only
+// blocks if the heap filled up before it finished), then the values the
+// barrier logged since it last looked and the current roots are traced on
+// this thread. Marking is complete and the heap is swept and sized as usual.
+void MSGraphUtil :: FinishConcurrentMark() {
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	if (marker_thread.joinable()) marker_thread.join();
+
+	for (int i = 0; i < int(satb_queue.size()); i++) {
+		MarkPush(satb_queue[i]);
+	}
+	for (int i = 0; i < int(satb_local.size()); i++) {
+		MarkPush(satb_local[i]);
+	}
+	satb_queue.clear();
+	satb_local.clear();
+	MarkRoots();
+	ProcessMarkStack();
+	events.Phase(gc_events::MARK);
+
+	marking = false;
+	cm_done = false;
+	StartSweep();
+	if (!lazy_sweep) Sweep();
+	events.Phase(gc_events::SWEEP);
+	SizeHeap();
+	RecordPause(start);
+}
+
+// Starts an incremental cycle. The write barrier is armed and objects
+// allocated from here on are allocated black; the roots are shaded by the
+// following steps, from root_cursor on.
+void MSGraphUtil :: StartIncrementalMark() {
+	grey_stack.clear();
+	root_cursor = 0;
+	marking = true;
+}
+
+// One bounded step of an incremental cycle, run on every allocation. While
+// marking, the roots not yet visited and then grey objects are scanned
+// until the budget runs out. When no grey objects are left, all the roots
+// are shaded again in the same step, since roots are reassigned without a
+// barrier, and marking is over once that turns up nothing new. This final
+// root scan is the one part of the cycle the budget does not bound. The
+// heap is sized from the mark bitmap as marking ends, with that step
+// standing for the collection's share of the time. After marking, the
+// step sweeps blocks instead. With the heap swept, a new
+// cycle starts once the occupancy threshold is reached.
+void MSGraphUtil :: IncrementalStep() {
+	int words = int(alloc_bits.size());
+	if (!marking && sweep_cursor == words &&
+	    used_bytes * 100 < max_bytes * cm_occupancy) return;
+
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	sizing.StartCollection();
+	int work = 0;
+	if (!marking && sweep_cursor == words) {
+		StartIncrementalMark();
+	}
+
+	if (marking) {
+		while (InBudget(work, start)) {
+			if (root_cursor < int(roots.size())) {
+				Shade(roots[root_cursor++]);
+				work++;
+				continue;
+			}
+			if (grey_stack.empty()) {
+				for (int i = 0; i < int(roots.size()); i++) {
+					Shade(roots[i]);
+				}
+				work += int(roots.size());
+				if (grey_stack.empty()) {
+					marking = false;
+					StartSweep();
+					SizeHeap();
+					break;
+				}
+				continue;
+			}
+			Object* obj = grey_stack.back();
+			grey_stack.pop_back();
+			ShadeVisitor visitor(this);
+			Types::Trace(obj, visitor);
+			work++;
+		}
 	} else {
-		if ((current->next != NULL) & (prev != NULL)) {
-			
-			// Object to be removed is neither the
-			// first nor the last item
-			Object* obsolete = current;
-			prev->next = current->next;
-			delete obsolete;
-			num_objects--;
-			Sweep(current->next, prev);
-		
-		} else if (prev == NULL) {
-			
-			// Object to be removed is the first item
-			Object* temp = current;
-			first = current->next;
-			delete temp;
-			num_objects--;
-			Sweep(first, prev);
-		
-		} else if (current->next == NULL) {
-	
-			// Object to be removed is the last item
-			prev->next = NULL;
-			last = prev;
-			Object* obsolete = current;
-			delete obsolete;
-			num_objects--;
-		}
-	}
-}
-
-// Shows the total memory used and the free memory
+		while (sweep_cursor < words && InBudget(work, start)) {
+			SweepBlock(sweep_cursor);
+			sweep_cursor += gc_bitmap::BLOCKWORDS;
+			work += gc_bitmap::BLOCKWORDS;
+		}
+	}
+	RecordPause(start);
+}
+
+// True while an incremental step begun at "start" that has done "work"
+// units may carry on.
+bool MSGraphUtil :: InBudget(int work, chrono::steady_clock::time_point start) {
+	if (inc_budget_us > 0) {
+		return chrono::duration<double, micro>(chrono::steady_clock::now() - start).count() < inc_budget_us;
+	}
+	return work < inc_budget;
+}
+
+// Turns a white object grey: marks it and queues it to be scanned.
+void MSGraphUtil :: Shade(Object* obj) {
+	if (obj == NULL || gc_bitmap::Test(mark_bits, Slot(obj))) return;
+	gc_bitmap::Set(mark_bits, Slot(obj));
+	grey_stack.push_back(obj);
+}
+
+// Keeps track of the longest pause, for a pause that began at "start".
+void MSGraphUtil :: RecordPause(chrono::steady_clock::time_point start) {
+	double us = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+	if (us > max_pause_us) max_pause_us = us;
+}
+
+// Pushes an object for marking. Objects are marked when they are popped,
+// so the push only issues a prefetch and the cache miss on the object
+// overlaps with the work on whatever is above it on the stack. When the
+// stack is full the object is marked without being scanned and the
+// overflow is left for RescanHeap().
+void MSGraphUtil :: MarkPush(Object* obj) {
+	if (obj == NULL) return;
+
+	if (int(mark_stack.size()) == MARKSTACKSIZE) {
+		gc_bitmap::Set(mark_bits, Slot(obj));
+		mark_overflow = true;
+		return;
+	}
+	__builtin_prefetch(obj);
+	mark_stack.push_back(obj);
+}
+
+// Drains the mark stack, then recovers from any overflow until the heap
+// has been marked completely.
+void MSGraphUtil :: ProcessMarkStack() {
+	MarkVisitor visitor(this);
+	do {
+		while (!mark_stack.empty()) {
+			Object* obj = mark_stack.back();
+			mark_stack.pop_back();
+			int slot = Slot(obj);
+			if (gc_bitmap::Test(mark_bits, slot)) continue;
+
+			gc_bitmap::Set(mark_bits, slot);
+			Types::Trace(obj, visitor);
+		}
+		if (mark_overflow) {
+			mark_overflow = false;
+			RescanHeap();
+		}
+	} while (!mark_stack.empty() || mark_overflow);
+}
+
+// Finds the marked objects whose children were dropped by an overflowing
+// push and pushes those children again. Only marked slots are visited.
+void MSGraphUtil :: RescanHeap() {
+	RescanVisitor visitor(this);
+	for (int w = 0; w < int(mark_bits.size()); w++) {
+		for (uint64_t bits = mark_bits[w]; bits != 0; bits &= bits - 1) {
+			Types::Trace(ObjectAt(w * 64 + __builtin_ctzll(bits)), visitor);
+		}
+	}
+}
+
+// Depth First Search to mark the nodes, driven by the explicit mark stack
+// rather than recursion so long chains cannot overflow the native stack.
+void MSGraphUtil :: DFSMark (Object* root) {
+	MarkPush(root);
+	ProcessMarkStack();
+}
+
+// Sweeps the page whose bits start at word "w", looking only at the
+// bitmaps. A large object that was not marked frees its pages. In a page
+// of slots the dead objects (allocated but unmarked) are dropped from the
+// allocation bitmap a word at a time and destroyed. A page swept for the
+// first time since the mark then has all its free slots listed, or is
+// freed if nothing on it survived; a page that is already listed only
+// gets its dead slots back, and is skipped outright if it has none. The
+// page's mark bits are cleared for the next cycle.
+void MSGraphUtil :: SweepBlock(int w) {
+	int page = w / gc_bitmap::BLOCKWORDS;
+	int size_class = page_class[page];
+	if (size_class == LARGEPAGE) {
+		if (!gc_bitmap::Test(mark_bits, w * 64)) {
+			gc_bitmap::Clear(alloc_bits, w * 64);
+			Release(ObjectAt(w * 64));
+		}
+	} else if (size_class >= 0 &&
+	           (!listed[page] || gc_bitmap::AnyDead(&alloc_bits[w], &mark_bits[w]))) {
+		Object*& free_list = free_lists[size_class];
+		bool survivors = false;
+		for (int i = w; i < w + gc_bitmap::BLOCKWORDS; i++) {
+			uint64_t dead = alloc_bits[i] & ~mark_bits[i];
+			alloc_bits[i] &= mark_bits[i];
+			if (alloc_bits[i] != 0) survivors = true;
+			for (; dead != 0; dead &= dead - 1) {
+				Object* obj = ObjectAt(i * 64 + __builtin_ctzll(dead));
+				Release(obj);
+				if (listed[page]) {
+					obj->next = free_list;
+					free_list = obj;
+				}
+			}
+		}
+
+		if (!listed[page] && !survivors) {
+			ReleasePages(page, 1);
+		} else if (!listed[page] && page < page_limit) {
+			int stride = CLASSBYTES[size_class];
+			for (int i = int(PAGEBYTES) / stride - 1; i >= 0; i--) {
+				int slot = w * 64 + i * stride / int(GRANULE);
+				if (gc_bitmap::Test(alloc_bits, slot)) continue;
+				Object* obj = ObjectAt(slot);
+				obj->next = free_list;
+				free_list = obj;
+			}
+		}
+		listed[page] = (page < page_limit);
+	}
+	for (int i = w; i < w + gc_bitmap::BLOCKWORDS; i++) {
+		mark_bits[i] = 0;
+	}
+}
+
+// Sweeps whatever part of the heap has not been swept since the last mark;
+// after an eager TriggerGC() that is the entire heap.
+void MSGraphUtil :: Sweep () {
+	for (; sweep_cursor < int(alloc_bits.size()); sweep_cursor += gc_bitmap::BLOCKWORDS) {
+		SweepBlock(sweep_cursor);
+	}
+}
+
+// Marking is over, the sweep starts from the first page. The free lists
+// are emptied, since the sweep lists every page's free slots again as it
+// gets to it.
+void MSGraphUtil :: StartSweep() {
+	sweep_cursor = 0;
+	free_lists.assign(NUMCLASSES, (Object*)NULL);
+	listed.assign(num_pages, 0);
+}
+
+// Shows the memory used and free, in bytes, and how fragmented it is:
+// internally, the share of the used bytes lost to rounding up to a size
+// class, and externally, the share of the free bytes that is not in free
+// pages, so only objects of one size class can use it. While a lazy sweep
+// is pending, garbage in the unswept part of the heap still counts as used.
 void MSGraphUtil :: ShowMemoryUsage() {
-	cout << "Used Memory: " << num_objects << endl;
-	cout << "Free Memory: " << max_objects - num_objects << endl << "------------------\n";
+	size_t free_bytes = max_bytes - used_bytes;
+	size_t free_pages = 0;
+	for (int p = 0; p < num_pages; p++) {
+		if (page_class[p] == FREEPAGE) free_pages++;
+	}
+	size_t stranded = free_bytes - free_pages * PAGEBYTES;
+	cout << "Used Memory: " << used_bytes << " bytes" << endl;
+	cout << "Free Memory: " << free_bytes << " bytes" << endl;
+	cout << "Internal fragmentation: "
+	     << (used_bytes ? 100.0 * (used_bytes - requested_bytes) / used_bytes : 0) << "%" << endl;
+	cout << "External fragmentation: "
+	     << (free_bytes ? 100.0 * stranded / free_bytes : 0) << "%" << endl << "------------------\n";
+}
+
+// Shows the heap size and how it has been resized.
+void MSGraphUtil :: ShowSizingStats() {
+	sizing.ShowStats(max_bytes);
 }
 
 // Creates a new reference object. Object* obj = new Object();. Essentially,
-// creates an object in the heap and a reference in the roots vector.
-void MSGraphUtil :: NewReference(const string& desc) {
-    
-    // if the heap is full, then we call TriggerGC() to free up some space.
-    if (num_objects == max_objects) {
-        TriggerGC();
-    }
-    
-    // pushing the object into the heap is simulated as adding an element
-    // at the end of a linked list.
-    if (num_objects == 0) {
-        	num_objects++;
-        	Object* obj = new Object(desc);
-        	roots.push_back(obj);
-        	first = obj;
-        	last = obj;
-    } else if (num_objects < max_objects) {
-  	    num_objects++;
-	    Object* obj = new Object(desc);
-	    roots.push_back(obj);
-	    last->next = obj;
-	    last = obj;
-    } else {
-	    cout << "Error! Unable to allocate memory!\n";
+// creates an object in the heap and a reference in the root table, and
+// returns the root's handle (an invalid one if the heap is full).
+gc_roots::RootHandle MSGraphUtil :: NewReference(const string& desc) {
+	return NewReference(desc, sizeof(Object));
+}
+
+// The same for an object of "size" bytes.
+gc_roots::RootHandle MSGraphUtil :: NewReference(const string& desc, size_t size) {
+    Object* obj = CollectAndAllocate(desc, size);
+    if (obj != NULL) {
+	    return roots.Add(obj);
     }
+    gc_roots::RootHandle none = { -1, 0 };
+    return none;
+}
+
+// The same for a mutator thread, the root going into its own root set.
+gc_roots::RootHandle MSGraphUtil :: NewReference(const string& desc, size_t size, Mutator* mutator) {
+	Object* obj = CollectAndAllocate(desc, size);
+	if (obj != NULL) {
+		return mutator->roots.Add(obj);
+	}
+	gc_roots::RootHandle none = { -1, 0 };
+	return none;
 }
 
 
 // Creating a new reference and making it point to an existing object
 // Object *obj = x;
-void MSGraphUtil :: NewReference(Object* obj) {
-	roots.push_back(obj);
+gc_roots::RootHandle MSGraphUtil :: NewReference(Object* obj) {
+	return roots.Add(obj);
 }
 
 // New object that would be pointed to by an existing pointer.
@@ -164,44 +984,161 @@ void MSGraphUtil :: NewReference(Object* obj) {
 // a self-referencing object, like a binary tree structure or a
 // linked-list.
 Object* MSGraphUtil :: New(const string& desc, Object* parent) {
-    Object* obj = NULL;
-	if (num_objects == max_objects) {
-      TriggerGC();
+	return New(desc, parent, sizeof(Object));
+}
+
+// The same for an object of "size" bytes. Without a parent there would be
+// nothing to keep the object alive, so nothing is allocated.
+Object* MSGraphUtil :: New(const string& desc, Object* parent, size_t size) {
+    if (parent == NULL) {
+        cout << "Error! New() needs a parent object!\n";
+        return NULL;
     }
-    if (num_objects == 0) {
-    	num_objects++;
-    	obj = new Object(desc);
-    	parent->child = obj;
-    	first = obj;
-    	last = obj;
-    } else if (num_objects < max_objects) {
-		num_objects++;
-		obj = new Object(desc);
-		parent->child = obj;
-		last->next = obj;
-		last = obj;
-    } else {
-        cout << "Error! Unable to allocate memory!\n";
+    Object* obj = CollectAndAllocate(desc, size);
+    if (obj != NULL) {
+		WriteReference(parent, obj);
     }
     return obj;
 }
 
 // Reassigning a pointer to a different object. No creation of objects
-// involved.
-void MSGraphUtil :: OldReference (Object* o1, Object* o2){
-	o2 = o1;
+// involved. The root "reference" now refers to obj.
+void MSGraphUtil :: OldReference (gc_roots::RootHandle reference, Object* obj){
+	WriteRoot(reference, obj);
+}
+
+// Stores "value" into obj's child field.
+void MSGraphUtil :: WriteReference(Object* obj, Object* value) {
+	WriteReference(obj, &obj->child, value);
+}
+
+// Stores "value" into "slot", one of the object's reference fields. While
+// a concurrent mark is running, the value being overwritten is logged
+// first, so the marker still finds everything that was reachable when
+// marking began. While an incremental mark is running, the value being
+// stored is shaded instead. Neither barrier needs the object itself.
+void MSGraphUtil :: WriteReference(Object*, Object** slot, Object* value) {
+	if (marking.load(memory_order_relaxed)) {
+		if (mark_mode == INCREMENTAL_MARK) {
+			Shade(value);
+		} else {
+			Object* old_value = *slot;
+			if (old_value != NULL) SatbEnqueue(old_value);
+		}
+	}
+	__atomic_store_n(slot, value, __ATOMIC_RELEASE);
+}
+
+// Reassigns a root. Roots are not traced by the marker thread, they are
+// scanned again at the end of marking, so no barrier is needed.
+void MSGraphUtil :: WriteRoot(gc_roots::RootHandle reference, Object* value) {
+	roots.Set(reference, value);
+}
+
+// Logs an overwritten reference in the mutator's buffer, handing the
+// buffer to the marker thread when it is full.
+void MSGraphUtil :: SatbEnqueue(Object* old_value) {
+	satb_local.push_back(old_value);
+	if (int(satb_local.size()) >= SATBBUFFERSIZE) {
+		satb_lock.lock();
+		satb_queue.insert(satb_queue.end(), satb_local.begin(), satb_local.end());
+		satb_lock.unlock();
+		satb_local.clear();
+	}
 }
 
 // Getting rid of the root reference. This is typically when a pointer
 // falls out of scope causing a memory leak.
-void MSGraphUtil :: EndLifetime(Object* obj) {
-    int pos = -1;
-    for (int i = 0; i < int(roots.size()); i++) {
-        if (roots[i] == obj) {
-            pos = i;
-            break;
-        }
-    }
-    if (pos != -1) roots.erase(roots.begin() + pos);
+void MSGraphUtil :: EndLifetime(gc_roots::RootHandle reference) {
+	roots.Remove(reference);
+}
+
+// Allocation as the mutator threads do it: a safepoint poll, then
+// Allocate() under the allocation lock.
+Object* MSGraphUtil :: LockedAllocate(const string& desc, size_t size) {
+	safepoints.Poll();
+	lock_guard<mutex> guard(alloc_lock);
+	return Allocate(desc, size);
+}
+
+// The allocation path shared by New() and NewReference(): if the object
+// does not fit, the heap is collected, and if it still does not fit, grown.
+// NULL when it does not fit the largest heap either.
+Object* MSGraphUtil :: CollectAndAllocate(const string& desc, size_t size) {
+	Object* obj = LockedAllocate(desc, size);
+	if (obj == NULL) {
+		TriggerGC(gc_events::HEAP_FULL);
+		obj = LockedAllocate(desc, size);
+	}
+	if (obj == NULL) obj = GrowAndAllocate(desc, size);
+	if (obj == NULL) OutOfMemory(size);
+	return obj;
+}
+
+// Allocates an array of "length" references, all NULL.
+RefArray* MSGraphUtil :: NewArray(const string& desc, int length) {
+	size_t size = sizeof(RefArray) + length * sizeof(Object*);
+	Object* p = CollectAndAllocate(desc, size);
+	if (p == NULL) return NULL;
+
+	p->~Object();
+	RefArray* array = new (p) RefArray(desc, length);
+	array->size = int(size);
+	array->type = Types::Id<RefArray>();
+	return array;
+}
+
+// Grows the heap for an object of "size" bytes and allocates it, under the
+// allocation lock so no other thread takes the new room first. A large
+// object may need more than one step, if the pages at the old end of the
+// heap are in use. NULL once the heap is at its largest, or while a
+// concurrent mark is using the bitmaps.
+Object* MSGraphUtil :: GrowAndAllocate(const string& desc, size_t size) {
+	safepoints.Poll();
+	lock_guard<mutex> guard(alloc_lock);
+	if (mark_mode == CONCURRENT_MARK && marking) return NULL;
+	Object* obj = NULL;
+	while (obj == NULL) {
+		size_t usable = page_limit * PAGEBYTES;
+		size_t bytes = sizing.GrowFor(usable, max(size, PAGEBYTES));
+		if (bytes <= usable) break;
+		ResizeHeap(bytes);
+		obj = Allocate(desc, size);
+	}
+	return obj;
+}
+
+// An allocation of "size" bytes that did not fit the largest heap. The
+// sizer's oom_handler runs with the allocation lock held, so it may drop
+// roots but must not allocate.
+void MSGraphUtil :: OutOfMemory(size_t size) {
+	cout << "Error! Unable to allocate memory!\n";
+	lock_guard<mutex> guard(alloc_lock);
+	sizing.OutOfMemory(size);
+}
+
+// Attaches the calling thread as a mutator, with an empty root set. The
+// concurrent and incremental marks only know the collector's own roots and
+// a single thread's barrier buffer, so they take no mutator threads.
+Mutator* MSGraphUtil :: AttachMutator() {
+	if (mark_mode != STW_MARK) {
+		cout << "Error! Mutator threads need mark_mode STW_MARK!\n";
+		return NULL;
+	}
+	Mutator* mutator = new Mutator();
+	safepoints.Attach(mutator);
+	return mutator;
+}
+
+// Detaches a mutator thread; its roots end with it.
+void MSGraphUtil :: DetachMutator(Mutator* mutator) {
+	safepoints.Detach(mutator);
+	delete mutator;
+}
+
+// Safepoint poll for a mutator thread that goes a long way without
+// allocating.
+void MSGraphUtil :: Safepoint() {
+	safepoints.Poll();
 }
 } // ms_graph_api
@@ -14,8 +14,21 @@
 
 #include <string>
 #include <vector>
+#include <new>
+#include <cstring>
 #include <cctype>
 #include <iostream>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include "gc-bitmap.h"
+#include "gc-types.h"
+#include "parallel-mark.h"
+#include "root-table.h"
+#include "safepoint.h"
+#include "heap-sizing.h"
+#include "gc-events.h"
 
 // Utility Macros.
 #define CHECK(x) if(!(x)){cerr<<"Check not satisfied! Aborting...\n";exit(1);}
@@ -24,55 +37,314 @@ using namespace std;
 
 namespace ms_graph_api {
 
+// How TriggerGC() marks. STW_MARK marks in the pause. CONCURRENT_MARK only
+// snapshots the roots in a short initial mark, traces on a background
+// thread while the mutator keeps running, and finishes with a short final
+// mark. INCREMENTAL_MARK does the whole cycle on the mutator's thread, a
+// few objects or blocks at a time, each time something is allocated.
+enum MarkMode { STW_MARK, CONCURRENT_MARK, INCREMENTAL_MARK };
+
+// An object is this header followed by size - sizeof(Object) bytes of raw
+// payload that the collector never looks at. Plain Objects are type 0; the
+// other types below derive from it and describe their reference fields
+// (see gc-types.h). Objects never move, so they need no CopyTo().
 class Object {
   public:
-    bool seen;
-    Object* next;
+    Object* next;   // free-list link while the slot is unused
     Object* child;
+    int size;       // bytes asked for, header included
+    int type;       // index in Types
     string desc;
     Object() {
         next = NULL;
         child = NULL;
+        size = sizeof(Object);
+        type = 0;
         desc = "";
     }
     Object (const string& description) {
     	next = NULL;
     	child = NULL;
+    	size = sizeof(Object);
+    	type = 0;
     	desc = description;
     }
+    char* Payload() { return (char*)(this + 1); }
+
+    size_t Size() const { return size; }
+
+    template <class V>
+    void EachRef(V& v) {
+    	v(child);
+    }
+};
+
+// An object with REFS reference fields on top of child, and BYTES bytes of
+// raw payload the collector never looks at.
+template <int REFS, int BYTES>
+class Record : public Object {
+  public:
+    Object* refs[REFS];
+    char payload[BYTES];
+
+    Record (const string& description) : Object(description) {
+    	for (int i = 0; i < REFS; i++) refs[i] = NULL;
+    	memset(payload, 0, BYTES);
+    }
+
+    template <class V>
+    void EachRef(V& v) {
+    	v(child);
+    	for (int i = 0; i < REFS; i++) v(refs[i]);
+    }
+};
+
+// Binary tree node: refs[0] and refs[1] are the subtrees, the payload a key.
+typedef Record<2, 8> TreeNode;
+// Hash map entry: child is the next entry in the bucket, refs[0] the value,
+// the payload the key.
+typedef Record<1, 16> MapEntry;
+
+// An array of "length" references stored right after the header.
+class RefArray : public Object {
+  public:
+    int length;
+
+    RefArray (const string& description, int n) : Object(description) {
+    	length = n;
+    	for (int i = 0; i < n; i++) Elems()[i] = NULL;
+    }
+
+    Object** Elems() { return (Object**)(this + 1); }
+
+    template <class V>
+    void EachRef(V& v) {
+    	v(child);
+    	Object** elems = Elems();
+    	for (int i = 0; i < length; i++) v(elems[i]);
+    }
+};
+
+// Every type the heap can hold. A new type is added here.
+typedef gc_types::TypeList<Object, Object, TreeNode, MapEntry, RefArray> Types;
+
+// A mutator thread attached to the collector, with roots of its own.
+class Mutator {
+  public:
+    gc_roots::RootTable <Object> roots;
 };
 
 class MSGraphUtil {
   public:
     
-    // constructors
+    // constructors, heap sizes are in bytes
     MSGraphUtil();
-    MSGraphUtil(int heap_size);
+    MSGraphUtil(size_t heap_bytes);
+    MSGraphUtil(size_t min_bytes, size_t max_bytes);
+    ~MSGraphUtil();
     
-    // utility data members
+    // utility data members. max_bytes is the heap size as it is now, used_bytes
+    // counts the slots handed out, requested_bytes what was asked for; the
+    // difference is lost to rounding up to a size class.
     int num_objects;
-    int max_objects;
+    size_t max_bytes;
+    size_t used_bytes;
+    size_t requested_bytes;
     
     // container for root items
-    vector <Object*> roots;
+    gc_roots::RootTable <Object> roots;
+
+    // Mutator threads. With threads attached, every thread using the heap
+    // has to be one of them, and the root table above belongs to whichever
+    // thread is not. Allocation is serialised on alloc_lock, and
+    // TriggerGC() stops every mutator at a safepoint. Only STW_MARK takes
+    // mutator threads; AttachMutator() refuses them in the other modes.
+    gc_safepoint::Safepoints <Mutator> safepoints;
+    mutex alloc_lock;
     
-    // pointers for scanning the heap
-    Object* first;
-    Object* last;
+    // The heap size moves between the bounds in "sizing" (see
+    // heap-sizing.h): it is checked after every collection that leaves the
+    // heap swept, and grown when an allocation does not fit after one.
+    gc_sizing::HeapSizer sizing;
+
+    // Every collection done in a pause is logged here once the log is
+    // enabled (see gc-events.h): a TriggerGC(), or the final mark of a
+    // concurrent cycle. An incremental cycle that ends a step at a time is
+    // not one collection and is not logged. After a lazy sweep the dead
+    // still count, since they have not been swept yet.
+    gc_events::EventLog events;
+
+    // The heap is one contiguous region reserved at sizing.max_bytes, of
+    // which the first max_bytes are in use, cut into pages of one
+    // sweep block each. A page is free, part of a large object (one that
+    // takes whole pages), or holds slots of a single size class. Each size
+    // class keeps its unused slots threaded through their "next" pointers
+    // into its own free list. The sweep rebuilds a page's share of its free
+    // list when it gets to the page, so "listed" records which pages have
+    // been swept (or carved into slots) since the last mark; a swept page
+    // with nothing left on it goes back to being free. Pages from
+    // page_limit on are being given back after a shrink: nothing new is
+    // allocated in them, and the heap ends at page_limit once they are
+    // all free.
+    char* heap;
+    int num_pages;
+    int page_limit;
+    vector <int> page_class;
+    vector <char> listed;
+    vector <Object*> free_lists;
+    int free_page_hint;
+
+    // Side bitmaps with one bit per granule of the heap: the granules that
+    // start an allocated object and the objects reached by the last mark.
+    // Objects carry no mark state.
+    vector <uint64_t> alloc_bits;
+    vector <uint64_t> mark_bits;
+
+    // With lazy_sweep set, TriggerGC() only marks and the allocation path
+    // sweeps the bitmaps one block at a time, from sweep_cursor (a word
+    // index), until it finds a free slot. Words at or past the cursor have
+    // not been swept since the last mark.
+    bool lazy_sweep;
+    int sweep_cursor;
+
+    // Number of GC worker threads marking in parallel; 1 keeps marking on
+    // the calling thread.
+    int gc_threads;
+
+    // Explicit mark stack, bounded at MARKSTACKSIZE entries. A push that
+    // finds it full sets mark_overflow instead, and the objects it dropped
+    // are recovered by rescanning the heap once the stack drains.
+    vector <Object*> mark_stack;
+    bool mark_overflow;
+
+    // Concurrent marking. A cycle starts once cm_occupancy percent of the
+    // heap is in use. While "marking" is set, reference stores log the
+    // value they overwrite (snapshot-at-the-beginning barrier) into
+    // satb_local, which is handed to the marker thread through satb_queue
+    // when it fills up. cm_done is raised when the marker thread runs out
+    // of work and the final mark can be done. mark_mode is chosen before
+    // any mutator thread attaches.
+    MarkMode mark_mode;
+    int cm_occupancy;
+    atomic <bool> marking;
+    atomic <bool> cm_done;
+    thread marker_thread;
+    vector <Object*> cm_stack;
+    vector <Object*> satb_local;
+    vector <Object*> satb_queue;
+    mutex satb_lock;
+
+    // Incremental marking. Each allocation does one step of at most
+    // inc_budget units of work (a grey object scanned, or 64 granules swept),
+    // or, with inc_budget_us set, as many units as fit in that many
+    // microseconds. Grey objects are marked and waiting on grey_stack;
+    // roots before root_cursor have been shaded. Cycles start at the same
+    // cm_occupancy threshold.
+    int inc_budget;
+    int inc_budget_us;
+    vector <Object*> grey_stack;
+    int root_cursor;
+
+    // Longest collector pause seen so far, in microseconds, whatever the
+    // mark mode, and how many collections had to be finished in one pause
+    // because the heap filled up before an incremental cycle was over.
+    double max_pause_us;
+    int full_collections;
 
     // utility functions
+    void InitHeap();
+    void ResizeHeap(size_t bytes);
+    void TrimHeap();
+    void SetPages(int pages);
+    void SizeHeap();
+    size_t MarkedBytes();
+    Object* Allocate(const string& desc);
+    Object* Allocate(const string& desc, size_t size);
+    Object* AllocateSmall(int size_class);
+    Object* AllocateLarge(size_t size);
+    bool CarvePage(int size_class);
+    int FindPages(int pages);
+    void ReleasePages(int first, int pages);
+    void Release(Object* obj);
+    void Free(Object* obj);
+    int Slot(Object* obj);
+    Object* ObjectAt(int slot);
+    void MarkPush(Object* obj);
+    void MarkRoots();
+    void ProcessMarkStack();
+    void RescanHeap();
     void DFSMark(Object* root);
-    void Sweep(Object* current, Object* prev);
+    void SweepBlock(int w);
+    void Sweep();
+    void StartSweep();
     void TriggerGC();
+    void TriggerGC(int cause);
+    void Collect();
+    void StartConcurrentMark();
+    void ConcurrentMark();
+    void FinishConcurrentMark();
+    void StartIncrementalMark();
+    void IncrementalStep();
+    bool InBudget(int work, chrono::steady_clock::time_point start);
+    void Shade(Object* obj);
+    void RecordPause(chrono::steady_clock::time_point start);
     void ShowMemoryUsage();
+    void ShowSizingStats();
     
-    // Object allocation and reference lifetime
+    // Object allocation and reference lifetime. "size" is the size of the
+    // object in bytes, header included; without it an object is just the
+    // header.
     Object* New(const string& desc, Object* parent);
-    void NewReference(const string& desc);
-    void NewReference(Object* obj);
-    void OldReference(Object* obj1, Object* obj2);
-    void EndLifetime(Object* reference);
+    Object* New(const string& desc, Object* parent, size_t size);
+    gc_roots::RootHandle NewReference(const string& desc);
+    gc_roots::RootHandle NewReference(const string& desc, size_t size);
+    gc_roots::RootHandle NewReference(const string& desc, size_t size, Mutator* mutator);
+    gc_roots::RootHandle NewReference(Object* obj);
+    void OldReference(gc_roots::RootHandle reference, Object* obj);
+    void EndLifetime(gc_roots::RootHandle reference);
+    Object* LockedAllocate(const string& desc, size_t size);
+    Object* CollectAndAllocate(const string& desc, size_t size);
+    Object* GrowAndAllocate(const string& desc, size_t size);
+    void OutOfMemory(size_t size);
+
+    // Mutator threads attach and detach themselves. Safepoint() is the
+    // explicit safepoint poll.
+    Mutator* AttachMutator();
+    void DetachMutator(Mutator* mutator);
+    void Safepoint();
+
+    // Reference stores. Every pointer store into the heap goes through
+    // WriteReference() so the write barrier sees it; without a slot the
+    // store is to obj->child.
+    void WriteReference(Object* obj, Object* value);
+    void WriteReference(Object* obj, Object** slot, Object* value);
+    void WriteRoot(gc_roots::RootHandle reference, Object* value);
+    void SatbEnqueue(Object* old_value);
+
+    // Typed objects. These collect first, then grow the heap, if the object
+    // does not fit, and return NULL if it still does not. Reference fields
+    // are set through WriteReference().
+    template <class T>
+    T* NewObject(const string& desc);
+    RefArray* NewArray(const string& desc, int length);
+
+  private:
+    // the slab is owned by the collector, so it cannot be copied
+    MSGraphUtil(const MSGraphUtil&);
+    MSGraphUtil& operator=(const MSGraphUtil&);
 };
 
+template <class T>
+T* MSGraphUtil :: NewObject(const string& desc) {
+	Object* p = CollectAndAllocate(desc, sizeof(T));
+	if (p == NULL) return NULL;
+
+	p->~Object();
+	T* obj = new (p) T(desc);
+	obj->size = int(sizeof(T));
+	obj->type = Types::Id<T>();
+	return obj;
+}
+
 } // ms_graph_api
 #endif /* MSGRAPHAPI_H_ */
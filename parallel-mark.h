@@ -0,0 +1,257 @@
+/*
+ * parallel-mark.h
+ *
+ *  Parallel marking for the slab heaps, shared by MSGraphUtil and the
+ *  mark-sweep half of HybGraphUtil.
+ *
+ *  Every GC worker owns a work-stealing deque (Chase and Lev, "Dynamic
+ *  Circular Work-Stealing Deque", in the C11 formulation of Le et al.). The
+ *  owner pushes and pops at the bottom without contention, idle workers
+ *  steal from the top of someone else's deque. An object is pushed only by
+ *  the worker whose atomic fetch-or set its mark bit, so objects shared
+ *  between several paths are traced exactly once.
+ */
+
+#ifndef PARALLELMARK_H_
+#define PARALLELMARK_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace gc_parallel {
+
+template <class T>
+class WorkStealingDeque {
+  public:
+    WorkStealingDeque() {
+    	top = 0;
+    	bottom = 0;
+    	array = new Array(1024);
+    }
+
+    ~WorkStealingDeque() {
+    	delete array.load();
+    	for (int i = 0; i < int(retired.size()); i++) delete retired[i];
+    }
+
+    // Owner only.
+    void Push(T x) {
+    	long b = bottom.load(memory_order_relaxed);
+    	long t = top.load(memory_order_acquire);
+    	Array* a = array.load(memory_order_relaxed);
+    	if (b - t > a->size - 1) {
+    		a = Grow(a, b, t);
+    	}
+    	a->Put(b, x);
+    	bottom.store(b + 1, memory_order_release);
+    }
+
+    // Owner only. Returns false when the deque is empty or a thief won the
+    // race for the last element.
+    bool Pop(T& x) {
+    	long b = bottom.load(memory_order_relaxed) - 1;
+    	Array* a = array.load(memory_order_relaxed);
+    	bottom.store(b, memory_order_relaxed);
+    	atomic_thread_fence(memory_order_seq_cst);
+    	long t = top.load(memory_order_relaxed);
+    	if (t > b) {
+    		bottom.store(b + 1, memory_order_relaxed);
+    		return false;
+    	}
+    	x = a->Get(b);
+    	if (t == b) {
+    		bool won = top.compare_exchange_strong(t, t + 1, memory_order_seq_cst,
+    		                                       memory_order_relaxed);
+    		bottom.store(b + 1, memory_order_relaxed);
+    		return won;
+    	}
+    	return true;
+    }
+
+    // Any thread.
+    bool Steal(T& x) {
+    	long t = top.load(memory_order_acquire);
+    	atomic_thread_fence(memory_order_seq_cst);
+    	long b = bottom.load(memory_order_acquire);
+    	if (t >= b) return false;
+
+    	Array* a = array.load(memory_order_acquire);
+    	x = a->Get(t);
+    	return top.compare_exchange_strong(t, t + 1, memory_order_seq_cst,
+    	                                   memory_order_relaxed);
+    }
+
+    bool Empty() {
+    	return top.load(memory_order_acquire) >= bottom.load(memory_order_acquire);
+    }
+
+  private:
+    struct Array {
+    	long size;
+    	atomic<T>* buf;
+    	Array(long n) {
+    		size = n;
+    		buf = new atomic<T>[n];
+    	}
+    	~Array() {
+    		delete[] buf;
+    	}
+    	T Get(long i) {
+    		return buf[i & (size - 1)].load(memory_order_relaxed);
+    	}
+    	void Put(long i, T x) {
+    		buf[i & (size - 1)].store(x, memory_order_relaxed);
+    	}
+    };
+
+    // Doubles the circular array. The old one may still be read by a
+    // thief, so it is retired rather than freed until the deque goes away.
+    Array* Grow(Array* a, long b, long t) {
+    	Array* bigger = new Array(a->size * 2);
+    	for (long i = t; i < b; i++) {
+    		bigger->Put(i, a->Get(i));
+    	}
+    	retired.push_back(a);
+    	array.store(bigger, memory_order_release);
+    	return bigger;
+    }
+
+    atomic<long> top;
+    atomic<long> bottom;
+    atomic<Array*> array;
+    vector<Array*> retired;
+};
+
+// Marks a heap of "granules" granules of "granule" bytes starting at
+// "heap", setting the bit in "mark_bits" of the granule an object starts
+// at. Objects outside the heap are not traced. "Types" is the heap's
+// TypeList (see gc-types.h), through which every reference slot of a
+// marked object is visited.
+template <class Object, class Types>
+class ParallelMarker {
+  public:
+    ParallelMarker(char* heap, size_t granule, int granules, vector<uint64_t>& mark_bits,
+                   int threads)
+      : marked(threads, 0), steals(threads, 0), heap(heap), granule(granule),
+        end(heap + granule * granules), bits(&mark_bits[0]), num_threads(threads),
+        deques(threads) {
+    	active = threads;
+    }
+
+    // Marks everything reachable from "roots". The roots are dealt out
+    // round-robin so every worker starts with work of its own.
+    void Mark(const vector<Object*>& roots) {
+    	for (int i = 0; i < int(roots.size()); i++) {
+    		if (TryMark(roots[i])) {
+    			deques[i % num_threads].Push(roots[i]);
+    		}
+    	}
+
+    	vector<thread> workers;
+    	for (int id = 1; id < num_threads; id++) {
+    		workers.push_back(thread(&ParallelMarker::Work, this, id));
+    	}
+    	Work(0);
+    	for (int i = 0; i < int(workers.size()); i++) {
+    		workers[i].join();
+    	}
+    }
+
+    // Objects marked, and successful steals, by each worker.
+    vector<long> marked;
+    vector<long> steals;
+
+  private:
+    // Atomically sets the object's mark bit. True for the one caller that
+    // found it clear.
+    bool TryMark(Object* obj) {
+    	if (obj == NULL || (char*)obj < heap || (char*)obj >= end) return false;
+
+    	int slot = int(((char*)obj - heap) / granule);
+    	uint64_t bit = uint64_t(1) << (slot & 63);
+    	if (__atomic_load_n(&bits[slot >> 6], __ATOMIC_RELAXED) & bit) return false;
+    	return !(__atomic_fetch_or(&bits[slot >> 6], bit, __ATOMIC_RELAXED) & bit);
+    }
+
+    bool StealFrom(int id, Object*& obj) {
+    	for (int i = 1; i < num_threads; i++) {
+    		if (deques[(id + i) % num_threads].Steal(obj)) {
+    			steals[id]++;
+    			return true;
+    		}
+    	}
+    	return false;
+    }
+
+    bool AnyWork() {
+    	for (int i = 0; i < num_threads; i++) {
+    		if (!deques[i].Empty()) return true;
+    	}
+    	return false;
+    }
+
+    // Worker loop: drain the own deque, then steal. A worker that finds
+    // nothing to steal goes idle, and marking is over once every worker is
+    // idle with all deques empty. An idle worker counts itself active again
+    // before it tries to steal, so the count never reaches zero while work
+    // is in flight.
+    void Work(int id) {
+    	Object* obj;
+    	while (true) {
+    		while (deques[id].Pop(obj) || StealFrom(id, obj)) {
+    			Scan(id, obj);
+    		}
+
+    		active.fetch_sub(1);
+    		bool found = false;
+    		while (!found) {
+    			if (active.load() == 0) return;
+    			if (AnyWork()) {
+    				active.fetch_add(1);
+    				if (StealFrom(id, obj)) {
+    					Scan(id, obj);
+    					found = true;
+    				} else {
+    					active.fetch_sub(1);
+    				}
+    			}
+    			if (!found) this_thread::yield();
+    		}
+    	}
+    }
+
+    // Pushes each child whose mark bit this worker set onto its deque.
+    struct ScanVisitor {
+    	ParallelMarker* marker;
+    	int id;
+    	void operator()(Object*& slot) {
+    		Object* child = slot;
+    		if (marker->TryMark(child)) {
+    			__builtin_prefetch(child);
+    			marker->deques[id].Push(child);
+    		}
+    	}
+    };
+
+    void Scan(int id, Object* obj) {
+    	marked[id]++;
+    	ScanVisitor visitor = { this, id };
+    	Types::Trace(obj, visitor);
+    }
+
+    char* heap;
+    size_t granule;
+    char* end;
+    uint64_t* bits;
+    int num_threads;
+    vector< WorkStealingDeque<Object*> > deques;
+    atomic<int> active;
+};
+
+} // gc_parallel
+
+#endif /* PARALLELMARK_H_ */
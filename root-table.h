@@ -0,0 +1,120 @@
+/*
+ * root-table.h
+ *
+ *  The root set, shared by all three collectors.
+ *
+ *  NewReference() hands out a RootHandle, a slot index plus the generation
+ *  the slot had when it was given out. The references themselves are kept
+ *  in a dense array that the collectors scan front to back. Every slot
+ *  knows where its reference sits in the dense array and every dense entry
+ *  knows its slot, so a root is removed by moving the last dense entry into
+ *  its place. Freed slots go on a free list and have their generation
+ *  bumped, so a handle to a root that has already ended is recognised as
+ *  stale instead of hitting whoever reuses the slot. Adding and removing a
+ *  root are O(1).
+ */
+
+#ifndef ROOTTABLE_H_
+#define ROOTTABLE_H_
+
+#include <vector>
+
+using namespace std;
+
+namespace gc_roots {
+
+struct RootHandle {
+	int index;
+	unsigned generation;
+};
+
+template <class Object>
+class RootTable {
+  public:
+    // Registers a root and returns its handle.
+    RootHandle Add(Object* obj) {
+    	int slot;
+    	if (free_slots.empty()) {
+    		slot = int(position.size());
+    		position.push_back(0);
+    		generation.push_back(0);
+    	} else {
+    		slot = free_slots.back();
+    		free_slots.pop_back();
+    	}
+    	position[slot] = int(refs.size());
+    	refs.push_back(obj);
+    	owner.push_back(slot);
+
+    	RootHandle h;
+    	h.index = slot;
+    	h.generation = generation[slot];
+    	return h;
+    }
+
+    // Ends a root. Stale handles are ignored.
+    void Remove(RootHandle h) {
+    	if (!Valid(h)) return;
+
+    	int pos = position[h.index];
+    	int last = int(refs.size()) - 1;
+    	refs[pos] = refs[last];
+    	owner[pos] = owner[last];
+    	position[owner[pos]] = pos;
+    	refs.pop_back();
+    	owner.pop_back();
+
+    	position[h.index] = -1;
+    	generation[h.index]++;
+    	free_slots.push_back(h.index);
+    }
+
+    // Whether the handle still names a live root.
+    bool Valid(RootHandle h) const {
+    	return h.index >= 0 && h.index < int(position.size()) &&
+    	       generation[h.index] == h.generation && position[h.index] >= 0;
+    }
+
+    // The object a root refers to, NULL for a stale handle.
+    Object* Get(RootHandle h) const {
+    	return Valid(h) ? refs[position[h.index]] : NULL;
+    }
+
+    void Set(RootHandle h, Object* obj) {
+    	if (Valid(h)) refs[position[h.index]] = obj;
+    }
+
+    // Handle of the root at dense position i.
+    RootHandle HandleAt(int i) const {
+    	RootHandle h;
+    	h.index = owner[i];
+    	h.generation = generation[owner[i]];
+    	return h;
+    }
+
+    // Vector-style access to the dense array, for the collectors' root
+    // scans. Writing through operator[] updates a root in place, as a
+    // moving collector does.
+    int size() const { return int(refs.size()); }
+    bool empty() const { return refs.empty(); }
+    Object*& operator[](int i) { return refs[i]; }
+    Object* operator[](int i) const { return refs[i]; }
+    Object*& back() { return refs.back(); }
+    void pop_back() { Remove(HandleAt(size() - 1)); }
+    const vector<Object*>& Refs() const { return refs; }
+
+    void clear() {
+    	while (!refs.empty()) pop_back();
+    }
+
+  private:
+    vector<Object*> refs;      // dense references, scanned by the collectors
+    vector<int> owner;         // slot of each dense entry
+    vector<int> position;      // dense position of each slot, -1 when free
+    vector<unsigned> generation;
+    vector<int> free_slots;
+};
+
+} // gc_roots
+
+#endif /* ROOTTABLE_H_ */
@@ -0,0 +1,185 @@
+/*
+ * safepoint.h
+ *
+ *  Stopping the mutator threads for a collection, shared by all three
+ *  collectors.
+ *
+ *  A thread that wants to use a collector alongside others attaches itself
+ *  as a mutator, with a root set of its own, and from then on polls for
+ *  safepoints: the collectors poll on every allocation, and a thread that
+ *  runs for a while without allocating calls Safepoint() itself. A thread
+ *  that wants to collect raises the request flag and waits until every
+ *  other attached thread has reached a poll and parked there. The
+ *  collection runs with the world stopped, and resuming lowers the flag and
+ *  wakes them up. The fast path of a poll reads the flag and nothing else.
+ *
+ *  How long the world took to stop (time-to-safepoint) is kept apart from
+ *  how long it then stayed stopped: a mutator that allocates waits for
+ *  both, but only the second is the collector's doing.
+ */
+
+#ifndef SAFEPOINT_H_
+#define SAFEPOINT_H_
+
+#include <iostream>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+
+using namespace std;
+
+namespace gc_safepoint {
+
+template <class Mutator>
+class Safepoints {
+  public:
+    Safepoints() : requested(false) {
+    	running = 0;
+    	depth = 0;
+    	stopper_attached = false;
+    	stops = 0;
+    	ttsp_total_us = 0;
+    	ttsp_max_us = 0;
+    	pause_total_us = 0;
+    	pause_max_us = 0;
+    	log_pauses = false;
+    }
+
+    // Attaches the calling thread. A thread that attaches while the world
+    // is stopped waits for it to be resumed first.
+    void Attach(Mutator* mutator) {
+    	unique_lock<mutex> guard(lock);
+    	while (requested) wakeup.wait(guard);
+    	threads.push_back(this_thread::get_id());
+    	mutators.push_back(mutator);
+    	running++;
+    }
+
+    // Detaches the calling thread, which stops counting towards a
+    // safepoint.
+    void Detach(Mutator* mutator) {
+    	lock_guard<mutex> guard(lock);
+    	int i = int(find(mutators.begin(), mutators.end(), mutator) - mutators.begin());
+    	if (i == int(mutators.size())) return;
+    	threads.erase(threads.begin() + i);
+    	mutators.erase(mutators.begin() + i);
+    	running--;
+    	wakeup.notify_all();
+    }
+
+    // Safepoint poll. Parks the thread if a collection is waiting for it.
+    void Poll() {
+    	if (requested.load(memory_order_acquire)) Park();
+    }
+
+    // Brings every other attached thread to a safepoint. False if another
+    // thread was collecting already; the caller has then waited for that
+    // collection instead, parked like at a poll. A thread that has stopped
+    // the world may stop it again, as long as it resumes it as often.
+    bool StopTheWorld() {
+    	unique_lock<mutex> guard(lock);
+    	thread::id self = this_thread::get_id();
+    	if (requested && depth > 0 && stopper == self) {
+    		depth++;
+    		return true;
+    	}
+    	bool attached = IsAttached(self);
+    	if (requested) {
+    		if (attached) running--;
+    		wakeup.notify_all();
+    		while (requested) wakeup.wait(guard);
+    		if (attached) running++;
+    		return false;
+    	}
+
+    	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    	requested = true;
+    	stopper = self;
+    	stopper_attached = attached;
+    	depth = 1;
+    	if (attached) running--;
+    	while (running > 0) wakeup.wait(guard);
+
+    	stopped_at = chrono::steady_clock::now();
+    	double ttsp = chrono::duration<double, micro>(stopped_at - start).count();
+    	stops++;
+    	ttsp_total_us += ttsp;
+    	ttsp_max_us = max(ttsp_max_us, ttsp);
+    	return true;
+    }
+
+    // Lets the parked threads go again.
+    void ResumeTheWorld() {
+    	lock_guard<mutex> guard(lock);
+    	if (--depth > 0) return;
+
+    	double pause = chrono::duration<double, micro>(chrono::steady_clock::now() - stopped_at).count();
+    	pause_total_us += pause;
+    	pause_max_us = max(pause_max_us, pause);
+    	if (log_pauses) pause_log.push_back(pause);
+    	if (stopper_attached) running++;
+    	requested = false;
+    	wakeup.notify_all();
+    }
+
+    // Shows, over every time the world was stopped, how long it took to
+    // stop and how long it stayed stopped.
+    void ShowStats() {
+    	cout << "Safepoints: " << stops << endl;
+    	cout << "Time to safepoint: " << (stops ? ttsp_total_us / stops : 0) << " us mean, "
+    	     << ttsp_max_us << " us max" << endl;
+    	cout << "Stopped: " << (stops ? pause_total_us / stops : 0) << " us mean, "
+    	     << pause_max_us << " us max" << endl << "------------------\n";
+    }
+
+    // The attached mutators. The collectors read their roots while the
+    // world is stopped.
+    vector <Mutator*> mutators;
+
+    long stops;
+    double ttsp_total_us;
+    double ttsp_max_us;
+    double pause_total_us;
+    double pause_max_us;
+
+    // With log_pauses set, every pause is also kept in pause_log, in
+    // microseconds, for percentiles.
+    bool log_pauses;
+    vector <double> pause_log;
+
+  private:
+    // Slow path of Poll(). Threads that are not attached are not waited
+    // for, so they do not park either, and neither does the thread that
+    // stopped the world.
+    void Park() {
+    	unique_lock<mutex> guard(lock);
+    	thread::id self = this_thread::get_id();
+    	if (!requested || stopper == self || !IsAttached(self)) return;
+    	running--;
+    	wakeup.notify_all();
+    	while (requested) wakeup.wait(guard);
+    	running++;
+    }
+
+    bool IsAttached(thread::id id) {
+    	return find(threads.begin(), threads.end(), id) != threads.end();
+    }
+
+    mutex lock;
+    condition_variable wakeup;
+    atomic<bool> requested;
+    vector <thread::id> threads;   // thread of each mutator
+    int running;                   // attached threads not parked
+    thread::id stopper;
+    bool stopper_attached;
+    int depth;
+    chrono::steady_clock::time_point stopped_at;
+};
+
+} // gc_safepoint
+
+#endif /* SAFEPOINT_H_ */
@@ -21,89 +21,760 @@
   The overhead of copying too much is a drawback. But it has the potential
   to free up a lot of memory with little overhead when there are many
   short-lived objects.
+
+  The copy follows Cheney: the roots are copied first, then to-space is
+  scanned breadth-first, left to right, copying whatever the scanned objects
+  point to. Each copied object leaves a forwarding pointer behind, so it is
+  copied only once and every later reference to it is redirected to the
+  copy. Survivors end up compacted at the bottom of to-space and allocation
+  is a pointer bump.
+
+  With several GC threads the copy is parallel. The threads split the roots
+  between them and copy into private allocation buffers (PLABs) carved out
+  of to-space, so they only contend when a buffer runs out. Whoever wins
+  the CAS on an object's forwarding pointer copies it; everyone else waits
+  for the copy's address. Copied objects that still need scanning go on the
+  copying thread's work-stealing deque, so idle threads can take over work.
+
+  Objects come in several types (see Types in the header), each with its
+  own size and reference fields. The copy looks the type up once per object
+  and then runs that type's own EachRef(), which visits exactly its
+  reference slots. Reference arrays are the exception in the parallel copy:
+  a long one is scanned ARRAYCHUNK elements at a time, and the array goes
+  back on the deque between chunks so other threads can help with it.
+
+  Several mutator threads can share the heap, each with roots of its own.
+  Allocation bumps the pointer under a lock, and a collection first brings
+  every mutator to a safepoint (see safepoint.h).
+
+  The heap need not have a fixed size. Both semispaces are reserved at the
+  largest size, and only the part below "limit" is allocated in; the limit
+  moves after a collection, or when an allocation does not fit, following
+  the policy in heap-sizing.h.
  */
 
+#include <new>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <utility>
+
 #include "sc-graph-api.h"
+#include "parallel-mark.h"
 
+// Heap size in bytes
 #ifndef SCHEAPSIZE
-#define SCHEAPSIZE 50
+#define SCHEAPSIZE 2800
+#endif
+
+#ifndef GCTHREADS
+#define GCTHREADS 1
+#endif
+
+// Objects per parallel allocation buffer
+#ifndef PLABSIZE
+#define PLABSIZE 256
+#endif
+
+// Elements of a reference array scanned per chunk in a parallel copy
+#ifndef ARRAYCHUNK
+#define ARRAYCHUNK 512
+#endif
+
+// A semispace is 1/COPYRESERVE larger than the heap, see ParallelCopy()
+#ifndef COPYRESERVE
+#define COPYRESERVE 4
 #endif
 
 namespace sc_graph_api {
 
+// Stands in for unused to-space, so to-space can still be walked object
+// by object. Its first word lines up with Object's type field.
+struct Filler {
+	int type;
+	int size;
+};
+
+const int FILLER = -1;
+
+// Bytes in one PLAB. Objects over a LARGEOBJECT are copied outside PLABs.
+const size_t PLABBYTES = PLABSIZE * sizeof(Object);
+const size_t LARGEOBJECT = PLABBYTES / 8;
+
+// Forwarding pointer of a large object that a GC thread is copying.
+Object* const BUSY = (Object*)1;
+
+// Bytes an object of "size" bytes takes: at least the header, and a whole
+// number of pointers.
+static size_t ObjectBytes(size_t size) {
+	if (size < sizeof(Object)) size = sizeof(Object);
+	return (size + sizeof(Object*) - 1) / sizeof(Object*) * sizeof(Object*);
+}
+
+// Bytes in one semispace: the heap proper plus the copy headroom.
+static size_t SpaceBytes(size_t max_bytes) {
+	return max_bytes + (max_bytes / COPYRESERVE) / sizeof(Object*) * sizeof(Object*);
+}
+
 // default constructor
 // initializes the state and heap size
 SCGraphUtil :: SCGraphUtil() {
 	state = 0;
-	max_objects = SCHEAPSIZE;
+	sizing.Bounds(SCHEAPSIZE, SCHEAPSIZE);
+	gc_threads = GCTHREADS;
+	plab_waste = 0;
+	typed_objects = false;
+	InitSpaces();
+}
+
+// Lets the user specify heap-size, in bytes
+SCGraphUtil :: SCGraphUtil(size_t heap_bytes) {
+	state = 0;
+	sizing.Bounds(heap_bytes, heap_bytes);
+	gc_threads = GCTHREADS;
+	plab_waste = 0;
+	typed_objects = false;
+	InitSpaces();
 }
 
-// Lets the user specify heap-size
-SCGraphUtil :: SCGraphUtil(int heap_size) {
+// A heap that starts at "min_bytes" and may grow to "max_bytes".
+SCGraphUtil :: SCGraphUtil(size_t min_bytes, size_t max_bytes) {
 	state = 0;
-	max_objects = heap_size;
+	sizing.Bounds(min_bytes, max_bytes);
+	gc_threads = GCTHREADS;
+	plab_waste = 0;
+	typed_objects = false;
+	InitSpaces();
+}
+
+// Destroys whatever is still allocated and releases both semispaces.
+SCGraphUtil :: ~SCGraphUtil() {
+	for (int i = 0; i < int(safepoints.mutators.size()); i++) {
+		delete safepoints.mutators[i];
+	}
+	Flush(space[state], top);
+	delete[] space[0];
+	delete[] space[1];
+}
+
+// Reserves the two semispaces at the largest heap size, with both bounds
+// rounded down to whole words, and starts the heap at the smallest.
+// Nothing is constructed in them until Allocate() or Copy() places an
+// object at the bump pointer.
+void SCGraphUtil :: InitSpaces() {
+	sizing.Bounds(sizing.min_bytes / sizeof(Object*) * sizeof(Object*),
+	              sizing.max_bytes / sizeof(Object*) * sizeof(Object*));
+	max_bytes = sizing.min_bytes;
+	space[0] = new char[SpaceBytes(sizing.max_bytes)];
+	space[1] = new char[SpaceBytes(sizing.max_bytes)];
+	top = space[state];
+	limit = space[state] + max_bytes;
 }
 
+// Bump-pointer allocation in the active semispace. Returns NULL when the
+// semispace is full.
+Object* SCGraphUtil :: Allocate(const string& desc) {
+	return Allocate(desc, sizeof(Object));
+}
+
+// The same for a plain object of "size" bytes, rounded up to whole
+// pointers so the object after it stays aligned.
+Object* SCGraphUtil :: Allocate(const string& desc, size_t size) {
+	size = ObjectBytes(size);
+	if (top + size > limit) return NULL;
+
+	Object* obj = new (top) Object(desc);
+	obj->size = int(size);
+	top += size;
+	if (size != sizeof(Object)) typed_objects = true;
+	return obj;
+}
+
+// Allocate() as the mutator threads do it: a safepoint poll, then the
+// pointer bump under the allocation lock.
+Object* SCGraphUtil :: LockedAllocate(const string& desc, size_t size) {
+	safepoints.Poll();
+	size = ObjectBytes(size);
+	char* p = BumpBytes(size);
+	if (p == NULL) return NULL;
+
+	Object* obj = new (p) Object(desc);
+	obj->size = int(size);
+	if (size != sizeof(Object)) typed_objects = true;
+	return obj;
+}
+
+// LockedAllocate() with room found by AllocateBytes(), collecting and
+// growing the heap as needed. NULL when not even the largest heap has
+// room.
+Object* SCGraphUtil :: CollectAndAllocate(const string& desc, size_t size) {
+	size = ObjectBytes(size);
+	char* p = AllocateBytes(size);
+	if (p == NULL) return NULL;
+
+	Object* obj = new (p) Object(desc);
+	obj->size = int(size);
+	if (size != sizeof(Object)) typed_objects = true;
+	return obj;
+}
+
+// Room for an object of "size" bytes. If the active semispace is too
+// full it is collected first, and if it still is the heap grows. Returns
+// NULL when not even the largest heap has room. Only roots survive the
+// collection with their addresses up to date.
+char* SCGraphUtil :: AllocateBytes(size_t size) {
+	safepoints.Poll();
+	char* p = BumpBytes(size);
+	if (p == NULL) {
+		TriggerGC(gc_events::HEAP_FULL);
+		p = BumpBytes(size);
+	}
+	if (p == NULL) p = GrowBytes(size);
+	if (p == NULL) OutOfMemory(size);
+	return p;
+}
+
+// Moves the bump pointer over "size" bytes under the allocation lock. NULL
+// when the active semispace is too full.
+char* SCGraphUtil :: BumpBytes(size_t size) {
+	lock_guard<mutex> guard(alloc_lock);
+	if (top + size > limit) return NULL;
+
+	char* p = top;
+	top += size;
+	return p;
+}
+
+// Grows the heap for "size" bytes and takes them, under the allocation
+// lock so no other thread takes the new room first. NULL once the heap is
+// at its largest.
+char* SCGraphUtil :: GrowBytes(size_t size) {
+	lock_guard<mutex> guard(alloc_lock);
+	size_t bytes = sizing.GrowFor(max_bytes, size) / sizeof(Object*) * sizeof(Object*);
+	if (bytes <= max_bytes) return NULL;
+	ResizeHeap(bytes);
+	if (top + size > limit) return NULL;
+
+	char* p = top;
+	top += size;
+	return p;
+}
+
+// An allocation of "size" bytes that did not fit the largest heap. The
+// sizer's oom_handler runs with the allocation lock held, so it may drop
+// roots but must not allocate.
+void SCGraphUtil :: OutOfMemory(size_t size) {
+	cout << "Error! Unable to allocate memory!\n";
+	lock_guard<mutex> guard(alloc_lock);
+	sizing.OutOfMemory(size);
+}
+
+// Sets the heap size to "bytes" by moving the limit of the active
+// semispace. Everything already in it stays below the limit.
+void SCGraphUtil :: ResizeHeap(size_t bytes) {
+	sizing.Resized(max_bytes, bytes);
+	max_bytes = bytes;
+	limit = space[state] + max_bytes;
+}
+
+// Allocates an array of "length" references, all NULL.
+RefArray* SCGraphUtil :: NewArray(const string& desc, int length) {
+	size_t size = sizeof(RefArray) + length * sizeof(Object*);
+	char* p = AllocateBytes(size);
+	if (p == NULL) return NULL;
+
+	RefArray* array = new (p) RefArray(desc, length);
+	array->size = int(size);
+	array->type = Types::Id<RefArray>();
+	typed_objects = true;
+	return array;
+}
+
+// Copies one object to to-space at "free" and leaves a forwarding pointer
+// in the original. An object that has already been copied is not copied
+// again, its forwarding pointer is returned instead. The copy's child still
+// points into from-space until the scan reaches it.
+Object* SCGraphUtil :: Copy(Object* obj, char*& free) {
+	if (obj == NULL) return NULL;
+	if (obj->forward != NULL) return obj->forward;
+
+	size_t size = Types::Size(obj);
+	Object* copy = Types::CopyTo(obj, free);
+	free += size;
+	obj->forward = copy;
+	return copy;
+}
+
+// Copies what one reference slot of a scanned object points to and
+// redirects the slot to the copy.
+struct CheneyVisitor {
+	SCGraphUtil* gc;
+	char*& free;
+
+	CheneyVisitor(SCGraphUtil* collector, char*& to) : gc(collector), free(to) {}
+
+	void operator()(Object*& slot) {
+		slot = gc->Copy(slot, free);
+	}
+};
+
+// Stops every mutator thread at a safepoint and collects. If another
+// thread was collecting already, its collection stands in for this one.
 void SCGraphUtil :: TriggerGC() {
-	for(int i = 0; i < (int)roots.size(); i++) {
-		(state == 0) ? DFSCopy(roots[i], h1) : DFSCopy(roots[i], h0);
+	TriggerGC(gc_events::EXPLICIT);
+}
+
+// TriggerGC() for "cause", one of the causes in gc-events.h, which the
+// event log records with the collection.
+void SCGraphUtil :: TriggerGC(int cause) {
+	if (!safepoints.StopTheWorld()) return;
+	events.Begin(cause, gc_events::FULL_HEAP);
+	if (events.On()) events.Before(NumObjects(), UsedBytes());
+	Collect();
+	if (events.On()) events.After(NumObjects(), UsedBytes());
+	events.End();
+	safepoints.ResumeTheWorld();
+}
+
+// Number of objects in the active semispace, live or not, found by
+// walking it past the fillers.
+long SCGraphUtil :: NumObjects() {
+	long n = 0;
+	char* p = space[state];
+	while (p < top) {
+		Filler* filler = (Filler*)p;
+		if (filler->type == FILLER) {
+			p += filler->size;
+			continue;
+		}
+		p += Types::Size((Object*)p);
+		n++;
 	}
-	(state == 0) ? Flush(h0) : Flush(h1);
+	return n;
+}
+
+// Bytes taken by objects in the active semispace, the PLAB tails of the
+// last parallel copy left out.
+size_t SCGraphUtil :: UsedBytes() {
+	return size_t(top - space[state]) - plab_waste;
+}
+
+// The addresses of every root reference: the collector's roots, and each
+// mutator's roots and held parent.
+void SCGraphUtil :: RootSlots(vector <Object**>& slots) {
+	for (int i = 0; i < roots.size(); i++) {
+		slots.push_back(&roots[i]);
+	}
+	for (int m = 0; m < int(safepoints.mutators.size()); m++) {
+		Mutator* mutator = safepoints.mutators[m];
+		for (int i = 0; i < mutator->roots.size(); i++) {
+			slots.push_back(&mutator->roots[i]);
+		}
+		slots.push_back(&mutator->held);
+	}
+}
+
+// The collection proper, with the world stopped: a serial or parallel
+// copy, after which the heap is resized for what survived. Everything left
+// in the active semispace is live, so the copy itself measures it.
+void SCGraphUtil :: Collect() {
+	sizing.StartCollection();
+	// A heap with typed objects is copied in parallel only when it is large
+	// enough for the copy headroom to cover the threads' open PLABs.
+	if (gc_threads > 1 &&
+	    (!typed_objects || gc_threads * PLABBYTES * 10 <= max_bytes)) {
+		ParallelCopy();
+	} else {
+		CheneyCopy();
+	}
+
+	size_t live = size_t(top - space[state]);
+	size_t bytes = sizing.AfterCollection(max_bytes, live) / sizeof(Object*) * sizeof(Object*);
+	if (bytes != max_bytes) ResizeHeap(max(bytes, min(live, sizing.max_bytes)));
+}
+
+// Cheney copy of everything reachable from the roots into the inactive
+// semispace. "scan" chases "free" through to-space; objects between the two
+// have been copied but their children have not. When they meet, every live
+// object has been copied and all references point into to-space.
+void SCGraphUtil :: CheneyCopy() {
+	char* to = space[!state];
+	char* scan = to;
+	char* free = to;
+
+	CheneyVisitor visitor(this, free);
+
+	vector <Object**> slots;
+	RootSlots(slots);
+	for (int i = 0; i < int(slots.size()); i++) {
+		*slots[i] = Copy(*slots[i], free);
+	}
+	events.Phase(gc_events::ROOTS);
+	while (scan < free) {
+		Object* obj = (Object*)scan;
+		Types::Trace(obj, visitor);
+		scan += Types::Size(obj);
+	}
+
+	Flush(space[state], top);
+	events.Phase(gc_events::COPY);
 	state = !state;
+	top = free;
+	limit = to + max_bytes;
+	plab_waste = 0;
 }
 
-void SCGraphUtil :: DFSCopy(Object* root, vector<Object*> &to) {
-	if (root == NULL) return;
+// The state of one parallel collection: the shared to-space bump pointer
+// that PLABs are carved from, and per thread its PLAB, its deque of copied
+// objects still to be scanned and its statistics.
+class ParallelCopier {
+  public:
+    ParallelCopier(char* to, char* end, int threads, bool mixed)
+      : deques(threads), plab_top(threads, (char*)NULL), plab_end(threads, (char*)NULL),
+        copied(threads, 0) {
+    	num_threads = threads;
+    	mixed_sizes = mixed;
+    	to_top = to;
+    	to_end = end;
+    	active = threads;
+    }
+
+    // Claims "obj" by swapping BUSY into its forwarding pointer, then copies
+    // it and publishes the copy there. A thread that loses the claim waits
+    // for the winner's copy, so every object is copied exactly once. Small
+    // objects go in the thread's PLAB, large ones get room of their own.
+    Object* Copy(int id, Object* obj) {
+    	if (obj == NULL) return NULL;
+
+    	Object* fwd = Forwarded(obj);
+    	if (fwd != NULL) return fwd;
+    	if (!__atomic_compare_exchange_n(&obj->forward, &fwd, BUSY, false,
+    	                                 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    		return Forwarded(obj);
+    	}
+
+    	size_t size = Types::Size(obj);
+    	char* to;
+    	if (size > LARGEOBJECT) {
+    		pair<char*, char*> room = Carve(size, size);
+    		if (room.second > room.first + size) {
+    			Spare(room.first + size, room.second);
+    		}
+    		to = room.first;
+    	} else {
+    		to = PlabAllocate(id, size);
+    	}
+    	Object* copy = Types::CopyTo(obj, to);
+    	__atomic_store_n(&obj->forward, copy, __ATOMIC_RELEASE);
+    	copied[id] += size;
+    	deques[id].Push(copy);
+    	return copy;
+    }
+
+    // Copies the objects a copied object refers to. A reference array
+    // longer than a chunk is scanned one claimed chunk at a time, and goes
+    // back on the deque first while chunks are left, so a thief can take
+    // the next chunk. Its header fields are scanned with the first chunk.
+    void Scan(int id, Object* obj) {
+    	CopyVisitor visitor(this, id);
+    	if (obj->type != Types::Id<RefArray>()) {
+    		Types::Trace(obj, visitor);
+    		return;
+    	}
+
+    	RefArray* array = (RefArray*)obj;
+    	int begin = __atomic_fetch_add(&array->scan_next, ARRAYCHUNK, __ATOMIC_RELAXED);
+    	if (begin >= array->length) return;
+    	int end = min(begin + ARRAYCHUNK, array->length);
+    	if (end < array->length) deques[id].Push(array);
+    	if (begin == 0) array->Object::EachRef(visitor);
+    	array->EachElement(visitor, begin, end);
+    }
+
+    // Worker "id" copies its share of the roots, then scans copied objects
+    // until every deque is empty, stealing when its own runs dry. A thread
+    // that goes idle gives the rest of its PLAB back for others to use.
+    void Work(int id, vector<Object**>& roots) {
+    	for (int i = id; i < int(roots.size()); i += num_threads) {
+    		*roots[i] = Copy(id, *roots[i]);
+    	}
+
+    	Object* obj;
+    	while (true) {
+    		while (deques[id].Pop(obj) || StealFrom(id, obj)) {
+    			Scan(id, obj);
+    		}
+
+    		GiveBack(id);
+    		active.fetch_sub(1);
+    		bool found = false;
+    		while (!found) {
+    			if (active.load() == 0) return;
+    			if (AnyWork()) {
+    				active.fetch_add(1);
+    				if (StealFrom(id, obj)) {
+    					Scan(id, obj);
+    					found = true;
+    				} else {
+    					active.fetch_sub(1);
+    				}
+    			}
+    			if (!found) this_thread::yield();
+    		}
+    	}
+    }
+
+    // Covers the PLAB tails nobody used with fillers, so to-space can still
+    // be walked object by object, and returns the new top of to-space.
+    // "waste" receives the number of filler bytes.
+    char* Retire(long& waste) {
+    	for (int id = 0; id < num_threads; id++) {
+    		GiveBack(id);
+    	}
+    	waste = 0;
+    	for (int i = 0; i < int(spare.size()); i++) {
+    		Filler* filler = (Filler*)spare[i].first;
+    		filler->type = FILLER;
+    		filler->size = int(spare[i].second - spare[i].first);
+    		waste += filler->size;
+    	}
+    	char* top = to_top.load();
+    	return (top < to_end) ? top : to_end;
+    }
+
+    vector< gc_parallel::WorkStealingDeque<Object*> > deques;
+    vector <char*> plab_top;
+    vector <char*> plab_end;
+    vector <long> copied;
+
+  private:
+    // Copies what one reference slot points to on behalf of thread "id".
+    struct CopyVisitor {
+    	ParallelCopier* copier;
+    	int id;
+
+    	CopyVisitor(ParallelCopier* c, int thread) : copier(c), id(thread) {}
+
+    	void operator()(Object*& slot) {
+    		slot = copier->Copy(id, slot);
+    	}
+    };
+
+    // The copy of an object, waiting while another thread is copying it.
+    // NULL if it has not been copied.
+    Object* Forwarded(Object* obj) {
+    	Object* fwd = __atomic_load_n(&obj->forward, __ATOMIC_ACQUIRE);
+    	while (fwd == BUSY) {
+    		this_thread::yield();
+    		fwd = __atomic_load_n(&obj->forward, __ATOMIC_ACQUIRE);
+    	}
+    	return fwd;
+    }
+
+    // Bump allocation of "size" bytes in the thread's PLAB. A PLAB too
+    // small for the object is given back and replaced. When all objects
+    // have one size, refills shrink as to-space runs low so the tails left
+    // in other threads' PLABs stay small. With mixed sizes they stay at
+    // PLABBYTES: an object that does not fit is at most LARGEOBJECT, so a
+    // PLAB is at least 7/8 used when it is given back.
+    char* PlabAllocate(int id, size_t size) {
+    	if (size_t(plab_end[id] - plab_top[id]) < size) {
+    		GiveBack(id);
+    		long bytes = PLABBYTES;
+    		if (!mixed_sizes) {
+    			long left = to_end - to_top.load();
+    			long objects = left / long(sizeof(Object)) / (8 * num_threads);
+    			if (objects < long(PLABSIZE)) bytes = max(objects, 1L) * sizeof(Object);
+    		}
+    		pair<char*, char*> room = Carve(bytes, size);
+    		plab_top[id] = room.first;
+    		plab_end[id] = room.second;
+    	}
+    	char* p = plab_top[id];
+    	plab_top[id] += size;
+    	return p;
+    }
+
+    // Takes "bytes" of to-space with one atomic add on the shared pointer,
+    // or less at the very end of to-space, but never less than "least".
+    // Once to-space is carved up, the thread takes a tail big enough from
+    // those given back by idle threads, waiting for one if need be. With
+    // one object size live data never exceeds to-space, so a tail always
+    // turns up; with mixed sizes the copy headroom sees to it that to-space
+    // is not carved up in the first place.
+    pair<char*, char*> Carve(size_t bytes, size_t least) {
+    	while (true) {
+    		if (to_top.load() < to_end) {
+    			char* start = to_top.fetch_add(bytes);
+    			char* end = (start + bytes < to_end) ? start + bytes : to_end;
+    			if (size_t(end - start) >= least) return make_pair(start, end);
+    			if (start < end) Spare(start, end);
+    		}
+
+    		pair<char*, char*> room(NULL, NULL);
+    		spare_lock.lock();
+    		for (int i = 0; i < int(spare.size()); i++) {
+    			if (size_t(spare[i].second - spare[i].first) >= least) {
+    				room = spare[i];
+    				spare[i] = spare.back();
+    				spare.pop_back();
+    				break;
+    			}
+    		}
+    		spare_lock.unlock();
+    		if (room.first != NULL) return room;
+    		this_thread::yield();
+    	}
+    }
+
+    // Returns the unused rest of a thread's PLAB to the spare list.
+    void GiveBack(int id) {
+    	if (plab_top[id] != plab_end[id]) Spare(plab_top[id], plab_end[id]);
+    	plab_top[id] = plab_end[id] = NULL;
+    }
+
+    void Spare(char* start, char* end) {
+    	spare_lock.lock();
+    	spare.push_back(make_pair(start, end));
+    	spare_lock.unlock();
+    }
+
+    bool StealFrom(int id, Object*& obj) {
+    	for (int i = 1; i < num_threads; i++) {
+    		if (deques[(id + i) % num_threads].Steal(obj)) return true;
+    	}
+    	return false;
+    }
+
+    bool AnyWork() {
+    	for (int i = 0; i < num_threads; i++) {
+    		if (!deques[i].Empty()) return true;
+    	}
+    	return false;
+    }
+
+    int num_threads;
+    bool mixed_sizes;
+    atomic<char*> to_top;
+    char* to_end;
+    atomic<int> active;
+    mutex spare_lock;
+    vector< pair<char*, char*> > spare;
+};
+
+// Parallel counterpart of TriggerGC(). The calling thread works as GC
+// thread 0 next to gc_threads - 1 helpers.
+//
+// With objects of one size every PLAB tail fits the next object, so
+// to-space always holds the live data. With mixed sizes a tail can be too
+// small for what comes next and stays unused, at most 1/7 of what its PLAB
+// holds. The copy may then run into the headroom above the heap limit,
+// which is big enough for that waste and the threads' open PLABs.
+void SCGraphUtil :: ParallelCopy() {
+	char* to = space[!state];
+	char* to_end = to + SpaceBytes(max_bytes);
+	ParallelCopier copier(to, to_end, gc_threads, typed_objects);
+	vector <Object**> slots;
+	RootSlots(slots);
+
+	vector<thread> workers;
+	for (int id = 1; id < gc_threads; id++) {
+		workers.push_back(thread(&ParallelCopier::Work, &copier, id, ref(slots)));
+	}
+	copier.Work(0, slots);
+	for (int i = 0; i < int(workers.size()); i++) {
+		workers[i].join();
+	}
+
+	char* free = copier.Retire(plab_waste);
+	copied_bytes.resize(gc_threads);
+	for (int id = 0; id < gc_threads; id++) {
+		copied_bytes[id] = copier.copied[id];
+	}
 
-	to.push_back(root);
-	DFSCopy(root->child, to);
+	Flush(space[state], top);
+	events.Phase(gc_events::COPY);
+	state = !state;
+	top = free;
+	limit = to + max_bytes;
 }
 
-// All the elements of the heap are dropped, the destructors of the objects are
-// called and we retain the heap (vector) of size 0. Hence freeing the heap.
-void SCGraphUtil :: Flush(vector <Object*>& v) {
-	v.clear();
+// Every object left in from-space is dead or has been copied. The
+// destructors are run and the whole region becomes free again in one go.
+void SCGraphUtil :: Flush(char* base, char* end) {
+	char* p = base;
+	while (p < end) {
+		Filler* filler = (Filler*)p;
+		if (filler->type == FILLER) {
+			p += filler->size;
+			continue;
+		}
+		Object* obj = (Object*)p;
+		p += Types::Size(obj);
+		Types::Destroy(obj);
+	}
 }
 
 
-// Displays the total memory used and the free memory.
+// Shows the heap size and how it has been resized.
+void SCGraphUtil :: ShowSizingStats() {
+	sizing.ShowStats(max_bytes);
+}
+
+// Displays the memory used and free, in bytes. Objects are laid out back
+// to back, rounded up to whole pointers at most, so there is no internal
+// fragmentation to speak of; the external fragmentation is the share of
+// the free memory lost in the tails of the last parallel copy's PLABs,
+// which nothing can use until the next collection.
 void SCGraphUtil :: ShowMemoryUsage() {
-	cout << "Used Memory: " << ((state == 0) ? h0.size() : h1.size()) << endl;
-	cout << "Free Memory: " << max_objects - ((state == 0) ? h0.size() : h1.size()) << endl << "------------------\n";
+	long used = long(UsedBytes());
+	long free = long(max_bytes) - used;
+	cout << "Used Memory: " << used << " bytes" << endl;
+	cout << "Free Memory: " << free << " bytes" << endl;
+	cout << "Internal fragmentation: 0%" << endl;
+	cout << "External fragmentation: "
+	     << (free ? 100.0 * plab_waste / free : 0) << "%" << endl << "------------------\n";
+}
+
+
+// Reports, for the last parallel collection, the bytes each GC thread
+// copied, the load imbalance (busiest thread over the mean, 1.0 is a
+// perfect split) and the to-space lost to partly used PLABs.
+void SCGraphUtil :: ShowCopyStats() {
+	long total = 0, busiest = 0;
+	for (int id = 0; id < int(copied_bytes.size()); id++) {
+		cout << "GC thread " << id << " copied: " << copied_bytes[id] << " bytes" << endl;
+		total += copied_bytes[id];
+		if (copied_bytes[id] > busiest) busiest = copied_bytes[id];
+	}
+	double mean = copied_bytes.empty() ? 0 : double(total) / copied_bytes.size();
+	cout << "Load imbalance: " << (mean > 0 ? busiest / mean : 0) << endl;
+	cout << "PLAB waste: " << plab_waste << " bytes" << endl << "------------------\n";
 }
 
 
 // Creates a new reference object. Object* obj = new Object();. Essentially,
-// creates an object in the heap and a reference in the roots vector.
-void SCGraphUtil :: NewReference(const string& desc) {
-    int num_objects = (int)((state == 0) ? h0.size() : h1.size());
+// creates an object in the heap and a reference in the root table, and
+// returns the root's handle (an invalid one if the heap is full).
+gc_roots::RootHandle SCGraphUtil :: NewReference(const string& desc) {
+	return NewReference(desc, sizeof(Object));
+}
 
-    // if the heap is full, then we call TriggerGC() to free up some space.
-    if (num_objects == max_objects) {
-        TriggerGC();
-    }
-    
-    num_objects = (int)((state == 0) ? h0.size() : h1.size());
-    
-    if (num_objects == 0) {
-        num_objects++;
-        Object* obj = new Object(desc);
-        roots.push_back(obj);
-        (state == 0) ? h0.push_back(obj) : h1.push_back(obj);
-     } else if (num_objects < max_objects) {
-  	    num_objects++;
-	    Object* obj = new Object(desc);
-	    roots.push_back(obj);
-	    (state == 0) ? h0.push_back(obj) : h1.push_back(obj);
-	 } else {
-	    cout << "Error! Unable to allocate memory!\n";
+// The same for an object of "size" bytes.
+gc_roots::RootHandle SCGraphUtil :: NewReference(const string& desc, size_t size) {
+    Object* obj = CollectAndAllocate(desc, size);
+    if (obj != NULL) {
+	    return roots.Add(obj);
     }
+    gc_roots::RootHandle none = { -1, 0 };
+    return none;
 }
 
 // Creating a new reference and making it point to an existing object
 // Object *obj = x;
-void SCGraphUtil :: NewReference(Object* obj) {
-	roots.push_back(obj);
+gc_roots::RootHandle SCGraphUtil :: NewReference(Object* obj) {
+	return roots.Add(obj);
 }
 
 // New object that would be pointed to by an existing pointer.
@@ -111,27 +782,27 @@ void SCGraphUtil :: NewReference(Object* obj) {
 // a self-referencing object, like a binary tree structure or a
 // linked-list.
 Object* SCGraphUtil :: New(const string& desc, Object* parent) {
-    Object* obj = NULL;
-    
-    int num_objects = (int)((state == 0) ? h0.size() : h1.size());
-	if (num_objects == max_objects) {
-		TriggerGC();
+	return New(desc, parent, sizeof(Object));
+}
+
+// The same for an object of "size" bytes.
+Object* SCGraphUtil :: New(const string& desc, Object* parent, size_t size) {
+	if (parent == NULL) {
+		cout << "Error! New() needs a parent object!\n";
+		return NULL;
+	}
+	// The parent is held as a temporary root across the collection, so it
+	// survives and we pick up its new address.
+	Object* obj = LockedAllocate(desc, size);
+	if (obj == NULL) {
+		gc_roots::RootHandle held = roots.Add(parent);
+		obj = CollectAndAllocate(desc, size);
+		parent = roots.Get(held);
+		roots.Remove(held);
     }
     
-    num_objects = (int)((state == 0) ? h0.size() : h1.size());
-    
-    if (num_objects == 0) {
-    	num_objects++;
-    	obj = new Object(desc);
-    	(state == 0) ? h0.push_back(obj) : h1.push_back(obj);
-    	parent->child = obj;
-    } else if (num_objects < max_objects) {
-	num_objects++;
-	obj = new Object(desc);
-	(state == 0) ? h0.push_back(obj) : h1.push_back(obj);
+    if (obj != NULL) {
 	parent->child = obj;
-    } else {
-        cout << "Error! Unable to allocate memory!\n";
     }
     
     return obj;
@@ -139,15 +810,58 @@ Object* SCGraphUtil :: New(const string& desc, Object* parent) {
 
 // Getting rid of the root reference. This is typically when a pointer
 // falls out of scope causing a memory leak.
-void SCGraphUtil :: EndLifetime(Object* obj) {
-    int pos = -1;
-    for (int i = 0; i < int(roots.size()); i++) {
-        if (roots[i] == obj) {
-            pos = i;
-            break;
-        }
-    }
-    if (pos != -1) roots.erase(roots.begin() + pos);
+void SCGraphUtil :: EndLifetime(gc_roots::RootHandle reference) {
+	roots.Remove(reference);
+}
+
+// New() for a mutator thread. The parent is kept in the mutator's "held"
+// slot from before the safepoint poll until the object is linked in, since
+// any collection in between may move it.
+Object* SCGraphUtil :: New(const string& desc, Object* parent, Mutator* mutator) {
+	if (parent == NULL) {
+		cout << "Error! New() needs a parent object!\n";
+		return NULL;
+	}
+	mutator->held = parent;
+	Object* obj = LockedAllocate(desc, sizeof(Object));
+	if (obj == NULL) obj = CollectAndAllocate(desc, sizeof(Object));
+	parent = mutator->held;
+	mutator->held = NULL;
+
+	if (obj != NULL) {
+		parent->child = obj;
+	}
+	return obj;
+}
+
+// NewReference() for a mutator thread, the root going into its own root
+// set.
+gc_roots::RootHandle SCGraphUtil :: NewReference(const string& desc, Mutator* mutator) {
+	Object* obj = CollectAndAllocate(desc, sizeof(Object));
+	if (obj != NULL) {
+		return mutator->roots.Add(obj);
+	}
+	gc_roots::RootHandle none = { -1, 0 };
+	return none;
+}
+
+// Attaches the calling thread as a mutator, with an empty root set.
+Mutator* SCGraphUtil :: AttachMutator() {
+	Mutator* mutator = new Mutator();
+	safepoints.Attach(mutator);
+	return mutator;
+}
+
+// Detaches a mutator thread; its roots end with it.
+void SCGraphUtil :: DetachMutator(Mutator* mutator) {
+	safepoints.Detach(mutator);
+	delete mutator;
+}
+
+// Safepoint poll for a mutator thread that goes a long way without
+// allocating.
+void SCGraphUtil :: Safepoint() {
+	safepoints.Poll();
 }
 
 } // sc_graph_api
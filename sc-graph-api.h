@@ -12,28 +12,158 @@
 
 #include <iostream>
 #include <vector>
+#include <string>
+#include <new>
+#include <cstring>
+#include <mutex>
+#include "root-table.h"
+#include "gc-types.h"
+#include "safepoint.h"
+#include "heap-sizing.h"
+#include "gc-events.h"
 
 using namespace std;
 
 namespace sc_graph_api {
 
+// The header of every object in the heap, followed by size -
+// sizeof(Object) bytes of raw payload that the collector never looks at.
+// Plain Objects are type 0; the other types below derive from it and
+// describe their reference fields (see gc-types.h). The type and size
+// fields come first and line up with a filler's, so the collector can
+// tell an object from a filler by the first word.
 class Object {
 public:
   
-  Object* next;
+  int type;         // index in Types
+  int size;         // bytes taken, header included, in whole pointers
+  Object* forward;  // set once the object has been copied to to-space
   Object* child;
   string desc;
   
   Object() {
+      type = 0;
+      size = sizeof(Object);
+      forward = NULL;
 	  child = NULL;
       desc = "";
   }
 
   Object (const string& description) {
+      type = 0;
+      size = sizeof(Object);
+      forward = NULL;
   	child = NULL;
   	desc = description;
   }
 
+  // A copy starts out unforwarded. The original's forwarding pointer is
+  // never read, since other GC threads may be racing to set it.
+  Object (const Object& other) {
+      type = other.type;
+      size = other.size;
+      forward = NULL;
+  	child = other.child;
+  	desc = other.desc;
+  }
+
+  char* Payload() { return (char*)(this + 1); }
+
+  size_t Size() const { return size; }
+
+  Object* CopyTo(void* to) {
+      Object* copy = new (to) Object(*this);
+      memcpy(copy->Payload(), Payload(), size - sizeof(Object));
+      return copy;
+  }
+
+  template <class V>
+  void EachRef(V& v) {
+      v(child);
+  }
+
+};
+
+// An object with REFS reference fields on top of child, and BYTES bytes of
+// raw payload the collector never looks at.
+template <int REFS, int BYTES>
+class Record : public Object {
+public:
+
+  Object* refs[REFS];
+  char payload[BYTES];
+
+  Record (const string& description) : Object(description) {
+      for (int i = 0; i < REFS; i++) refs[i] = NULL;
+      memset(payload, 0, BYTES);
+  }
+
+  Object* CopyTo(void* to) { return new (to) Record(*this); }
+
+  template <class V>
+  void EachRef(V& v) {
+      v(child);
+      for (int i = 0; i < REFS; i++) v(refs[i]);
+  }
+
+};
+
+// Binary tree node: refs[0] and refs[1] are the subtrees, the payload a key.
+typedef Record<2, 8> TreeNode;
+// Hash map entry: child is the next entry in the bucket, refs[0] the value,
+// the payload the key.
+typedef Record<1, 16> MapEntry;
+
+// An array of "length" references stored right after the header. A long
+// array is scanned in chunks that GC threads claim one at a time from
+// scan_next, the first element nobody has claimed yet.
+class RefArray : public Object {
+public:
+
+  int length;
+  int scan_next;
+
+  RefArray (const string& description, int n) : Object(description) {
+      length = n;
+      scan_next = 0;
+      for (int i = 0; i < n; i++) Elems()[i] = NULL;
+  }
+
+  Object** Elems() { return (Object**)(this + 1); }
+
+  Object* CopyTo(void* to) {
+      RefArray* copy = new (to) RefArray(*this);
+      memcpy(copy->Elems(), Elems(), length * sizeof(Object*));
+      copy->scan_next = 0;
+      return copy;
+  }
+
+  template <class V>
+  void EachRef(V& v) {
+      v(child);
+      EachElement(v, 0, length);
+  }
+
+  template <class V>
+  void EachElement(V& v, int begin, int end) {
+      Object** elems = Elems();
+      for (int i = begin; i < end; i++) v(elems[i]);
+  }
+
+};
+
+// Every type the heap can hold. A new type is added here.
+typedef gc_types::TypeList<Object, Object, TreeNode, MapEntry, RefArray> Types;
+
+// A mutator thread attached to the collector, with roots of its own, and
+// "held", the parent that New() keeps across a collection for it.
+class Mutator {
+  public:
+    gc_roots::RootTable <Object> roots;
+    Object* held;
+    Mutator() {
+    	held = NULL;
+    }
 };
 
 class SCGraphUtil {
@@ -41,37 +171,132 @@ class SCGraphUtil {
     
     // constructors
     SCGraphUtil();
-    SCGraphUtil(int heap_size);
+    SCGraphUtil(size_t heap_bytes);
+    SCGraphUtil(size_t min_bytes, size_t max_bytes);
+    ~SCGraphUtil();
     
     // utility data members:
     // state explains which is the active and inactive heap
-    // max_objects is the heap size.
+    // max_bytes is the heap size as it is now.
     bool state;
-    int max_objects;
+    size_t max_bytes;
+
+    // The heap size moves between the bounds in "sizing" (see
+    // heap-sizing.h): it is checked after every collection, and grown when
+    // an allocation does not fit after one.
+    gc_sizing::HeapSizer sizing;
+
+    // Every collection is logged here once the log is enabled (see
+    // gc-events.h). Counting the objects takes a walk of the active
+    // semispace, which is only done with the log on.
+    gc_events::EventLog events;
+
+    // List of all the roots. A collection moves objects, so these are the
+    // only references the collector updates; other pointers held by the
+    // caller go stale across a TriggerGC().
+    gc_roots::RootTable <Object> roots;
+
+    // Mutator threads. With threads attached, every thread using the heap
+    // has to be one of them, and the root table above belongs to whichever
+    // thread is not. The bump pointer moves under alloc_lock, and
+    // TriggerGC() stops every mutator at a safepoint. A mutator's roots are
+    // updated like the others; any other pointer it holds goes stale across
+    // a safepoint, its own allocations included.
+    gc_safepoint::Safepoints <Mutator> safepoints;
+    mutex alloc_lock;
 
-    // List of all the roots
-    vector <Object*> roots;
+    // The two semispaces, each reserved with room for sizing.max_bytes of
+    // objects plus some headroom for parallel copies (see ParallelCopy()). One is the
+    // active component and the other the inactive component. Objects of any
+    // type are bump-allocated in space[state] at "top", which never passes
+    // "limit".
+    char* space[2];
+    char* top;
+    char* limit;
 
-    // The two heaps, one which is the active component and the
-    // other is the inactive component.
-    vector <Object*> h0;
-    vector <Object*> h1;
+    // Number of GC threads copying in parallel, 1 for the serial Cheney
+    // copy. After a parallel collection, copied_bytes holds what each
+    // thread copied and plab_waste the to-space left unused in the tails
+    // of the threads' allocation buffers.
+    int gc_threads;
+    vector <long> copied_bytes;
+    long plab_waste;
+
+    // Set once anything but a header-only plain Object has been allocated.
+    // Objects then differ in size, which the parallel copy has to allow
+    // for.
+    bool typed_objects;
 
     // Utility functions
-	  void DFSCopy(Object* root, vector<Object*> &to);
-	  void Flush(vector<Object*> &v);
+	  void InitSpaces();
+	  Object* Allocate(const string& desc);
+	  Object* Allocate(const string& desc, size_t size);
+	  Object* LockedAllocate(const string& desc, size_t size);
+	  Object* CollectAndAllocate(const string& desc, size_t size);
+	  char* AllocateBytes(size_t size);
+	  char* BumpBytes(size_t size);
+	  char* GrowBytes(size_t size);
+	  void OutOfMemory(size_t size);
+	  Object* Copy(Object* obj, char*& free);
+	  void Flush(char* base, char* end);
 	  void TriggerGC();
+	  void TriggerGC(int cause);
+	  long NumObjects();
+	  size_t UsedBytes();
+	  void Collect();
+	  void RootSlots(vector <Object**>& slots);
+	  void CheneyCopy();
+	  void ParallelCopy();
+	  void ResizeHeap(size_t bytes);
 	  void ShowMemoryUsage();
+	  void ShowCopyStats();
+	  void ShowSizingStats();
 
     // Functions dealing with memory allocation and references falling
-    // out of scope
+    // out of scope. "size" is the size of the object in bytes, header
+    // included, rounded up to whole pointers; without it an object is just
+    // the header.
   	Object* New(const string& desc, Object* parent);
-	  void NewReference(const string& desc);
-	  void NewReference(Object* obj);
-	  void EndLifetime(Object* reference);
+  	Object* New(const string& desc, Object* parent, size_t size);
+	  gc_roots::RootHandle NewReference(const string& desc);
+	  gc_roots::RootHandle NewReference(const string& desc, size_t size);
+	  gc_roots::RootHandle NewReference(Object* obj);
+	  void EndLifetime(gc_roots::RootHandle reference);
+
+    // The same for mutator threads, which attach and detach themselves.
+    // Safepoint() is the explicit safepoint poll.
+  	Object* New(const string& desc, Object* parent, Mutator* mutator);
+	  gc_roots::RootHandle NewReference(const string& desc, Mutator* mutator);
+	  Mutator* AttachMutator();
+	  void DetachMutator(Mutator* mutator);
+	  void Safepoint();
+
+    // Typed objects. These collect first if the object does not fit, then
+    // grow the heap, and return NULL if it still does not. Fields are set by the caller; the
+    // same warning applies as for roots, a collection leaves pointers that
+    // are not held in the root table stale.
+	  template <class T>
+	  T* NewObject(const string& desc);
+	  RefArray* NewArray(const string& desc, int length);
 
+  private:
+    // the semispaces are owned by the collector, so it cannot be copied
+    SCGraphUtil(const SCGraphUtil&);
+    SCGraphUtil& operator=(const SCGraphUtil&);
 };
 
+template <class T>
+T* SCGraphUtil :: NewObject(const string& desc) {
+	char* p = AllocateBytes(sizeof(T));
+	if (p == NULL) return NULL;
+
+	T* obj = new (p) T(desc);
+	obj->size = int(sizeof(T));
+	obj->type = Types::Id<T>();
+	typed_objects = true;
+	return obj;
+}
+
 } // sc_graph_api
 
 #endif /* SCGRAPHAPI_H_ */